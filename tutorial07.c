@@ -14,11 +14,24 @@
 //
 // to play the video.
 
+#ifdef __linux__
+#define _GNU_SOURCE /* CPU_SET, pthread_setaffinity_np */
+#endif
+
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libswscale/swscale.h>
 #include <libavutil/avstring.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/adler32.h>
+#include <libavutil/fifo.h>
+#include <libavcodec/avfft.h>
+#include <libavfilter/avfiltergraph.h>
+#include <libavfilter/avcodec.h>
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
 #include <libswresample/swresample.h>
 
 #include <SDL.h>
@@ -27,35 +40,158 @@
 #undef main /* Prevents SDL from overriding main() */
 #endif
 #include <stdio.h>
+#include <stddef.h>
 #include <math.h>
+#include <float.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
+#define AUDIO_BUFFER_MIN 128 /* samples */
+#define AUDIO_BUFFER_MAX 8192
+#define AUDIO_MAX_CALLBACKS_PER_SEC 200 /* sets the first device buffer size */
+#define AUDIO_UNDERRUN_LIMIT 2   /* underruns within AUDIO_UNDERRUN_WINDOW ... */
+#define AUDIO_UNDERRUN_WINDOW 5000000 /* ... double the device buffer */
+#define AUDIO_SETTLE_TIME 500000 /* a device just (re)started gets to stutter */
+#define AUDIO_LEAD_WINDOW 256    /* callbacks the lowest lead is kept for */
+#define MAX_MIX_TRACKS 8
+#define MIX_FIFO_TIME 0.5        /* seconds of decoded audio per mixed track */
+#define MIX_SYNC_THRESHOLD 0.04  /* seconds a mixed track may be off */
+#define MIX_GAIN_BITS 14         /* fixed point gains, so under 2.0 */
+#define VIS_WIDTH 640
+#define VIS_HEIGHT 360
+#define VIS_FPS 60
+#define VIS_FFT_BITS 11          /* 2048 samples, 23 Hz bins at 48 kHz */
+#define VIS_FFT_SIZE (1 << VIS_FFT_BITS)
+#define VIS_RING_SIZE 65536      /* mono samples, a power of two */
+#define VIS_WAVE_SECONDS 4       /* across the waveform */
+#define VIS_MIN_FREQ 20.0
+#define VIS_RANGE_DB 90.0
+#define MAX_FILTER_STAGES 16
+#define FILTER_QUEUE_SIZE 4      /* decoded pictures waiting for the filters */
 #define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
 #define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
+/* a mixed track's queue past this is dropped from rather than grown,
+   the track resyncs over the gap */
+#define MAX_MIXQ_SIZE (4 * MAX_AUDIOQ_SIZE)
 #define AV_SYNC_THRESHOLD 0.01
 #define AV_NOSYNC_THRESHOLD 10.0
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 #define AUDIO_DIFF_AVG_NB 20
-#define FF_ALLOC_EVENT   (SDL_USEREVENT)
 #define FF_REFRESH_EVENT (SDL_USEREVENT + 1)
 #define FF_QUIT_EVENT (SDL_USEREVENT + 2)
-#define VIDEO_PICTURE_QUEUE_SIZE 1
+#define FF_VIS_EVENT (SDL_USEREVENT + 3)
+#define FF_STEP_EVENT (SDL_USEREVENT + 4)
+#define VIDEO_PICTURE_QUEUE_SIZE 4
 #define DEFAULT_AV_SYNC_TYPE AV_SYNC_VIDEO_MASTER
 #define MAX_AUDIO_FRAME_SIZE 192000
 #define SUBPICTURE_QUEUE_SIZE 1
+#define FAST_PROBESIZE (256 * 1024)
+#define FAST_ANALYZE_DURATION (AV_TIME_BASE / 2)
+#define STREAMINFO_CACHE_MAGIC "tutorial07-streaminfo 1"
+#define STREAMINFO_MAX_EXTRADATA (1 << 20) /* bytes, more is a corrupt cache */
+#define STREAMINFO_MAX_CHANNELS 64
+#define LIVE_PROBESIZE (32 * 1024)
+#define LIVE_ANALYZE_DURATION (AV_TIME_BASE / 10)
+#define LIVE_DEFAULT_LATENCY 0.2
+#define LIVE_CATCHUP_THRESHOLD 0.05 /* seconds over target before speeding up */
+#define LIVE_DROP_THRESHOLD 1.0 /* seconds over target before dropping to a keyframe */
+#define LIVE_SPEEDUP_PERCENT 5
+#define LIVE_REPORT_INTERVAL 2000000
+#define MPOL_PREFERRED 1 /* from linux/mempolicy.h */
+#define TASK_POOL_MAX_WORKERS 64
+#define TASK_DEQUE_SIZE 256
+#define MAX_CONVERT_SLICES 16
+#define DIRTY_BAND_HEIGHT 16      /* rows per change detection hash */
+#define MAX_DIRTY_BANDS 288        /* pictures up to 4608 rows are hashed */
+#define MIN_CONVERT_SLICE_HEIGHT 64
+#define MEM_THROTTLE_DELAY 10 /* ms the demuxer waits while over budget */
+#define SPEC_CACHE_SIZE 4        /* one per seek key */
+#define SPEC_POLL_INTERVAL 100   /* ms between speculation rounds */
+#define SPEC_TOLERANCE 0.5       /* s, when the file has no index */
+#define SPEC_MAX_PACKETS 1000    /* give up on a target after this many */
+#define GOP_CACHE_DEFAULT 256    /* MiB of decoded GOPs for frame stepping */
+#define SIM_DRAIN_DELAY 100      /* ms for the last picture before -simulate ends */
+#define FILE_SINK_BUFFER_SIZE (4 * 1024 * 1024)
+#define FILE_SINK_ALIGN 4096     /* every write() is a multiple of this */
+#define SHM_RING_SLOTS 8
+#define SHM_RING_MAGIC "TUT7RING"
+#define ANALYSIS_QUEUE_SIZE 64   /* results in flight per media type */
+#define ANALYSIS_AUDIO_SLOT_SIZE (64 * 1024) /* preallocated samples per audio job */
+#define BLACK_PIXEL_MAX 32       /* luma at or below counts as black */
+#define BLACK_RATIO 0.98         /* of the pixels, for a black frame */
+#define FREEZE_MAX_DIFF 0.5      /* mean abs luma change of a frozen frame */
+#define SILENCE_DB -60.0
+#define MAX_RENDITIONS 8
+#define CLIP_IO_BUFFER_SIZE (4 * 1024 * 1024)
+#define THUMB_MAX_SCALES 8       /* decoded keyframes waiting per file */
+#define THUMB_JPEG_QSCALE 3      /* 2 (best) to 31 */
 
 typedef struct PacketQueue {
 	AVPacketList *first_pkt, *last_pkt;
 	int nb_packets;
 	int size;
+	int abort_request;
 	SDL_mutex *mutex;
 	SDL_cond *cond;
 } PacketQueue;
+/* A decoder output buffer we allocate ourselves (see our_get_buffer), so
+   the picture queue can keep a reference to it after the decoder is done
+   and convert it only when it is actually displayed. The planes are
+   laid out in a block that is kept across frames and reused for any
+   picture size that fits it. */
+typedef struct FrameBuffer {
+	uint8_t *data[4];
+	int linesize[4];
+	int w, h;
+	enum PixelFormat pix_fmt;
+	int refcount;
+	int size;     /* of block */
+	int charged;  /* to the memory governor: the picture, not the page rounding */
+	uint64_t pts; /* global_video_pkt_pts at allocation time */
+	uint8_t *block;
+	int mapping;  /* FRAME_BLOCK_*, how block was allocated */
+	struct FrameBuffer *next; /* free list */
+} FrameBuffer;
+
+enum {
+	FRAME_BLOCK_MALLOC,
+	FRAME_BLOCK_HUGETLB, /* from the reserved hugepages */
+	FRAME_BLOCK_THP,     /* transparent hugepages, if the kernel obliges */
+};
+
+/* -framepool */
+enum {
+	FRAME_POOL_OFF,      /* libavcodec's buffers, pictures get copied */
+	FRAME_POOL_ALIGNED,
+	FRAME_POOL_HUGE,
+};
+
 typedef struct VideoPicture {
-	SDL_Overlay *bmp;
+	FrameBuffer *buf;  /* reference held by the queue, or NULL */
+	AVPicture pict;    /* decoded picture, in buf or in a private copy */
+	int copied;        /* pict was copied out of a decoder-owned buffer */
+	int copy_size;     /* bytes of that copy */
 	int width, height; /* source height & width */
-	int allocated;
+	enum PixelFormat pix_fmt;
+	AVRational sample_aspect_ratio; /* num 0: the stream's */
+	AVFilterBufferRef *picref; /* reference held by the queue, from -vf */
 	double pts;
+	uint64_t band_hash[MAX_DIRTY_BANDS]; /* see picture_hash_bands */
+	int nb_bands;      /* 0: not hashed */
 } VideoPicture;
 
 typedef struct AudioParams{
@@ -65,87 +201,605 @@ typedef struct AudioParams{
 	enum AVSampleFormat fmt;
 }AudioParams;
 
+/* An audio stream mixed into the played one, see -mix. Its thread
+   decodes and resamples to audio_tgt into fifo, audio_callback takes
+   what it plays from there. */
+typedef struct MixTrack {
+	struct VideoState *is;
+	int stream_index;
+	AVStream *st;
+	double gain;
+	int gain_q;          /* gain << MIX_GAIN_BITS */
+	PacketQueue q;
+	SDL_Thread *tid;
+	struct SwrContext *swr_ctx;
+	AudioParams src;
+	AVFifoBuffer *fifo;  /* guarded by mutex */
+	AudioParams tgt;     /* the format fifo holds, guarded by mutex */
+	int tgt_gen;         /* bumped by mix_retarget, guarded by mutex */
+	double end_pts;      /* of the last sample in fifo, NAN if unknown */
+	int flushing;        /* drop what is decoded until the flush packet */
+	int quit;
+	SDL_mutex *mutex;
+	SDL_cond *cond;      /* the callback made room, or we quit */
+	uint8_t *buf;        /* the callback reads fifo into this */
+	int64_t decode_time; /* decoding and resampling */
+	int64_t samples_mixed;
+	int shortfalls, resyncs;
+	int dropped;         /* packets over MAX_MIXQ_SIZE, decode_thread only */
+} MixTrack;
+
+/* One filter of -vf in a graph of its own, so it can be timed by
+   itself: buffer -> the filter -> ffbuffersink */
+typedef struct FilterStage {
+	const char *desc;
+	AVFilterGraph *graph;  /* NULL: set up with the next picture */
+	AVFilterContext *src, *sink;
+	int w, h, format;      /* of the pictures it was set up for */
+	int failed;            /* reported already */
+	int frames_in, frames_out;
+	int64_t time;          /* in the filter, not waiting for the next */
+} FilterStage;
+
+/* -vf runs in filter_thread, between video_thread and the picture
+   queue. queue holds references to decoded pictures, a NULL is a seek. */
+typedef struct VideoFilter {
+	char *desc;            /* -vf, cut up into the stages */
+	FilterStage stages[MAX_FILTER_STAGES];
+	int nb_stages;
+	AVFilterBufferRef *queue[FILTER_QUEUE_SIZE];
+	int rindex, windex, size;
+	int eof;               /* video_thread is done */
+	int done;              /* filter_thread is */
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	SDL_Thread *tid;
+} VideoFilter;
+
 typedef struct SubPicture {
     double pts; /* presentation time stamp for this picture */
     AVSubtitle sub;
+    int mem_size; /* bitmaps and palettes */
 } SubPicture;
 
+/* A picture decoded ahead of time for a likely seek target */
+typedef struct SpecEntry {
+	int stream;        /* video stream it was decoded from, -1 if unused */
+	double lo, hi;     /* seek targets that land on this picture */
+	AVPicture pict;    /* NULL data if the target could not be decoded */
+	int width, height;
+	enum PixelFormat pix_fmt;
+	int size;
+	double pts;
+} SpecEntry;
+
+/* A set of tasks that something waits for, e.g. all slices of a frame.
+   When the last one finishes, then_func (if any) is queued in
+   next_group: that is how a frame's later stage depends on an earlier
+   one. */
+typedef struct TaskGroup {
+	int pending; /* submitted but not finished, under the pool mutex */
+	struct TaskGroup *next_group;
+	void (*then_func)(void *arg);
+	void *then_arg;
+} TaskGroup;
+
+typedef struct GopFrame {
+	AVPicture pict;
+	double pts;
+} GopFrame;
+
+/* Every picture from one keyframe up to (not including) the next, in
+   display order, for frame stepping */
+typedef struct Gop {
+	double start, end; /* pts of its keyframe and of the next one */
+	GopFrame *frames;
+	int nb_frames;
+	int width, height;
+	enum PixelFormat pix_fmt;
+	int64_t size;
+	struct Gop *next;  /* LRU list, most recently used first */
+} Gop;
+
+#define CACHE_LINE 64
+#define FRAME_ALIGN 64              /* of every plane and line of our frame buffers */
+#define FRAME_POOL_GRANULE (64 * 1024) /* size classes of the frame buffer blocks */
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
+
+/* Shared fields read without a lock. Stores release and loads acquire,
+   so what a thread wrote before a store (seek_pos before seek_req, a
+   picture before pictq_size) is there for the thread that loads it.
+   A double clock is loaded whole, never half old and half new. */
+#define atomic_get(p)    __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_set(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_add(p, v) __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+/* Where each side stores one flag and then loads the other's
+   (refresh_running against video_st), acquire and release would let
+   both loads miss both stores: those go sequentially consistent. */
+#define atomic_get_sc(p)     __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define atomic_set_sc(p, v)  __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_xchg_sc(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+static inline double clock_get(double *p) {
+	double v;
+	__atomic_load(p, &v, __ATOMIC_ACQUIRE);
+	return v;
+}
+
+static inline void clock_set(double *p, double v) {
+	__atomic_store(p, &v, __ATOMIC_RELEASE);
+}
 
+/* The fields are grouped by the thread that writes them, each group in
+   cache lines of its own, so one thread updating its state doesn't
+   keep taking the lines another is reading away from it. The fields
+   marked atomic are read by other threads without a lock; those reads
+   and every write go through atomic_get/atomic_set or
+   clock_get/clock_set. */
 typedef struct VideoState {
-	AVFormatContext *pFormatCtx;
-	int             videoStream, audioStream, subtitleStream;
-
-	int             av_sync_type;
-	double          external_clock; /* external clock base */
-	int64_t         external_clock_time;
-	int             seek_req;
-	int             seek_flags;
-	int64_t         seek_pos;
-
-	double          audio_clock;
-	AVStream        *audio_st;
+	/* set up before the other threads start, read by all; quit and the
+	   seek request are written rarely */
+	struct CACHE_ALIGNED {
+		AVFormatContext *pFormatCtx;
+		int             videoStream, audioStream, subtitleStream;
+		AVStream        *audio_st;
+		AVStream        *video_st;     /* atomic, stored with atomic_set_sc, see refresh_start */
+		AVStream        *subtitle_st;
+		int             av_sync_type;
+		int             quit;          /* atomic */
+		int             refresh_running; /* atomic, see refresh_start */
+		int             seek_req;      /* atomic, published after seek_pos and seek_flags */
+		int             seek_flags;
+		int64_t         seek_pos;
+		int             switch_req;    /* atomic, published after switch_type and switch_stream */
+		int             switch_type;   /* AVMediaType of the track being switched */
+		int             switch_stream; /* new stream index, -1 turns subtitles off */
+		SDL_mutex       *switch_mutex; /* held across a switch and while pictures are shown */
+		double          external_clock; /* external clock base */
+		int64_t         external_clock_time;
+	};
+
+	/* the audio callback */
+	struct CACHE_ALIGNED {
+		double          audio_clock;     /* atomic */
+		unsigned int    audio_buf_size;  /* atomic */
+		unsigned int    audio_buf_index; /* atomic */
+		uint8_t         *audio_buf;
+		uint8_t         *audio_buf1;
+		unsigned int    audio_buf1_size;
+		AVPacket        audio_pkt;
+		uint8_t         *audio_pkt_data;
+		int             audio_pkt_size;
+		int             audio_drain_item;   /* playlist item to enter once the decoder is empty, or -1 */
+		int             audio_hw_buf_size;  
+		int             audio_samples;      /* device buffer size in samples */
+		int             audio_resize_req;   /* atomic, samples for decode_thread to reopen with */
+		/* output latency, see audio_output_update */
+		int64_t         audio_write_time;   /* atomic, start of the last callback */
+		double          audio_write_clock;  /* atomic, pts at the end of what it wrote */
+		double          audio_latency;      /* atomic, until that has been played */
+		int64_t         audio_lead_time;    /* when audio_lead_bytes started counting */
+		int64_t         audio_lead_bytes;   /* handed to the device since then */
+		double          audio_lead_min, audio_lead_next; /* this and the next window */
+		int             audio_lead_count;
+		int64_t         audio_settle_time;
+		int64_t         audio_underrun_time; /* start of the current underrun window */
+		int             audio_window_underruns;
+		int             audio_underruns, audio_reopens;
+		double          audio_latency_sum, audio_latency_min, audio_latency_max;
+		int             audio_latency_count;
+		double          audio_diff_cum; /* used for AV difference average computation */
+		double          audio_diff_avg_coef;
+		double          audio_diff_threshold;
+		int             audio_diff_avg_count;
+		AudioParams     audio_src;
+		AudioParams     audio_tgt;
+		struct SwrContext *swr_ctx;
+		int             audio_thread_placed; /* SDL's audio thread got its placement */
+		int             audio_callbacks;
+		int             audio_corrections;
+		int64_t         audio_samples_added, audio_samples_removed;
+		AVFrame         audio_frame;
+		//uint8_t         audio_buf[(MAX_AUDIO_FRAME_SIZE* 3) / 2];
+		uint8_t         silence_buf[SDL_AUDIO_BUFFER_SIZE];
+	};
+
+	/* video_thread */
+	struct CACHE_ALIGNED {
+		double          video_clock; ///<pts of last decoded frame / predicted pts of next decoded frame
+		FrameBuffer     *buffer_pool;
+		SDL_mutex       *buffer_pool_mutex;
+		int             pool_allocs, pool_hugetlb, pool_thp; /* blocks allocated */
+		int             pool_reuses, pool_resizes; /* resizes: reused for another size */
+		int             video_frames_decoded;
+		int64_t         video_decode_time;
+	};
+
+	/* what fills the picture queue: video_thread, or filter_thread
+	   with -vf; the other threads read the statistics */
+	struct CACHE_ALIGNED {
+		int             pictq_windex;
+		int             pictures_hashed; /* atomic */
+		int64_t         hash_time;       /* atomic */
+	};
+
+	/* the main thread: display and the refresh timer */
+	struct CACHE_ALIGNED {
+		double          frame_timer;
+		double          frame_last_pts;
+		double          frame_last_delay;
+		double          video_current_pts; ///<current displayed pts (different from video_clock if frame fifos are used), atomic
+		int64_t         video_current_pts_time;  ///<time (av_gettime) at which we updated video_current_pts - used to have running video pts, atomic
+		int             pictq_rindex;
+		int             frames_converted;
+		int             frames_copied;   /* YUV420P already, no sws_scale */
+		int             frames_dropped;
+		int64_t         sim_refresh_time; /* virtual time of the next refresh */
+		/* a/v sync statistics */
+		double          sync_drift_sum, sync_drift_max; /* audio - video at display */
+		int             sync_drift_count;
+		int             frames_repeated; /* shown twice as long to wait for the master */
+		int             frames_skipped;  /* shown without delay to catch up */
+		int             refreshes;       /* refresh timer events handled */
+		/* the picture in a sink that keeps it, see video_display_picture */
+		uint64_t        shown_hash[MAX_DIRTY_BANDS];
+		int             shown_bands;     /* 0: unknown, convert it all */
+		int             static_skipped, static_partial;
+		int64_t         bands_converted, bands_partial; /* of the partly changed */
+	};
+
+	/* the picture queue, between video_thread (filter_thread with -vf)
+	   and the main thread */
+	struct CACHE_ALIGNED {
+		int             pictq_size;    /* atomic, changed under pictq_mutex */
+		SDL_mutex       *pictq_mutex;
+		SDL_cond        *pictq_cond;
+	};
+	VideoPicture    pictq[VIDEO_PICTURE_QUEUE_SIZE];
+
+	/* each has its own lock */
 	PacketQueue     audioq;
-	AVFrame         audio_frame;
-	//uint8_t         audio_buf[(MAX_AUDIO_FRAME_SIZE* 3) / 2];
-	uint8_t         *audio_buf;
-	uint8_t         *audio_buf1;
-	unsigned int    audio_buf_size;
-	unsigned int    audio_buf1_size;
-	unsigned int    audio_buf_index;
-	AVPacket        audio_pkt;
-	uint8_t         *audio_pkt_data;
-	int             audio_pkt_size;
-	int             audio_hw_buf_size;  
-	double          audio_diff_cum; /* used for AV difference average computation */
-	double          audio_diff_avg_coef;
-	double          audio_diff_threshold;
-	int             audio_diff_avg_count;
-	AudioParams     audio_src;
-	AudioParams     audio_tgt;
-	struct SwrContext *swr_ctx;
-	double          frame_timer;
-	double          frame_last_pts;
-	double          frame_last_delay;
-	double          video_clock; ///<pts of last decoded frame / predicted pts of next decoded frame
-	double          video_current_pts; ///<current displayed pts (different from video_clock if frame fifos are used)
-	int64_t         video_current_pts_time;  ///<time (av_gettime) at which we updated video_current_pts - used to have running video pts
-	AVStream        *video_st;
 	PacketQueue     videoq;
-	VideoPicture    pictq[VIDEO_PICTURE_QUEUE_SIZE];
-	int             pictq_size, pictq_rindex, pictq_windex;
-	//subtitle
 	PacketQueue     subtitleq;
-	AVStream        *subtitle_st;
+
+	//subtitle
     SubPicture subpq[SUBPICTURE_QUEUE_SIZE];
 	int subpq_size, subpq_rindex, subpq_windex;
 	SDL_mutex *subpq_mutex;
 	SDL_cond *subpq_cond;
 
-	SDL_mutex       *pictq_mutex;
-	SDL_cond        *pictq_cond;
 	SDL_Thread      *parse_tid;
 	SDL_Thread      *video_tid;
 	SDL_Thread      *subtitle_tid;
 
 	char            filename[1024];
-	int             quit;
 
-	AVIOContext     *io_context;
-	struct SwsContext *sws_ctx;
+	struct SwsContext *sws_ctx[MAX_CONVERT_SLICES]; /* one per slice, see video_display */
+
+	/* startup instrumentation, all in av_gettime() units */
+	int             streaminfo_cached;
+	int64_t         open_done_time;
+	int64_t         probe_done_time;
+	int64_t         first_video_time;
+	int64_t         first_audio_time;
+
+	/* live mode jitter buffer, written by decode_thread; the flags go
+	   through atomic_get/set and the doubles through clock_get/set */
+	int             live_buffering;  /* still filling up to live_latency */
+	int64_t         live_first_ts;   /* AV_NOPTS_VALUE until the first master packet */
+	double          live_buffered;   /* demuxed but not yet played, seconds */
+	double          live_clock_offset; /* min(arrival - pts), maps pts to arrival time */
+	int             live_have_offset;
+	int64_t         live_report_time;
+	double          live_latency_last; /* written by the main thread */
+	double          live_latency_max;
+	double          live_latency_sum;
+	int             live_latency_count;
+	int             live_speedups;
+	int             live_keyframe_drops;
+
+	/* speculative pre-decode of the seek targets */
+	SDL_Thread      *spec_tid;
+	SDL_mutex       *spec_mutex;
+	SpecEntry       spec_cache[SPEC_CACHE_SIZE];
+	int             spec_quit;     /* atomic */
+	int             spec_decoded;
+
+	/* seek-to-display instrumentation */
+	int             seek_display_pending;
+	int             seek_display_hit;
+	double          seek_from, seek_to;
+	int64_t         seek_start_time;
+	int             seek_count, seek_hits;
+	double          seek_hit_latency, seek_miss_latency; /* sums */
+
+	/* frame stepping: step_mode is the main thread's, the rest belongs
+	   to step_task on the task pool, except what is under step_mutex */
+	int             step_mode;
+	SDL_mutex       *step_mutex;
+	int             step_requests; /* directions not stepped yet, step_mutex */
+	int             step_busy;     /* step_task is queued or running, step_mutex */
+	TaskGroup       step_group;
+	Gop             *step_gop;     /* picture to show, step_mutex */
+	int             step_index;
+	double          step_pts;      /* picture on screen, step_mutex */
+	double          step_shift;    /* playlist_shift of step_item, step_mutex */
+	AVFormatContext *step_fmt;     /* our own demuxer for decoding GOPs */
+	int             step_stream;   /* stream whose decoder is open, or -1 */
+	AVFrame         *step_frame;
+	Gop             *gop_cache;    /* changed under step_mutex */
+	int64_t         gop_cache_size;
+	int             steps;
+	int             gop_hits, gop_misses, gop_evictions;
+	int64_t         gop_decode_time;
+	int             step_item;
+
+	/* playlist position of the demuxer and of each decoder; the
+	   decoders follow through the item markers in their queues */
+	int             demux_item;
+	int             audio_item, video_item, subtitle_item;
+	double          demux_end; /* playlist time of the end of the last packet */
+	int             spec_item;
+
+	int             demux_ready; /* streams are open, reading packets */
+	int             eof;         /* the demuxer has nothing more to read */
+
+	/* -mix; the callback mixes the first mix_active tracks */
+	MixTrack        mix[MAX_MIX_TRACKS];
+	int             nb_mix;
+	int             mix_active;  /* atomic */
+
+	VideoFilter     vf;
 } VideoState;
 
+/* each group above starts a cache line of its own */
+_Static_assert(offsetof(VideoState, pFormatCtx) % CACHE_LINE == 0, "shared group is not line aligned");
+_Static_assert(offsetof(VideoState, audio_clock) % CACHE_LINE == 0, "audio group is not line aligned");
+_Static_assert(offsetof(VideoState, video_clock) % CACHE_LINE == 0, "video_thread group is not line aligned");
+_Static_assert(offsetof(VideoState, pictq_windex) % CACHE_LINE == 0, "picture producer group is not line aligned");
+_Static_assert(offsetof(VideoState, frame_timer) % CACHE_LINE == 0, "main thread group is not line aligned");
+_Static_assert(offsetof(VideoState, pictq_size) % CACHE_LINE == 0, "picture queue group is not line aligned");
+_Static_assert(offsetof(VideoState, pictq) % CACHE_LINE == 0, "picture queue group does not fill its lines");
+
+/* For alignments av_malloc doesn't give, it aligns for SIMD only */
+static void *memalign_alloc(size_t align, size_t size) {
+	void *p;
+
+#ifdef _WIN32
+	p = _aligned_malloc(size, align);
+#else
+	if(posix_memalign(&p, align, size))
+		p = NULL;
+#endif
+	return p;
+}
+
+static void memalign_free(void *p) {
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+/* the groups above need whole lines */
+static VideoState *video_state_alloc(void) {
+	void *p = memalign_alloc(CACHE_LINE, sizeof(VideoState));
+
+	if(p)
+		memset(p, 0, sizeof(VideoState));
+	return p;
+}
+
+static void video_state_free(VideoState **is) {
+	memalign_free(*is);
+	*is = NULL;
+}
+
+/* One entry of the playlist. Every item after the first is opened,
+   probed and has its decoders opened on a background thread while the
+   one before it plays. */
+typedef struct PlaylistItem {
+	const char *filename;
+	AVFormatContext *fmt;
+	int video_index, audio_index, subtitle_index;
+	double shift;           /* added to its timestamps to get playlist time */
+	SDL_Thread *prepare_tid;
+	int prepared;           /* 1 when ready, -1 if it can't be played */
+	int gapless;            /* 0: the decoders were closed and reopened */
+	int64_t prepare_time;   /* spent opening in the background */
+	int64_t wait_time;      /* the demuxer waited for it at the end of the previous item */
+	int64_t eof_time;       /* the previous item ran out */
+	int64_t audio_switch_time, audio_first_time;
+	int64_t video_switch_time, video_first_time;
+} PlaylistItem;
+
 enum {
 	AV_SYNC_AUDIO_MASTER,
 	AV_SYNC_VIDEO_MASTER,
 	AV_SYNC_EXTERNAL_MASTER,
 };
 
+enum {
+	THREAD_ROLE_MAIN,
+	THREAD_ROLE_DECODE,
+	THREAD_ROLE_VIDEO,
+	THREAD_ROLE_SUBTITLE,
+	THREAD_ROLE_AUDIO,
+	THREAD_ROLE_WORKER,
+	THREAD_ROLE_SPECULATE,
+	THREAD_ROLE_NB
+};
+
+enum {
+	THREAD_SCHED_DEFAULT,
+	THREAD_SCHED_RT,   /* SCHED_FIFO with the given priority */
+	THREAD_SCHED_NICE, /* SCHED_OTHER with the given nice value */
+};
+
+/* Where and how a pipeline thread runs, from -affinity/-priority/-numa */
+typedef struct ThreadPlacement {
+	char cpus[128];    /* cpu list such as "0-3,8", empty for any */
+	int sched;
+	int priority;
+	int numa_node;     /* preferred memory node, -1 for the default policy */
+} ThreadPlacement;
+
+static const char *thread_role_names[THREAD_ROLE_NB] = {
+	"main", "decode", "video", "subtitle", "audio", "worker", "speculate"
+};
+
+typedef struct Task {
+	void (*func)(void *arg);
+	void *arg;
+	TaskGroup *group;
+} Task;
+
+/* Each worker pushes and pops at the bottom of its own deque, idle
+   workers steal from the top of the others. Under the pool mutex, so
+   queued always agrees with what the deques hold. */
+typedef struct TaskDeque {
+	Task tasks[TASK_DEQUE_SIZE];
+	int top, bottom;
+} TaskDeque;
+
+typedef struct TaskWorker {
+	struct TaskPool *pool;
+	int index;
+	SDL_Thread *tid;
+	Uint32 thread_id;         /* atomic, 0 until the worker is running */
+	TaskDeque deque;
+	int64_t busy_time;
+	int tasks_run;
+	int steals;
+} TaskWorker;
+
+typedef struct TaskPool {
+	TaskWorker workers[TASK_POOL_MAX_WORKERS];
+	int nb_workers;
+	unsigned int next_worker; /* round robin for submissions from outside */
+	int queued;               /* tasks sitting in any deque */
+	int tasks_helped;         /* run by threads waiting on a group */
+	int quit;
+	int64_t start_time;
+	SDL_mutex *mutex;         /* the deques, queued, quit and all TaskGroups */
+	SDL_cond *work_cond;
+	SDL_cond *done_cond;
+} TaskPool;
+
+
 SDL_Surface     *screen;
 
 /* Since we only have one decoding thread, the Big Struct
    can be global in case we need it. */
 VideoState *global_video_state;
 AVPacket flush_pkt;
+AVPacket item_pkt; /* pos is the playlist item the packets after it belong to */
+
+PlaylistItem *playlist;
+int playlist_size;
+
+/* command line options */
+static const char *input_filename = NULL;
+static int fast_start = 0;
+static int skip_static = 1; /* -allframes turns it off */
+static int frame_pool_mode = FRAME_POOL_HUGE;
+static int audio_buffer_samples = 0; /* 0 adapts the size to underruns */
+static const char *mix_spec = NULL;
+static int vis_mode = 0;
+static const char *vfilter_desc = NULL;
+static const char *cache_dir = NULL;
+static int live_mode = 0;
+static double live_latency = LIVE_DEFAULT_LATENCY;
+static ThreadPlacement thread_placement[THREAD_ROLE_NB] = {
+	{ "", THREAD_SCHED_DEFAULT, 0, -1 },
+	{ "", THREAD_SCHED_DEFAULT, 0, -1 },
+	{ "", THREAD_SCHED_DEFAULT, 0, -1 },
+	{ "", THREAD_SCHED_DEFAULT, 0, -1 },
+	{ "", THREAD_SCHED_DEFAULT, 0, -1 },
+	{ "", THREAD_SCHED_DEFAULT, 0, -1 },
+	{ "", THREAD_SCHED_NICE, 10, -1 }, /* speculation must not slow playback */
+};
+static int thread_placement_set = 0;
+static int task_workers = -1; /* -1: one per cpu */
+static int speculate = 0;
+static int64_t gop_cache_limit = (int64_t)GOP_CACHE_DEFAULT * 1024 * 1024;
+static int simulate = 0;
+static int segments = -1; /* -segments n, -1: play normally */
+static const char *framecrc_file = NULL;
+static int64_t clip_start, clip_end; /* -clip, AV_TIME_BASE units */
+static const char *clip_output = NULL;
+static int clip_smart = 0;
+static double thumb_interval = 0; /* -thumbs, 0: play normally */
+static int thumb_width = 160, thumb_height = 0;
+static int thumb_cols = 10, thumb_rows = 10;
+static const char *thumb_dir = ".";
+static const char *analyze_file = NULL;
+
+/* the offsets the arrow keys seek by, see main */
+static const double spec_offsets[SPEC_CACHE_SIZE] = { -10.0, 10.0, 60.0, -60.0 };
+
+/* What the memory governor accounts for */
+enum {
+	MEM_PACKETS,   /* demuxed packets in the queues */
+	MEM_FRAMES,    /* decoder frame buffer pool */
+	MEM_PICTURES,  /* picture copies and the overlay */
+	MEM_AUDIO,     /* resampled audio */
+	MEM_SUBTITLES, /* decoded subtitle bitmaps */
+	MEM_GOPS,      /* frame stepping cache */
+	MEM_NB
+};
+
+static const char *mem_names[MEM_NB] = {
+	"packets", "frame buffers", "pictures", "audio", "subtitles", "gop cache"
+};
+
+/* One budget for the whole process. Allocations are charged as they
+   happen and never fail because of it; instead the demuxer stops
+   reading while the total is over budget, which drains the pipeline. */
+typedef struct MemGovernor {
+	int64_t budget; /* bytes, 0 for no limit */
+	int64_t used[MEM_NB];
+	int64_t peak[MEM_NB];
+	int64_t total, total_peak;
+	int throttles;  /* times the demuxer had to wait */
+	int64_t throttle_time;
+	int64_t report_interval, report_time;
+	SDL_mutex *mutex;
+} MemGovernor;
+
+MemGovernor mem_governor;
+
+/* shared by every stage; NULL runs all tasks inline */
+TaskPool *task_pool;
+
+/* av_gettime() at the top of main, for time-to-first-frame */
+int64_t program_start_time;
+
+/* The clock the sync code runs on. -simulate swaps in a virtual one
+   that only moves when simulate_run says so. */
+static int64_t sim_time, sim_start_time, sim_wall_time;
+static int64_t sim_gettime(void) {
+	return sim_time;
+}
+static int64_t (*clock_now)(void) = av_gettime;
+
+/* Stands in for the SDL audio device with -simulate: simulate_run calls
+   the callback whenever the virtual clock reaches next_time. */
+typedef struct SimAudio {
+	SDL_mutex *mutex; /* held while the callback runs */
+	int open, paused;
+	SDL_AudioSpec spec;
+	uint8_t *buf;     /* spec.size bytes the callback writes into */
+	int64_t start_time; /* virtual time the device (re)started at */
+	int64_t played;     /* bytes handed out since start_time */
+	int64_t next_time;
+	int64_t callbacks;
+} SimAudio;
+
+SimAudio sim_audio;
+static int audio_restarted; /* atomic, the device (re)started, see audio_output_update */
 
 #define ALPHA_BLEND(a, oldp, newp, s)\
 ((((oldp << s) * (255 - (a))) + (newp * (a))) / (255 << s))
@@ -380,10 +1034,86 @@ void packet_queue_init(PacketQueue *q) {
 	q->mutex = SDL_CreateMutex();
 	q->cond = SDL_CreateCond();
 }
+/* Called when a stream component is (re)opened on this queue */
+static void packet_queue_start(PacketQueue *q) {
+	SDL_LockMutex(q->mutex);
+	q->abort_request = 0;
+	SDL_UnlockMutex(q->mutex);
+}
+/* Wake up the consumer so it can leave packet_queue_get and exit */
+static void packet_queue_abort(PacketQueue *q) {
+	SDL_LockMutex(q->mutex);
+	q->abort_request = 1;
+	SDL_CondSignal(q->cond);
+	SDL_UnlockMutex(q->mutex);
+}
+/* Charge (or with a negative size, release) bytes to a subsystem */
+static void mem_charge(int type, int64_t size) {
+
+	MemGovernor *g = &mem_governor;
+
+	if(!size)
+		return;
+	SDL_LockMutex(g->mutex);
+	g->used[type] += size;
+	g->total += size;
+	if(g->used[type] > g->peak[type])
+		g->peak[type] = g->used[type];
+	if(g->total > g->total_peak)
+		g->total_peak = g->total;
+	SDL_UnlockMutex(g->mutex);
+}
+
+static int mem_over_budget(void) {
+	return mem_governor.budget && mem_governor.total >= mem_governor.budget;
+}
+
+/* resident set size in bytes, or -1 if unknown */
+static int64_t mem_rss(void) {
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/statm", "r");
+	long pages, resident;
+	int n;
+
+	if(!f)
+		return -1;
+	n = fscanf(f, "%ld %ld", &pages, &resident);
+	fclose(f);
+	if(n != 2)
+		return -1;
+	return (int64_t)resident * sysconf(_SC_PAGESIZE);
+#else
+	return -1;
+#endif
+}
+
+static void mem_print_usage(const char *prefix, int peak) {
+
+	MemGovernor *g = &mem_governor;
+	int64_t rss = mem_rss();
+	int i;
+
+	SDL_LockMutex(g->mutex);
+	printf("%s%.1f MiB", prefix,
+			(peak ? g->total_peak : g->total) / (1024.0 * 1024.0));
+	if(g->budget)
+		printf(" of %.1f MiB", g->budget / (1024.0 * 1024.0));
+	for(i = 0; i < MEM_NB; i++)
+		printf(", %s %.1f", mem_names[i],
+				(peak ? g->peak[i] : g->used[i]) / (1024.0 * 1024.0));
+	if(rss >= 0)
+		printf(", rss %.1f MiB", rss / (1024.0 * 1024.0));
+	printf("\n");
+	SDL_UnlockMutex(g->mutex);
+}
+
+#define PACKET_MEM_SIZE(pkt1) ((int64_t)(pkt1)->pkt.size + sizeof(AVPacketList))
+
 int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
 
 	AVPacketList *pkt1;
-	if(pkt != &flush_pkt && av_dup_packet(pkt) < 0) {
+	if(pkt->data != flush_pkt.data && pkt->data != item_pkt.data &&
+			av_dup_packet(pkt) < 0) {
 		return -1;
 	}
 	pkt1 = av_malloc(sizeof(AVPacketList));
@@ -404,6 +1134,7 @@ int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
 	SDL_CondSignal(q->cond);
 
 	SDL_UnlockMutex(q->mutex);
+	mem_charge(MEM_PACKETS, PACKET_MEM_SIZE(pkt1));
 	return 0;
 }
 static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
@@ -415,7 +1146,7 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
 
 	for(;;) {
 
-		if(global_video_state->quit) {
+		if(atomic_get(&global_video_state->quit) || q->abort_request) {
 			ret = -1;
 			break;
 		}
@@ -428,6 +1159,7 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
 			q->nb_packets--;
 			q->size -= pkt1->pkt.size;
 			*pkt = pkt1->pkt;
+			mem_charge(MEM_PACKETS, -PACKET_MEM_SIZE(pkt1));
 			av_free(pkt1);
 			ret = 1;
 			break;
@@ -447,6 +1179,7 @@ static void packet_queue_flush(PacketQueue *q) {
 	SDL_LockMutex(q->mutex);
 	for(pkt = q->first_pkt; pkt != NULL; pkt = pkt1) {
 		pkt1 = pkt->next;
+		mem_charge(MEM_PACKETS, -PACKET_MEM_SIZE(pkt));
 		av_free_packet(&pkt->pkt);
 		av_freep(&pkt);
 	}
@@ -457,6 +1190,115 @@ static void packet_queue_flush(PacketQueue *q) {
 	SDL_UnlockMutex(q->mutex);
 }
 
+/* Drop everything queued before the newest keyframe and put a flush_pkt
+   in front of it so the decoder starts over cleanly. Returns the pts of
+   that keyframe, or AV_NOPTS_VALUE if nothing could be dropped. */
+static int64_t packet_queue_drop_to_keyframe(PacketQueue *q) {
+	AVPacketList *pkt, *pkt1, *key = NULL, *flush;
+	int64_t key_pts = AV_NOPTS_VALUE;
+
+	flush = av_malloc(sizeof(AVPacketList));
+	if(!flush)
+		return AV_NOPTS_VALUE;
+
+	SDL_LockMutex(q->mutex);
+	for(pkt = q->first_pkt; pkt != NULL; pkt = pkt->next) {
+		if(pkt->pkt.flags & AV_PKT_FLAG_KEY)
+			key = pkt;
+	}
+	if(key && key != q->first_pkt) {
+		for(pkt = q->first_pkt; pkt != key; pkt = pkt1) {
+			pkt1 = pkt->next;
+			q->nb_packets--;
+			q->size -= pkt->pkt.size;
+			mem_charge(MEM_PACKETS, -PACKET_MEM_SIZE(pkt));
+			av_free_packet(&pkt->pkt);
+			av_free(pkt);
+		}
+		flush->pkt = flush_pkt;
+		flush->next = key;
+		q->first_pkt = flush;
+		q->nb_packets++;
+		mem_charge(MEM_PACKETS, PACKET_MEM_SIZE(flush));
+		key_pts = key->pkt.pts != AV_NOPTS_VALUE ? key->pkt.pts : key->pkt.dts;
+		flush = NULL;
+	}
+	SDL_UnlockMutex(q->mutex);
+
+	av_free(flush);
+	return key_pts;
+}
+
+/* Drop queued packets with a timestamp before ts (stream time base) */
+static int packet_queue_drop_before(PacketQueue *q, int64_t ts) {
+	AVPacketList *pkt;
+	int64_t pkt_ts;
+	int dropped = 0;
+
+	SDL_LockMutex(q->mutex);
+	while((pkt = q->first_pkt) != NULL) {
+		pkt_ts = pkt->pkt.pts != AV_NOPTS_VALUE ? pkt->pkt.pts : pkt->pkt.dts;
+		if(pkt->pkt.data == flush_pkt.data || pkt->pkt.data == item_pkt.data ||
+				pkt_ts == AV_NOPTS_VALUE || pkt_ts >= ts)
+			break;
+		q->first_pkt = pkt->next;
+		if(!q->first_pkt)
+			q->last_pkt = NULL;
+		q->nb_packets--;
+		q->size -= pkt->pkt.size;
+		mem_charge(MEM_PACKETS, -PACKET_MEM_SIZE(pkt));
+		av_free_packet(&pkt->pkt);
+		av_free(pkt);
+		dropped++;
+	}
+	SDL_UnlockMutex(q->mutex);
+	return dropped;
+}
+
+/* Tell the decoder that the packets from here on are from playlist item */
+static void packet_queue_put_item(PacketQueue *q, int item) {
+
+	AVPacket pkt = item_pkt;
+
+	pkt.pos = item;
+	packet_queue_put(q, &pkt);
+}
+
+static double playlist_shift(int item) {
+	return playlist_size > 1 ? playlist[item].shift : 0;
+}
+
+/* A decoder reached the marker of playlist item index: from now on it
+   decodes that item's stream, whose codec is already open. Returns the
+   stream, or NULL if it was already there (the marker after a seek). */
+static AVStream *playlist_enter(VideoState *is, int codec_type, int index) {
+
+	PlaylistItem *item = &playlist[index];
+	int64_t now = av_gettime();
+
+	switch(codec_type) {
+		case AVMEDIA_TYPE_AUDIO:
+			if(index == is->audio_item)
+				return NULL;
+			is->audio_item = index;
+			item->audio_switch_time = now;
+			return item->fmt->streams[item->audio_index];
+		case AVMEDIA_TYPE_VIDEO:
+			if(index == is->video_item)
+				return NULL;
+			is->video_item = index;
+			item->video_switch_time = now;
+			return item->fmt->streams[item->video_index];
+		case AVMEDIA_TYPE_SUBTITLE:
+			if(index == is->subtitle_item)
+				return NULL;
+			is->subtitle_item = index;
+			return item->fmt->streams[item->subtitle_index];
+		default:
+			return NULL;
+	}
+}
+
 static void packet_queue_destroy(PacketQueue *q)
 {
 	packet_queue_flush(q);
@@ -464,127 +1306,1405 @@ static void packet_queue_destroy(PacketQueue *q)
 	SDL_DestroyCond(q->cond);
 }
 
-double get_audio_clock(VideoState *is) {
-	double pts;
-	int hw_buf_size, bytes_per_sec, n;
+#ifdef __linux__
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
 
-	pts = is->audio_clock; /* maintained in the audio thread */
-	hw_buf_size = is->audio_buf_size - is->audio_buf_index;
-	bytes_per_sec = 0;
-	n = is->audio_st->codec->channels * 2;
-	if(is->audio_st) {
-		bytes_per_sec = is->audio_st->codec->sample_rate * n;
+	char *end;
+	long first, last;
+
+	CPU_ZERO(set);
+	while(*list) {
+		first = last = strtol(list, &end, 10);
+		if(end == list)
+			return -1;
+		if(*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if(end == list)
+				return -1;
+		}
+		if(first < 0 || last >= CPU_SETSIZE || first > last)
+			return -1;
+		for(; first <= last; first++)
+			CPU_SET(first, set);
+		if(*end == ',')
+			end++;
+		else if(*end)
+			return -1;
+		list = end;
 	}
-	if(bytes_per_sec) {
-		pts -= (double)hw_buf_size / bytes_per_sec;
+	return 0;
+}
+
+static void format_cpu_list(const cpu_set_t *set, char *buf, int size) {
+
+	int cpu, first;
+
+	buf[0] = 0;
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(!CPU_ISSET(cpu, set))
+			continue;
+		first = cpu;
+		while(cpu + 1 < CPU_SETSIZE && CPU_ISSET(cpu + 1, set))
+			cpu++;
+		if(buf[0])
+			av_strlcat(buf, ",", size);
+		if(first == cpu)
+			av_strlcatf(buf, size, "%d", cpu);
+		else
+			av_strlcatf(buf, size, "%d-%d", first, cpu);
 	}
-	return pts;
 }
-double get_video_clock(VideoState *is) {
-	double delta;
+#endif
+
+/* Called by each pipeline thread on entry: SDL_CreateThread takes no
+   attributes, so placement is applied from inside the thread. Memory
+   the thread touches first (packets in decode, frame buffers in video)
+   then comes from its preferred NUMA node. */
+static void thread_setup(int role) {
+
+	ThreadPlacement *tp = &thread_placement[role];
+#ifdef __linux__
+	pthread_t self = pthread_self();
+	pid_t tid = syscall(SYS_gettid);
+	struct sched_param param;
+	cpu_set_t set;
+	unsigned long nodemask;
+	char cpus[256], errors[256] = "";
+	int policy;
+
+	if(tp->cpus[0]) {
+		if(parse_cpu_list(tp->cpus, &set) < 0)
+			av_strlcatf(errors, sizeof(errors), ", bad cpu list %s", tp->cpus);
+		else if(pthread_setaffinity_np(self, sizeof(set), &set))
+			av_strlcatf(errors, sizeof(errors), ", affinity %s refused", tp->cpus);
+	}
+	if(tp->sched == THREAD_SCHED_RT) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = tp->priority;
+		if(pthread_setschedparam(self, SCHED_FIFO, &param))
+			av_strlcatf(errors, sizeof(errors), ", rt:%d refused", tp->priority);
+	} else if(tp->sched == THREAD_SCHED_NICE) {
+		if(setpriority(PRIO_PROCESS, tid, tp->priority))
+			av_strlcatf(errors, sizeof(errors), ", nice:%d refused", tp->priority);
+	}
+	if(tp->numa_node >= 0) {
+		nodemask = tp->numa_node < sizeof(nodemask) * 8 ? 1UL << tp->numa_node : 0;
+		if(!nodemask ||
+				syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8))
+			av_strlcatf(errors, sizeof(errors), ", numa node %d refused", tp->numa_node);
+	}
 
-	delta = (av_gettime() - is->video_current_pts_time) / 1000000.0;
-	return is->video_current_pts + delta;
+	if(!thread_placement_set)
+		return;
+
+	/* report what the kernel actually applied, not what was asked */
+	cpus[0] = 0;
+	if(!pthread_getaffinity_np(self, sizeof(set), &set))
+		format_cpu_list(&set, cpus, sizeof(cpus));
+	pthread_getschedparam(self, &policy, &param);
+	if(policy == SCHED_FIFO)
+		printf("thread %-8s tid %d: cpus %s, rt:%d", thread_role_names[role],
+				(int)tid, cpus, param.sched_priority);
+	else
+		printf("thread %-8s tid %d: cpus %s, nice:%d", thread_role_names[role],
+				(int)tid, cpus, getpriority(PRIO_PROCESS, tid));
+	if(tp->numa_node >= 0)
+		printf(", numa node %d", tp->numa_node);
+	printf("%s\n", errors);
+#else
+	if(thread_placement_set && (tp->cpus[0] || tp->sched || tp->numa_node >= 0))
+		printf("thread %s: placement is only supported on Linux\n",
+				thread_role_names[role]);
+#endif
 }
-double get_external_clock(VideoState *is) {
-	return av_gettime() / 1000000.0;
+
+static int deque_push(TaskDeque *d, const Task *task) {
+	if(d->bottom - d->top >= TASK_DEQUE_SIZE)
+		return -1;
+	d->tasks[d->bottom++ % TASK_DEQUE_SIZE] = *task;
+	return 0;
 }
-double get_master_clock(VideoState *is) {
-	if(is->av_sync_type == AV_SYNC_VIDEO_MASTER) {
-		return get_video_clock(is);
-	} else if(is->av_sync_type == AV_SYNC_AUDIO_MASTER) {
-		return get_audio_clock(is);
-	} else {
-		return get_external_clock(is);
+
+/* the owner takes its newest task: its data is most likely in cache */
+static int deque_pop(TaskDeque *d, Task *task) {
+	if(d->bottom <= d->top)
+		return 0;
+	*task = d->tasks[--d->bottom % TASK_DEQUE_SIZE];
+	return 1;
+}
+
+/* thieves take the oldest one, of group only if it is set */
+static int deque_steal(TaskDeque *d, Task *task, TaskGroup *group) {
+	int i;
+
+	for(i = d->top; i < d->bottom; i++)
+		if(!group || d->tasks[i % TASK_DEQUE_SIZE].group == group)
+			break;
+	if(i == d->bottom)
+		return 0;
+	*task = d->tasks[i % TASK_DEQUE_SIZE];
+	/* close the hole from the top side */
+	for(; i > d->top; i--)
+		d->tasks[i % TASK_DEQUE_SIZE] = d->tasks[(i - 1) % TASK_DEQUE_SIZE];
+	d->top++;
+	if(d->top == d->bottom)
+		d->top = d->bottom = 0;
+	return 1;
+}
+
+static int task_pool_current_worker(TaskPool *pool) {
+	Uint32 id = SDL_ThreadID();
+	int i;
+
+	for(i = 0; i < pool->nb_workers; i++) {
+		if(atomic_get(&pool->workers[i].thread_id) == id)
+			return i;
 	}
+	return -1;
 }
-/* Add or subtract samples to get a better sync, return new
-   audio buffer size */
-int synchronize_audio(VideoState *is, short *samples,
-		int samples_size, double pts) {
-	int n;
-	double ref_clock;
 
-	n = 2 * is->audio_st->codec->channels;
+static void task_push(TaskPool *pool, const Task *task);
 
-	if(is->av_sync_type != AV_SYNC_AUDIO_MASTER) {
-		double diff, avg_diff;
-		int wanted_size, min_size, max_size /*, nb_samples */;
+static void task_done(TaskPool *pool, TaskGroup *group) {
 
-		ref_clock = get_master_clock(is);
-		diff = get_audio_clock(is) - ref_clock;
+	Task then;
+	int submit_then = 0;
 
-		if(diff < AV_NOSYNC_THRESHOLD) {
-			// accumulate the diffs
-			is->audio_diff_cum = diff + is->audio_diff_avg_coef
-				* is->audio_diff_cum;
-			if(is->audio_diff_avg_count < AUDIO_DIFF_AVG_NB) {
-				is->audio_diff_avg_count++;
-			} else {
-				avg_diff = is->audio_diff_cum * (1.0 - is->audio_diff_avg_coef);
-				if(fabs(avg_diff) >= is->audio_diff_threshold) {
-					wanted_size = samples_size + ((int)(diff * is->audio_st->codec->sample_rate) * n);
-					min_size = samples_size * ((100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100);
-					max_size = samples_size * ((100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100);
-					if(wanted_size < min_size) {
-						wanted_size = min_size;
-					} else if (wanted_size > max_size) {
-						wanted_size = max_size;
-					}
-					if(wanted_size < samples_size) {
-						/* remove samples */
-						samples_size = wanted_size;
-					} else if(wanted_size > samples_size) {
-						uint8_t *samples_end, *q;
-						int nb;
+	SDL_LockMutex(pool->mutex);
+	if(--group->pending == 0 && group->then_func) {
+		then.func = group->then_func;
+		then.arg = group->then_arg;
+		then.group = group->next_group;
+		group->then_func = NULL;
+		submit_then = 1;
+	}
+	SDL_CondBroadcast(pool->done_cond);
+	SDL_UnlockMutex(pool->mutex);
 
-						/* add samples by copying final sample*/
-						nb = (samples_size - wanted_size);
-						samples_end = (uint8_t *)samples + samples_size - n;
-						q = samples_end + n;
-						while(nb > 0) {
-							memcpy(q, samples_end, n);
-							q += n;
-							nb -= n;
-						}
-						samples_size = wanted_size;
-					}
-				}
-			}
-		} else {
-			/* difference is TOO big; reset diff stuff */
-			is->audio_diff_avg_count = 0;
-			is->audio_diff_cum = 0;
-		}
+	/* group may be gone now that its waiter has been woken */
+	if(submit_then)
+		task_push(pool, &then);
+}
+
+static void task_run(TaskPool *pool, TaskWorker *w, Task *task) {
+
+	int64_t start = av_gettime();
+
+	task->func(task->arg);
+	if(w) {
+		w->busy_time += av_gettime() - start;
+		w->tasks_run++;
 	}
-	return samples_size;
+	task_done(pool, task->group);
 }
 
-int audio_decode_frame(VideoState *is, double *pts_ptr) {
+static void task_push(TaskPool *pool, const Task *task) {
 
-	int len1,len2, data_size = 0, n, resampled_data_size;
-	AVPacket *pkt = &is->audio_pkt;
-	double pts;
-	int64_t dec_channel_layout;
-	AVRational tb;
+	Task inline_task;
+	int index = task_pool_current_worker(pool);
 
-	for(;;) 
-	{
-		while(is->audio_pkt_size > 0) 
-		{
-			int got_frame = 0;
-			len1 = avcodec_decode_audio4(is->audio_st->codec, &is->audio_frame, &got_frame, pkt);
-			if(len1 < 0) {
-				/* if error, skip frame */
-				is->audio_pkt_size = 0;
-				break;
-			}
+	SDL_LockMutex(pool->mutex);
+	if(index < 0)
+		index = pool->next_worker++ % pool->nb_workers;
+	if(deque_push(&pool->workers[index].deque, task) < 0) {
+		/* deque full: do it ourselves rather than block */
+		SDL_UnlockMutex(pool->mutex);
+		inline_task = *task;
+		task_run(pool, NULL, &inline_task);
+		return;
+	}
+	pool->queued++;
+	SDL_CondSignal(pool->work_cond);
+	SDL_UnlockMutex(pool->mutex);
+}
 
-			is->audio_pkt_data += len1;
-			is->audio_pkt_size -= len1;
+/* Under the pool mutex: take one queued task, our own newest if we
+   are a worker, otherwise (or if ours is empty) the oldest of someone
+   else. A thread from outside the pool only helps with group, the one
+   it waits for: anything else could hold it (the main thread, say) for
+   as long as that task takes. */
+static int task_take(TaskPool *pool, int self, TaskGroup *group, Task *task) {
 
-			if (got_frame)
-			{
+	TaskWorker *w = self >= 0 ? &pool->workers[self] : NULL;
+	int i, victim;
+
+	if(w && deque_pop(&w->deque, task)) {
+		pool->queued--;
+		return 1;
+	}
+	victim = self >= 0 ? self : rand();
+	for(i = 1; i <= pool->nb_workers; i++) {
+		victim = (victim + 1) % pool->nb_workers;
+		if(victim != self && deque_steal(&pool->workers[victim].deque, task, w ? NULL : group)) {
+			pool->queued--;
+			if(w)
+				w->steals++;
+			else
+				pool->tasks_helped++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int task_worker_thread(void *arg) {
+
+	TaskWorker *w = (TaskWorker *)arg;
+	TaskPool *pool = w->pool;
+	Task task;
+
+	/* before any task can ask task_pool_current_worker who we are */
+	atomic_set(&w->thread_id, SDL_ThreadID());
+	thread_setup(THREAD_ROLE_WORKER);
+
+	SDL_LockMutex(pool->mutex);
+	for(;;) {
+		if(task_take(pool, w->index, NULL, &task)) {
+			SDL_UnlockMutex(pool->mutex);
+			task_run(pool, w, &task);
+			SDL_LockMutex(pool->mutex);
+			continue;
+		}
+		if(pool->quit)
+			break;
+		SDL_CondWait(pool->work_cond, pool->mutex);
+	}
+	SDL_UnlockMutex(pool->mutex);
+	return 0;
+}
+
+TaskPool *task_pool_create(int nb_workers) {
+
+	TaskPool *pool;
+	int i;
+
+	if(nb_workers <= 0)
+		return NULL;
+	if(nb_workers > TASK_POOL_MAX_WORKERS)
+		nb_workers = TASK_POOL_MAX_WORKERS;
+
+	pool = av_mallocz(sizeof(TaskPool));
+	if(!pool)
+		return NULL;
+	pool->nb_workers = nb_workers;
+	pool->mutex = SDL_CreateMutex();
+	pool->work_cond = SDL_CreateCond();
+	pool->done_cond = SDL_CreateCond();
+	pool->start_time = av_gettime();
+
+	for(i = 0; i < nb_workers; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+	}
+	for(i = 0; i < nb_workers; i++)
+		pool->workers[i].tid = SDL_CreateThread(task_worker_thread, &pool->workers[i]);
+	return pool;
+}
+
+void task_pool_destroy(TaskPool *pool) {
+
+	int i;
+
+	if(!pool)
+		return;
+	SDL_LockMutex(pool->mutex);
+	pool->quit = 1;
+	SDL_CondBroadcast(pool->work_cond);
+	SDL_UnlockMutex(pool->mutex);
+
+	for(i = 0; i < pool->nb_workers; i++)
+		SDL_WaitThread(pool->workers[i].tid, NULL);
+	SDL_DestroyMutex(pool->mutex);
+	SDL_DestroyCond(pool->work_cond);
+	SDL_DestroyCond(pool->done_cond);
+	av_free(pool);
+}
+
+void task_group_init(TaskGroup *group) {
+	memset(group, 0, sizeof(TaskGroup));
+}
+
+void task_submit(TaskPool *pool, TaskGroup *group, void (*func)(void *), void *arg) {
+
+	Task task;
+
+	if(!pool) {
+		func(arg);
+		return;
+	}
+	task.func = func;
+	task.arg = arg;
+	task.group = group;
+
+	SDL_LockMutex(pool->mutex);
+	group->pending++;
+	SDL_UnlockMutex(pool->mutex);
+	task_push(pool, &task);
+}
+
+/* Queue func in next_group once every task of group has finished */
+void task_group_then(TaskPool *pool, TaskGroup *group, TaskGroup *next_group,
+		void (*func)(void *), void *arg) {
+
+	Task task;
+
+	if(!pool) {
+		/* without a pool everything already ran inline */
+		func(arg);
+		return;
+	}
+	SDL_LockMutex(pool->mutex);
+	next_group->pending++;
+	if(group->pending) {
+		group->then_func = func;
+		group->then_arg = arg;
+		group->next_group = next_group;
+		SDL_UnlockMutex(pool->mutex);
+		return;
+	}
+	SDL_UnlockMutex(pool->mutex);
+
+	task.func = func;
+	task.arg = arg;
+	task.group = next_group;
+	task_push(pool, &task);
+}
+
+/* Wait for a group, running queued tasks meanwhile instead of idling */
+void task_group_wait(TaskPool *pool, TaskGroup *group) {
+
+	Task task;
+	int self;
+
+	if(!pool)
+		return;
+	self = task_pool_current_worker(pool);
+	SDL_LockMutex(pool->mutex);
+	while(group->pending) {
+		if(task_take(pool, self, group, &task)) {
+			SDL_UnlockMutex(pool->mutex);
+			task_run(pool, self >= 0 ? &pool->workers[self] : NULL, &task);
+			SDL_LockMutex(pool->mutex);
+			continue;
+		}
+		/* what is left runs on the workers, each task_done wakes us */
+		SDL_CondWait(pool->done_cond, pool->mutex);
+	}
+	SDL_UnlockMutex(pool->mutex);
+}
+
+void task_pool_print_stats(TaskPool *pool) {
+
+	int64_t wall = av_gettime() - pool->start_time;
+	TaskWorker *w;
+	int i;
+
+	printf("task pool: %d workers, %d tasks run by waiting threads\n",
+			pool->nb_workers, pool->tasks_helped);
+	for(i = 0; i < pool->nb_workers; i++) {
+		w = &pool->workers[i];
+		printf("  worker %2d: %6d tasks, %5d steals, %5.1f%% busy\n", i,
+				w->tasks_run, w->steals,
+				wall > 0 ? 100.0 * w->busy_time / wall : 0.0);
+	}
+}
+
+static int cpu_count(void) {
+#ifdef __linux__
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#else
+	return 1;
+#endif
+}
+
+/* adler32 of the visible part of every plane */
+static uint32_t picture_checksum(const AVPicture *pict, int pix_fmt, int width, int height) {
+
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+	unsigned long crc = 1;
+	int i, y, h, bytes;
+
+	if(!desc)
+		return 0;
+	for(i = 0; i < 4 && pict->data[i]; i++) {
+		bytes = av_image_get_linesize(pix_fmt, width, i);
+		if(bytes <= 0)
+			continue;
+		h = (i == 1 || i == 2) ? -((-height) >> desc->log2_chroma_h) : height;
+		for(y = 0; y < h; y++)
+			crc = av_adler32_update(crc, pict->data[i] + y * pict->linesize[i], bytes);
+	}
+	return crc;
+}
+
+/* -analyze: quality checks on every decoded picture and audio frame.
+   The decoders only copy their output into a job; the measuring runs on
+   the task pool, and results are written in decode order as soon as
+   every earlier job of the same type is done. */
+typedef struct AnalysisPicture {
+	AVPicture pict;
+	int width, height, pix_fmt, size;
+	int refs; /* the job of this picture, the next one, the producer */
+} AnalysisPicture;
+
+typedef struct AnalysisJob {
+	int used;          /* atomic, claimed by the producer alone */
+	int done;
+	int64_t seq;
+	double pts;
+	AnalysisPicture *pic, *prev;
+	int16_t *samples;  /* audio: the slot's own, ANALYSIS_AUDIO_SLOT_SIZE */
+	int nb_samples, channels, sample_rate;
+
+	/* video */
+	double mean, variance, diff; /* diff: mean abs change, <0 for none */
+	int hist[16];
+	int black, frozen;
+	uint32_t hash;
+	/* audio */
+	double peak_db, rms_db;
+	int silent;
+} AnalysisJob;
+
+typedef struct AnalysisQueue {
+	AnalysisJob jobs[ANALYSIS_QUEUE_SIZE];
+	int64_t next_seq, next_write;
+} AnalysisQueue;
+
+typedef struct Analysis {
+	FILE *out;
+	int json;
+	AnalysisQueue video, audio;
+	AnalysisPicture *last; /* the producer's previous picture */
+	TaskGroup group;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	const char *kernels;
+	int64_t busy_time, start_time;
+	int frames, black_frames, frozen_frames;
+	int blocks, silent_blocks;
+	int blocks_dropped; /* atomic; no free audio slot, or too big for one */
+	double audio_time;
+} Analysis;
+
+Analysis *analysis;
+
+/* The kernels; analysis_open picks the widest the cpu has */
+static void luma_sums_c(const uint8_t *p, int n, uint64_t *sum, uint64_t *sumsq) {
+	uint64_t s = 0, sq = 0;
+	int i;
+
+	for(i = 0; i < n; i++) {
+		s += p[i];
+		sq += p[i] * p[i];
+	}
+	*sum = s;
+	*sumsq = sq;
+}
+
+static uint64_t luma_sad_c(const uint8_t *a, const uint8_t *b, int n) {
+	uint64_t sad = 0;
+	int i;
+
+	for(i = 0; i < n; i++)
+		sad += abs(a[i] - b[i]);
+	return sad;
+}
+
+static void audio_levels_c(const int16_t *p, int n, int *peak, uint64_t *sumsq) {
+	uint64_t sq = 0;
+	int i, v, m = 0;
+
+	for(i = 0; i < n; i++) {
+		v = FFMIN(abs(p[i]), 32767);
+		if(v > m)
+			m = v;
+		sq += v * v;
+	}
+	*peak = m;
+	*sumsq = sq;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void luma_sums_sse2(const uint8_t *p, int n, uint64_t *sum, uint64_t *sumsq) {
+	__m128i zero = _mm_setzero_si128(), s = zero, sq = zero, v, lo, hi, sq32;
+	uint64_t ts, tsq, r[2];
+	int i = 0;
+
+	for(; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		s = _mm_add_epi64(s, _mm_sad_epu8(v, zero));
+		lo = _mm_unpacklo_epi8(v, zero);
+		hi = _mm_unpackhi_epi8(v, zero);
+		sq32 = _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+		sq = _mm_add_epi64(sq, _mm_unpacklo_epi32(sq32, zero));
+		sq = _mm_add_epi64(sq, _mm_unpackhi_epi32(sq32, zero));
+	}
+	luma_sums_c(p + i, n - i, &ts, &tsq);
+	_mm_storeu_si128((__m128i *)r, s);
+	*sum = r[0] + r[1] + ts;
+	_mm_storeu_si128((__m128i *)r, sq);
+	*sumsq = r[0] + r[1] + tsq;
+}
+
+__attribute__((target("sse2")))
+static uint64_t luma_sad_sse2(const uint8_t *a, const uint8_t *b, int n) {
+	__m128i sad = _mm_setzero_si128();
+	uint64_t r[2];
+	int i = 0;
+
+	for(; i + 16 <= n; i += 16)
+		sad = _mm_add_epi64(sad, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+					_mm_loadu_si128((const __m128i *)(b + i))));
+	_mm_storeu_si128((__m128i *)r, sad);
+	return r[0] + r[1] + luma_sad_c(a + i, b + i, n - i);
+}
+
+/* |x| saturated to 32767, so two squares still fit madd's int32 */
+__attribute__((target("sse2")))
+static void audio_levels_sse2(const int16_t *p, int n, int *peak, uint64_t *sumsq) {
+	__m128i zero = _mm_setzero_si128(), m = zero, sq = zero, v, sq32;
+	int16_t r16[8];
+	uint64_t r[2], tsq;
+	int i = 0, tpeak, j;
+
+	for(; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		v = _mm_max_epi16(v, _mm_subs_epi16(zero, v));
+		m = _mm_max_epi16(m, v);
+		sq32 = _mm_madd_epi16(v, v);
+		sq = _mm_add_epi64(sq, _mm_unpacklo_epi32(sq32, zero));
+		sq = _mm_add_epi64(sq, _mm_unpackhi_epi32(sq32, zero));
+	}
+	audio_levels_c(p + i, n - i, &tpeak, &tsq);
+	_mm_storeu_si128((__m128i *)r16, m);
+	for(j = 0; j < 8; j++)
+		tpeak = FFMAX(tpeak, r16[j]);
+	_mm_storeu_si128((__m128i *)r, sq);
+	*peak = tpeak;
+	*sumsq = r[0] + r[1] + tsq;
+}
+
+__attribute__((target("avx2")))
+static void luma_sums_avx2(const uint8_t *p, int n, uint64_t *sum, uint64_t *sumsq) {
+	__m256i zero = _mm256_setzero_si256(), s = zero, sq = zero, v, lo, hi, sq32;
+	uint64_t ts, tsq, r[4];
+	int i = 0;
+
+	for(; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		s = _mm256_add_epi64(s, _mm256_sad_epu8(v, zero));
+		lo = _mm256_unpacklo_epi8(v, zero);
+		hi = _mm256_unpackhi_epi8(v, zero);
+		sq32 = _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi));
+		sq = _mm256_add_epi64(sq, _mm256_unpacklo_epi32(sq32, zero));
+		sq = _mm256_add_epi64(sq, _mm256_unpackhi_epi32(sq32, zero));
+	}
+	luma_sums_c(p + i, n - i, &ts, &tsq);
+	_mm256_storeu_si256((__m256i *)r, s);
+	*sum = r[0] + r[1] + r[2] + r[3] + ts;
+	_mm256_storeu_si256((__m256i *)r, sq);
+	*sumsq = r[0] + r[1] + r[2] + r[3] + tsq;
+}
+
+__attribute__((target("avx2")))
+static uint64_t luma_sad_avx2(const uint8_t *a, const uint8_t *b, int n) {
+	__m256i sad = _mm256_setzero_si256();
+	uint64_t r[4];
+	int i = 0;
+
+	for(; i + 32 <= n; i += 32)
+		sad = _mm256_add_epi64(sad, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(a + i)),
+					_mm256_loadu_si256((const __m256i *)(b + i))));
+	_mm256_storeu_si256((__m256i *)r, sad);
+	return r[0] + r[1] + r[2] + r[3] + luma_sad_c(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void audio_levels_avx2(const int16_t *p, int n, int *peak, uint64_t *sumsq) {
+	__m256i zero = _mm256_setzero_si256(), m = zero, sq = zero, v, sq32;
+	int16_t r16[16];
+	uint64_t r[4], tsq;
+	int i = 0, tpeak, j;
+
+	for(; i + 16 <= n; i += 16) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		v = _mm256_max_epi16(v, _mm256_subs_epi16(zero, v));
+		m = _mm256_max_epi16(m, v);
+		sq32 = _mm256_madd_epi16(v, v);
+		sq = _mm256_add_epi64(sq, _mm256_unpacklo_epi32(sq32, zero));
+		sq = _mm256_add_epi64(sq, _mm256_unpackhi_epi32(sq32, zero));
+	}
+	audio_levels_c(p + i, n - i, &tpeak, &tsq);
+	_mm256_storeu_si256((__m256i *)r16, m);
+	for(j = 0; j < 16; j++)
+		tpeak = FFMAX(tpeak, r16[j]);
+	_mm256_storeu_si256((__m256i *)r, sq);
+	*peak = tpeak;
+	*sumsq = r[0] + r[1] + r[2] + r[3] + tsq;
+}
+#endif
+
+static void (*luma_sums)(const uint8_t *p, int n, uint64_t *sum, uint64_t *sumsq) = luma_sums_c;
+static uint64_t (*luma_sad)(const uint8_t *a, const uint8_t *b, int n) = luma_sad_c;
+static void (*audio_levels)(const int16_t *p, int n, int *peak, uint64_t *sumsq) = audio_levels_c;
+
+static const char *analysis_kernels_init(void) {
+	const char *name = "c";
+
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) {
+		luma_sums = luma_sums_sse2;
+		luma_sad = luma_sad_sse2;
+		audio_levels = audio_levels_sse2;
+		name = "sse2";
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		luma_sums = luma_sums_avx2;
+		luma_sad = luma_sad_avx2;
+		audio_levels = audio_levels_avx2;
+		name = "avx2";
+	}
+#endif
+	return name;
+}
+
+/* Change detection hashes over rows of pixels, see picture_hash_bands.
+   Only ever compared with each other, so the kernels need not agree. */
+static uint64_t row_hash_c(uint64_t h, const uint8_t *p, int n) {
+	uint64_t v;
+	int i;
+
+	for(i = 0; i + 8 <= n; i += 8) {
+		memcpy(&v, p + i, 8);
+		h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+	for(; i < n; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+#ifdef HAVE_X86_KERNELS
+/* crc32c on two interleaved chains, one per half of the result */
+__attribute__((target("sse4.2")))
+static uint64_t row_hash_sse42(uint64_t h, const uint8_t *p, int n) {
+	uint64_t c0 = h >> 32, c1 = (uint32_t)h, v0, v1;
+	int i;
+
+	for(i = 0; i + 16 <= n; i += 16) {
+		memcpy(&v0, p + i, 8);
+		memcpy(&v1, p + i + 8, 8);
+		c0 = _mm_crc32_u64(c0, v0);
+		c1 = _mm_crc32_u64(c1, v1);
+	}
+	for(; i < n; i++)
+		c0 = _mm_crc32_u8((uint32_t)c0, p[i]);
+	return c0 << 32 | c1;
+}
+#endif
+
+static uint64_t (*row_hash)(uint64_t h, const uint8_t *p, int n) = row_hash_c;
+
+static void row_hash_init(void) {
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2"))
+		row_hash = row_hash_sse42;
+#endif
+}
+
+/* dst += src * gain, saturated; gain has MIX_GAIN_BITS fraction bits */
+static void mix_s16_c(int16_t *dst, const int16_t *src, int n, int gain) {
+	int i;
+
+	for(i = 0; i < n; i++)
+		dst[i] = av_clip_int16(dst[i] +
+				((src[i] * gain + (1 << (MIX_GAIN_BITS - 1))) >> MIX_GAIN_BITS));
+}
+
+#ifdef HAVE_X86_KERNELS
+/* madd of (src, 1) pairs with (gain, rounding) gives the rounded
+   product in 32 bits; dst is added there too, as gains over 1.0 can
+   take the product past 16 bits, and packs saturates once */
+__attribute__((target("sse2")))
+static void mix_s16_sse2(int16_t *dst, const int16_t *src, int n, int gain) {
+	__m128i g = _mm_set1_epi32((1 << (MIX_GAIN_BITS - 1)) << 16 | gain);
+	__m128i one = _mm_set1_epi16(1), v, d, lo, hi;
+	int i = 0;
+
+	for(; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		d = _mm_loadu_si128((const __m128i *)(dst + i));
+		lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(v, one), g), MIX_GAIN_BITS);
+		hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(v, one), g), MIX_GAIN_BITS);
+		lo = _mm_add_epi32(lo, _mm_srai_epi32(_mm_unpacklo_epi16(d, d), 16));
+		hi = _mm_add_epi32(hi, _mm_srai_epi32(_mm_unpackhi_epi16(d, d), 16));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+	}
+	mix_s16_c(dst + i, src + i, n - i, gain);
+}
+
+/* unpack and pack both work within 128-bit lanes, so the order holds */
+__attribute__((target("avx2")))
+static void mix_s16_avx2(int16_t *dst, const int16_t *src, int n, int gain) {
+	__m256i g = _mm256_set1_epi32((1 << (MIX_GAIN_BITS - 1)) << 16 | gain);
+	__m256i one = _mm256_set1_epi16(1), v, d, lo, hi;
+	int i = 0;
+
+	for(; i + 16 <= n; i += 16) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		lo = _mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(v, one), g), MIX_GAIN_BITS);
+		hi = _mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(v, one), g), MIX_GAIN_BITS);
+		lo = _mm256_add_epi32(lo, _mm256_srai_epi32(_mm256_unpacklo_epi16(d, d), 16));
+		hi = _mm256_add_epi32(hi, _mm256_srai_epi32(_mm256_unpackhi_epi16(d, d), 16));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packs_epi32(lo, hi));
+	}
+	mix_s16_c(dst + i, src + i, n - i, gain);
+}
+#endif
+
+typedef void (*MixKernel)(int16_t *dst, const int16_t *src, int n, int gain);
+
+static MixKernel mix_s16 = mix_s16_c;
+static double mix_ns_per_sample;
+
+/* Time one kernel over a buffer that stays in L1, like a callback's */
+static double mix_kernel_bench(MixKernel kernel) {
+	int16_t dst[4096], src[4096];
+	int64_t t;
+	int i;
+
+	for(i = 0; i < 4096; i++) {
+		dst[i] = i * 7;
+		src[i] = i * 13;
+	}
+	kernel(dst, src, 4096, 3 << (MIX_GAIN_BITS - 2));
+	t = av_gettime();
+	for(i = 0; i < 1024; i++)
+		kernel(dst, src, 4096, 3 << (MIX_GAIN_BITS - 2));
+	return (av_gettime() - t) * 1000.0 / (1024.0 * 4096);
+}
+
+/* Picks the widest kernel, and prints what each costs on this cpu */
+static void mix_kernels_init(void) {
+	const char *name = "c";
+
+	mix_ns_per_sample = mix_kernel_bench(mix_s16_c);
+	printf("mix kernels: c %.3f", mix_ns_per_sample);
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) {
+		mix_s16 = mix_s16_sse2;
+		mix_ns_per_sample = mix_kernel_bench(mix_s16);
+		printf(", sse2 %.3f", mix_ns_per_sample);
+		name = "sse2";
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		mix_s16 = mix_s16_avx2;
+		mix_ns_per_sample = mix_kernel_bench(mix_s16);
+		printf(", avx2 %.3f", mix_ns_per_sample);
+		name = "avx2";
+	}
+#endif
+	printf(" ns per sample; using %s\n", name);
+}
+
+enum {
+	VIS_WAVES = 1,
+	VIS_SPECTRUM = 2,
+};
+
+/* -vis: pictures of the audio for files without video. audio_decode_frame
+   puts its output into ring, vis_thread draws the part the audio clock
+   is at into back and swaps it with front, and the main thread shows
+   front through the video sink. */
+typedef struct Vis {
+	int mode;
+	SDL_mutex *mutex;        /* ring, front, pending */
+	int16_t ring[VIS_RING_SIZE]; /* mono */
+	int64_t ring_pos;        /* samples written so far */
+	double ring_end_pts;     /* of the last one */
+	int freq;
+	uint8_t *front, *back;   /* YUV420P, VIS_WIDTH x VIS_HEIGHT */
+	int pending;             /* front is new, main thread not told yet */
+	SDL_Thread *tid;
+	int quit;
+	/* vis_thread only */
+	RDFTContext *rdft;
+	float *fft, *window, *power;
+	int16_t samples[VIS_FFT_SIZE];
+	int bin_lo[VIS_WIDTH], bin_hi[VIS_WIDTH]; /* power bins of each column */
+	int bins_freq;
+	int16_t wave_min[VIS_WIDTH], wave_max[VIS_WIDTH]; /* columns, a ring */
+	int wave_head;
+	int64_t wave_pos;        /* ring position of the next column */
+	const char *kernels;
+	int frames;
+	int64_t busy_time, start_time;
+} Vis;
+
+Vis *vis;
+
+/* The kernels; vis_open picks the widest the cpu has */
+static void vis_window_c(float *dst, const int16_t *src, const float *window, int n) {
+	int i;
+
+	for(i = 0; i < n; i++)
+		dst[i] = src[i] * window[i];
+}
+
+/* av_rdft's output is re, im pairs (the first holds DC and Nyquist) */
+static void vis_power_c(float *dst, const float *fft, int n) {
+	int i;
+
+	for(i = 0; i < n; i++)
+		dst[i] = fft[2 * i] * fft[2 * i] + fft[2 * i + 1] * fft[2 * i + 1];
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void vis_window_sse2(float *dst, const int16_t *src, const float *window, int n) {
+	__m128i v;
+	int i = 0;
+
+	for(; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		/* sign extend by putting each sample in the top half */
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)),
+					_mm_loadu_ps(window + i)));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)),
+					_mm_loadu_ps(window + i + 4)));
+	}
+	vis_window_c(dst + i, src + i, window + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void vis_power_sse2(float *dst, const float *fft, int n) {
+	__m128 a, b;
+	int i = 0;
+
+	for(; i + 4 <= n; i += 4) {
+		a = _mm_loadu_ps(fft + 2 * i);
+		b = _mm_loadu_ps(fft + 2 * i + 4);
+		a = _mm_mul_ps(a, a);
+		b = _mm_mul_ps(b, b);
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+					_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+	}
+	vis_power_c(dst + i, fft + 2 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void vis_window_avx2(float *dst, const int16_t *src, const float *window, int n) {
+	int i = 0;
+
+	for(; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+							_mm_loadu_si128((const __m128i *)(src + i)))),
+					_mm256_loadu_ps(window + i)));
+	vis_window_c(dst + i, src + i, window + i, n - i);
+}
+
+/* the shuffles work within 128-bit lanes, the permute puts the halves
+   back in order */
+__attribute__((target("avx2")))
+static void vis_power_avx2(float *dst, const float *fft, int n) {
+	__m256 a, b, p;
+	int i = 0;
+
+	for(; i + 8 <= n; i += 8) {
+		a = _mm256_loadu_ps(fft + 2 * i);
+		b = _mm256_loadu_ps(fft + 2 * i + 8);
+		a = _mm256_mul_ps(a, a);
+		b = _mm256_mul_ps(b, b);
+		p = _mm256_add_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+				_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+		_mm256_storeu_ps(dst + i, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(p),
+							_MM_SHUFFLE(3, 1, 2, 0))));
+	}
+	vis_power_c(dst + i, fft + 2 * i, n - i);
+}
+#endif
+
+static void (*vis_window)(float *dst, const int16_t *src, const float *window, int n) = vis_window_c;
+static void (*vis_power)(float *dst, const float *fft, int n) = vis_power_c;
+
+static const char *vis_kernels_init(void) {
+	const char *name = "c";
+
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) {
+		vis_window = vis_window_sse2;
+		vis_power = vis_power_sse2;
+		name = "sse2";
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		vis_window = vis_window_avx2;
+		vis_power = vis_power_avx2;
+		name = "avx2";
+	}
+#endif
+	return name;
+}
+
+/* From audio_decode_frame: interleaved S16 that starts playing at pts */
+static void vis_audio(const int16_t *p, int size, int channels, int freq, double pts) {
+	int n = size / (2 * channels), i, c, sum;
+
+	SDL_LockMutex(vis->mutex);
+	for(i = 0; i < n; i++) {
+		for(c = 0, sum = 0; c < channels; c++)
+			sum += p[i * channels + c];
+		vis->ring[(vis->ring_pos + i) & (VIS_RING_SIZE - 1)] = sum / channels;
+	}
+	vis->ring_pos += n;
+	vis->ring_end_pts = pts + (double)n / freq;
+	vis->freq = freq;
+	SDL_UnlockMutex(vis->mutex);
+}
+
+static void analysis_picture_unref(AnalysisPicture *p) {
+	if(p && --p->refs == 0) {
+		av_freep(&p->pict.data[0]);
+		mem_charge(MEM_PICTURES, -p->size);
+		av_free(p);
+	}
+}
+
+int analysis_open(const char *filename) {
+	int len = strlen(filename);
+	int i;
+
+	analysis = av_mallocz(sizeof(Analysis));
+	if(!analysis)
+		return -1;
+	analysis->out = fopen(filename, "w");
+	if(!analysis->out) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		av_freep(&analysis);
+		return -1;
+	}
+	analysis->json = len > 5 && !strcasecmp(filename + len - 5, ".json");
+	if(!analysis->json)
+		fprintf(analysis->out, "type,n,pts,mean,variance,diff,black,frozen,hash,hist,"
+				"peak_db,rms_db,silent\n");
+	/* the audio callback must not wait on av_malloc */
+	for(i = 0; i < ANALYSIS_QUEUE_SIZE; i++) {
+		analysis->audio.jobs[i].samples = av_malloc(ANALYSIS_AUDIO_SLOT_SIZE);
+		if(!analysis->audio.jobs[i].samples) {
+			while(i--)
+				av_free(analysis->audio.jobs[i].samples);
+			fclose(analysis->out);
+			av_freep(&analysis);
+			return -1;
+		}
+	}
+	mem_charge(MEM_AUDIO, (int64_t)ANALYSIS_QUEUE_SIZE * ANALYSIS_AUDIO_SLOT_SIZE);
+	analysis->mutex = SDL_CreateMutex();
+	analysis->cond = SDL_CreateCond();
+	analysis->kernels = analysis_kernels_init();
+	analysis->start_time = av_gettime();
+	return 0;
+}
+
+/* a free slot for the next job, waits while the oldest is unwritten,
+   or returns NULL right away if wait is 0. next_seq is the producer's
+   own, so a free slot is taken without the mutex, which
+   analysis_job_done holds while it writes. */
+static AnalysisJob *analysis_job_get(AnalysisQueue *q, int wait) {
+	AnalysisJob *job;
+	int16_t *samples;
+
+	job = &q->jobs[q->next_seq % ANALYSIS_QUEUE_SIZE];
+	if(atomic_get(&job->used)) {
+		if(!wait)
+			return NULL;
+		SDL_LockMutex(analysis->mutex);
+		while(atomic_get(&job->used))
+			SDL_CondWait(analysis->cond, analysis->mutex);
+		SDL_UnlockMutex(analysis->mutex);
+	}
+	samples = job->samples;
+	memset(job, 0, sizeof(AnalysisJob));
+	job->samples = samples;
+	job->seq = q->next_seq++;
+	atomic_set(&job->used, 1);
+	return job;
+}
+
+static void analysis_write(AnalysisJob *job) {
+	FILE *f = analysis->out;
+	int i;
+
+	if(job->pic) {
+		if(analysis->json) {
+			fprintf(f, "{\"type\":\"video\",\"n\":%lld,\"pts\":%.3f,\"mean\":%.2f,\"variance\":%.2f,"
+					"\"diff\":%.3f,\"black\":%d,\"frozen\":%d,\"hash\":\"%08x\",\"hist\":[",
+					(long long)job->seq, job->pts, job->mean, job->variance, job->diff,
+					job->black, job->frozen, job->hash);
+			for(i = 0; i < 16; i++)
+				fprintf(f, i ? ",%d" : "%d", job->hist[i]);
+			fprintf(f, "]}\n");
+		} else {
+			fprintf(f, "v,%lld,%.3f,%.2f,%.2f,%.3f,%d,%d,%08x,",
+					(long long)job->seq, job->pts, job->mean, job->variance, job->diff,
+					job->black, job->frozen, job->hash);
+			for(i = 0; i < 16; i++)
+				fprintf(f, i ? " %d" : "%d", job->hist[i]);
+			fprintf(f, ",,,\n");
+		}
+	} else {
+		if(analysis->json)
+			fprintf(f, "{\"type\":\"audio\",\"n\":%lld,\"pts\":%.3f,\"peak_db\":%.1f,"
+					"\"rms_db\":%.1f,\"silent\":%d}\n",
+					(long long)job->seq, job->pts, job->peak_db, job->rms_db, job->silent);
+		else
+			fprintf(f, "a,%lld,%.3f,,,,,,,,%.1f,%.1f,%d\n",
+					(long long)job->seq, job->pts, job->peak_db, job->rms_db, job->silent);
+	}
+}
+
+/* write out everything that is done, in order */
+static void analysis_job_done(AnalysisQueue *q, AnalysisJob *job, int64_t time) {
+	AnalysisJob *next;
+
+	SDL_LockMutex(analysis->mutex);
+	job->done = 1;
+	analysis->busy_time += time;
+	for(;;) {
+		next = &q->jobs[q->next_write % ANALYSIS_QUEUE_SIZE];
+		if(!atomic_get(&next->used) || !next->done || next->seq != q->next_write)
+			break;
+		analysis_write(next);
+		if(next->pic) {
+			analysis->frames++;
+			analysis->black_frames += next->black;
+			analysis->frozen_frames += next->frozen;
+		} else {
+			analysis->blocks++;
+			analysis->silent_blocks += next->silent;
+			analysis->audio_time += (double)next->nb_samples / next->sample_rate;
+		}
+		analysis_picture_unref(next->pic);
+		analysis_picture_unref(next->prev);
+		atomic_set(&next->used, 0);
+		q->next_write++;
+	}
+	SDL_CondBroadcast(analysis->cond);
+	SDL_UnlockMutex(analysis->mutex);
+}
+
+static void analysis_video_task(void *arg) {
+	AnalysisJob *job = (AnalysisJob *)arg;
+	AnalysisPicture *p = job->pic, *prev = job->prev;
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(p->pix_fmt);
+	int hist[4][256];
+	uint64_t sum = 0, sumsq = 0, sad = 0, s, sq;
+	const uint8_t *row;
+	int64_t start = av_gettime();
+	int x, y, black, n = p->width * p->height;
+
+	job->diff = -1;
+	/* 8 bit luma in a plane of its own */
+	if(n && desc && !(desc->flags & (PIX_FMT_RGB | PIX_FMT_PAL)) &&
+			desc->comp[0].depth_minus1 == 7 && desc->comp[0].step_minus1 == 0) {
+		memset(hist, 0, sizeof(hist));
+		if(prev && (prev->width != p->width || prev->height != p->height))
+			prev = NULL;
+		for(y = 0; y < p->height; y++) {
+			row = p->pict.data[0] + y * p->pict.linesize[0];
+			luma_sums(row, p->width, &s, &sq);
+			sum += s;
+			sumsq += sq;
+			/* four histograms, so neighbouring equal pixels don't stall on one counter */
+			for(x = 0; x + 4 <= p->width; x += 4) {
+				hist[0][row[x]]++;
+				hist[1][row[x + 1]]++;
+				hist[2][row[x + 2]]++;
+				hist[3][row[x + 3]]++;
+			}
+			for(; x < p->width; x++)
+				hist[0][row[x]]++;
+			if(prev)
+				sad += luma_sad(row, prev->pict.data[0] + y * prev->pict.linesize[0], p->width);
+		}
+		job->mean = (double)sum / n;
+		job->variance = (double)sumsq / n - job->mean * job->mean;
+		black = 0;
+		for(x = 0; x < 256; x++) {
+			y = hist[0][x] + hist[1][x] + hist[2][x] + hist[3][x];
+			job->hist[x >> 4] += y;
+			if(x <= BLACK_PIXEL_MAX)
+				black += y;
+		}
+		job->black = black >= BLACK_RATIO * n;
+		if(prev) {
+			job->diff = (double)sad / n;
+			job->frozen = job->diff < FREEZE_MAX_DIFF;
+		}
+	}
+	job->hash = picture_checksum(&p->pict, p->pix_fmt, p->width, p->height);
+	analysis_job_done(&analysis->video, job, av_gettime() - start);
+}
+
+static void analysis_audio_task(void *arg) {
+	AnalysisJob *job = (AnalysisJob *)arg;
+	int64_t start = av_gettime();
+	uint64_t sumsq;
+	int peak, n = job->nb_samples * job->channels;
+
+	audio_levels(job->samples, n, &peak, &sumsq);
+	job->peak_db = peak ? 20 * log10(peak / 32768.0) : -INFINITY;
+	job->rms_db = sumsq ? 10 * log10(sumsq / (n * 32768.0 * 32768.0)) : -INFINITY;
+	job->silent = job->rms_db < SILENCE_DB;
+	analysis_job_done(&analysis->audio, job, av_gettime() - start);
+}
+
+/* called by video_thread for every decoded picture */
+void analysis_video(AVFrame *frame, int pix_fmt, int width, int height, double pts) {
+	AnalysisJob *job;
+	AnalysisPicture *p;
+	int size;
+
+	p = av_mallocz(sizeof(AnalysisPicture));
+	if(!p)
+		return;
+	size = av_image_alloc(p->pict.data, p->pict.linesize, width, height, pix_fmt, 32);
+	if(size < 0) {
+		av_free(p);
+		return;
+	}
+	av_image_copy(p->pict.data, p->pict.linesize, (const uint8_t **)frame->data,
+			frame->linesize, pix_fmt, width, height);
+	p->width = width;
+	p->height = height;
+	p->pix_fmt = pix_fmt;
+	p->size = size;
+	p->refs = 2; /* this job and analysis->last */
+	mem_charge(MEM_PICTURES, size);
+
+	job = analysis_job_get(&analysis->video, 1);
+	job->pts = pts;
+	job->pic = p;
+	/* our reference to the previous picture goes to the job */
+	job->prev = analysis->last;
+	analysis->last = p;
+	task_submit(task_pool, &analysis->group, analysis_video_task, job);
+}
+
+/* called by audio_decode_frame with the S16 samples it hands out. That
+   is the audio callback, which can't wait for the workers to catch up:
+   a frame that finds no free slot is dropped and counted, unless a
+   simulation, with no device to underrun, is playing. */
+void analysis_audio(const uint8_t *buf, int size, int channels, int sample_rate, double pts) {
+	AnalysisJob *job = NULL;
+
+	if(channels <= 0 || sample_rate <= 0)
+		return;
+	if(size <= ANALYSIS_AUDIO_SLOT_SIZE)
+		job = analysis_job_get(&analysis->audio, simulate);
+	if(!job) {
+		atomic_add(&analysis->blocks_dropped, 1);
+		return;
+	}
+	memcpy(job->samples, buf, size);
+	job->pts = pts;
+	job->channels = channels;
+	job->sample_rate = sample_rate;
+	job->nb_samples = size / (2 * channels);
+	task_submit(task_pool, &analysis->group, analysis_audio_task, job);
+}
+
+void analysis_close(void) {
+	double wall;
+	int i;
+
+	if(!analysis)
+		return;
+	task_group_wait(task_pool, &analysis->group);
+	SDL_LockMutex(analysis->mutex);
+	analysis_picture_unref(analysis->last);
+	SDL_UnlockMutex(analysis->mutex);
+	fclose(analysis->out);
+	for(i = 0; i < ANALYSIS_QUEUE_SIZE; i++)
+		av_free(analysis->audio.jobs[i].samples);
+	mem_charge(MEM_AUDIO, -(int64_t)ANALYSIS_QUEUE_SIZE * ANALYSIS_AUDIO_SLOT_SIZE);
+
+	wall = (av_gettime() - analysis->start_time) / 1000000.0;
+	printf("analysis (%s kernels): %d pictures, %d black, %d frozen; %d audio frames, "
+			"%.1f s, %d silent, %d dropped; %.2f ms per job on the workers, %.1f jobs/s\n",
+			analysis->kernels, analysis->frames, analysis->black_frames, analysis->frozen_frames,
+			analysis->blocks, analysis->audio_time, analysis->silent_blocks, analysis->blocks_dropped,
+			analysis->busy_time / 1000.0 / FFMAX(analysis->frames + analysis->blocks, 1),
+			wall > 0 ? (analysis->frames + analysis->blocks) / wall : 0.0);
+	SDL_DestroyMutex(analysis->mutex);
+	SDL_DestroyCond(analysis->cond);
+	av_freep(&analysis);
+}
+
+double get_audio_clock(VideoState *is) {
+	double pts, latency, elapsed;
+	int hw_buf_size, bytes_per_sec;
+	int64_t time;
+
+	/* maintained in the audio thread; they can be a callback apart,
+	   which is off by at most one buffer for a moment */
+	time = atomic_get(&is->audio_write_time);
+	if(time) {
+		/* the last callback's data ends playing latency after it ran,
+		   and the device plays in real time until then */
+		pts = clock_get(&is->audio_write_clock);
+		latency = clock_get(&is->audio_latency);
+		elapsed = (clock_now() - time) / 1000000.0;
+		return pts - latency + FFMIN(FFMAX(elapsed, 0), latency);
+	}
+	pts = clock_get(&is->audio_clock);
+	hw_buf_size = atomic_get(&is->audio_buf_size) - atomic_get(&is->audio_buf_index);
+	bytes_per_sec = is->audio_tgt.freq * is->audio_tgt.channels * 2;
+	if(bytes_per_sec) {
+		pts -= (double)hw_buf_size / bytes_per_sec;
+	}
+	return pts;
+}
+double get_video_clock(VideoState *is) {
+	double delta;
+
+	delta = (clock_now() - atomic_get(&is->video_current_pts_time)) / 1000000.0;
+	return clock_get(&is->video_current_pts) + delta;
+}
+double get_external_clock(VideoState *is) {
+	return clock_now() / 1000000.0;
+}
+double get_master_clock(VideoState *is) {
+	if(is->av_sync_type == AV_SYNC_VIDEO_MASTER) {
+		return get_video_clock(is);
+	} else if(is->av_sync_type == AV_SYNC_AUDIO_MASTER) {
+		return get_audio_clock(is);
+	} else {
+		return get_external_clock(is);
+	}
+}
+/* Add or subtract samples to get a better sync, return new
+   audio buffer size */
+int synchronize_audio(VideoState *is, short *samples,
+		int samples_size, double pts) {
+	int n;
+	double ref_clock;
+
+	n = 2 * is->audio_st->codec->channels;
+
+	if(is->av_sync_type != AV_SYNC_AUDIO_MASTER) {
+		double diff, avg_diff;
+		int wanted_size, min_size, max_size /*, nb_samples */;
+
+		ref_clock = get_master_clock(is);
+		diff = get_audio_clock(is) - ref_clock;
+
+		if(diff < AV_NOSYNC_THRESHOLD) {
+			// accumulate the diffs
+			is->audio_diff_cum = diff + is->audio_diff_avg_coef
+				* is->audio_diff_cum;
+			if(is->audio_diff_avg_count < AUDIO_DIFF_AVG_NB) {
+				is->audio_diff_avg_count++;
+			} else {
+				avg_diff = is->audio_diff_cum * (1.0 - is->audio_diff_avg_coef);
+				if(fabs(avg_diff) >= is->audio_diff_threshold) {
+					wanted_size = samples_size + ((int)(diff * is->audio_st->codec->sample_rate) * n);
+					min_size = samples_size * ((100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100);
+					max_size = samples_size * ((100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100);
+					if(wanted_size < min_size) {
+						wanted_size = min_size;
+					} else if (wanted_size > max_size) {
+						wanted_size = max_size;
+					}
+					if(wanted_size != samples_size) {
+						is->audio_corrections++;
+						if(wanted_size < samples_size)
+							is->audio_samples_removed += (samples_size - wanted_size) / n;
+						else
+							is->audio_samples_added += (wanted_size - samples_size) / n;
+					}
+					if(wanted_size < samples_size) {
+						/* remove samples */
+						samples_size = wanted_size;
+					} else if(wanted_size > samples_size) {
+						uint8_t *samples_end, *q;
+						int nb;
+
+						/* add samples by copying final sample*/
+						nb = (samples_size - wanted_size);
+						samples_end = (uint8_t *)samples + samples_size - n;
+						q = samples_end + n;
+						while(nb > 0) {
+							memcpy(q, samples_end, n);
+							q += n;
+							nb -= n;
+						}
+						samples_size = wanted_size;
+					}
+				}
+			}
+		} else {
+			/* difference is TOO big; reset diff stuff */
+			is->audio_diff_avg_count = 0;
+			is->audio_diff_cum = 0;
+		}
+	} else if(live_mode && !atomic_get(&is->live_buffering) &&
+			clock_get(&is->live_buffered) > live_latency + LIVE_CATCHUP_THRESHOLD) {
+		/* we are the master clock and behind the live edge: play this
+		   buffer slightly faster so video follows us back to the target */
+		int wanted_size = samples_size * (100 - LIVE_SPEEDUP_PERCENT) / 100;
+		wanted_size -= wanted_size % n;
+		if(wanted_size > 0) {
+			samples_size = wanted_size;
+			atomic_add(&is->live_speedups, 1);
+		}
+	}
+	return samples_size;
+}
+
+int audio_decode_frame(VideoState *is, double *pts_ptr) {
+
+	int len1,len2, data_size = 0, n, resampled_data_size;
+	unsigned int old_size;
+	AVPacket *pkt = &is->audio_pkt;
+	double pts;
+	int64_t dec_channel_layout;
+	AVRational tb;
+	AVStream *st;
+
+	for(;;) 
+	{
+		while(is->audio_pkt_size > 0 || is->audio_drain_item >= 0) 
+		{
+			int got_frame = 0;
+			len1 = avcodec_decode_audio4(is->audio_st->codec, &is->audio_frame, &got_frame, pkt);
+			if(is->audio_drain_item >= 0 && (len1 < 0 || !got_frame)) {
+				/* the ending item's decoder gave all it held back */
+				avcodec_flush_buffers(is->audio_st->codec);
+				if((st = playlist_enter(is, AVMEDIA_TYPE_AUDIO, is->audio_drain_item)) != NULL)
+					is->audio_st = st;
+				is->audio_drain_item = -1;
+				break;
+			}
+			if(len1 < 0) {
+				/* if error, skip frame */
+				is->audio_pkt_size = 0;
+				break;
+			}
+
+			is->audio_pkt_data += len1;
+			is->audio_pkt_size -= len1;
+
+			if (got_frame)
+			{
 				tb = (AVRational){1, is->audio_frame.sample_rate};
 				if(is->audio_frame.pts != AV_NOPTS_VALUE)
 					is->audio_frame.pts = av_rescale_q(is->audio_frame.pts, is->audio_st->codec->time_base, tb);
@@ -593,934 +2713,5932 @@ int audio_decode_frame(VideoState *is, double *pts_ptr) {
 				if(pkt->pts != AV_NOPTS_VALUE)
 					pkt->pts += (double)is->audio_frame.nb_samples / is->audio_frame.sample_rate / av_q2d(is->audio_st->time_base);
 
-				data_size = av_samples_get_buffer_size(NULL, av_frame_get_channels(&(is->audio_frame)),
-						is->audio_frame.nb_samples,
-						is->audio_frame.format, 1);
-				dec_channel_layout =
-					(is->audio_frame.channel_layout && av_frame_get_channels(&(is->audio_frame)) == av_get_channel_layout_nb_channels(is->audio_frame.channel_layout)) ? 
-					is->audio_frame.channel_layout : av_get_default_channel_layout(av_frame_get_channels(&(is->audio_frame)));
+				data_size = av_samples_get_buffer_size(NULL, av_frame_get_channels(&(is->audio_frame)),
+						is->audio_frame.nb_samples,
+						is->audio_frame.format, 1);
+				dec_channel_layout =
+					(is->audio_frame.channel_layout && av_frame_get_channels(&(is->audio_frame)) == av_get_channel_layout_nb_channels(is->audio_frame.channel_layout)) ? 
+					is->audio_frame.channel_layout : av_get_default_channel_layout(av_frame_get_channels(&(is->audio_frame)));
+
+				if(is->audio_frame.format != is->audio_src.fmt
+						|| dec_channel_layout != is->audio_src.channel_layout
+						|| is->audio_frame.sample_rate != is->audio_src.freq
+						|| is->swr_ctx == NULL)
+				{
+					if(is->swr_ctx)
+						swr_free(is->swr_ctx);
+
+					is->swr_ctx = swr_alloc_set_opts(NULL,
+							is->audio_tgt.channel_layout, is->audio_tgt.fmt, is->audio_tgt.freq,
+							dec_channel_layout, is->audio_frame.format, is->audio_frame.sample_rate,
+							0, NULL);
+					if(is->swr_ctx == NULL || swr_init(is->swr_ctx) < 0)
+					{
+						printf("create swr_ctx error\n");
+						break;
+					}
+
+					is->audio_src.channel_layout = dec_channel_layout;
+					is->audio_src.channels = av_frame_get_channels(&(is->audio_frame));
+					is->audio_src.freq = is->audio_frame.sample_rate;
+					is->audio_src.fmt = is->audio_frame.format;
+				}
+
+				if(is->swr_ctx)
+				{
+					const uint8_t **in = (const uint8_t **)is->audio_frame.extended_data;
+					uint8_t **out = &is->audio_buf1;
+					int out_count = (int64_t)is->audio_frame.nb_samples * is->audio_tgt.freq / is->audio_frame.sample_rate + 256;
+					int out_size = av_samples_get_buffer_size(NULL, is->audio_tgt.channels, out_count, is->audio_tgt.fmt, 0);
+					if(out_size < 0)
+					{
+						printf("av_samples_get_buffer_size error\n");
+						break;
+					}
+
+					old_size = is->audio_buf1_size;
+					av_fast_malloc(&is->audio_buf1, &is->audio_buf1_size, out_size);
+					if(!is->audio_buf1) {
+						mem_charge(MEM_AUDIO, -(int64_t)old_size);
+						is->audio_buf1_size = 0;
+						return AVERROR(ENOMEM);
+					}
+					mem_charge(MEM_AUDIO, (int64_t)is->audio_buf1_size - old_size);
+					len2 = swr_convert(is->swr_ctx, out, out_count, in, is->audio_frame.nb_samples);
+					if(len2 < 0)
+					{
+						printf("swr_convert error\n");
+						break;
+					}
+					if(len2 == out_count)
+					{
+						printf("warning: audio buffer is probably too small\n");
+						swr_init(is->swr_ctx);
+					}
+
+					is->audio_buf = is->audio_buf1;
+					resampled_data_size = len2 * is->audio_tgt.channels * av_get_bytes_per_sample(is->audio_tgt.fmt);
+
+				}
+				else
+				{
+					is->audio_buf = is->audio_frame.data[0];
+					resampled_data_size = data_size;
+				}
+
+				pts = is->audio_clock;
+				if(analysis)
+					analysis_audio(is->audio_buf, resampled_data_size, is->audio_tgt.channels,
+							is->audio_tgt.freq, pts);
+				if(vis)
+					vis_audio((const int16_t *)is->audio_buf, resampled_data_size,
+							is->audio_tgt.channels, is->audio_tgt.freq, pts);
+				if(is->audio_frame.pts != AV_NOPTS_VALUE)
+				{
+					clock_set(&is->audio_clock, is->audio_frame.pts * av_q2d(tb) + (double)is->audio_frame.nb_samples / is->audio_frame.sample_rate
+						+ playlist_shift(is->audio_item));
+				}
+				*pts_ptr = pts;
+				if(playlist_size > 1 && !playlist[is->audio_item].audio_first_time)
+					playlist[is->audio_item].audio_first_time = av_gettime();
+
+				return resampled_data_size;
+				// printf("channels: %u, nb_samples: %d, data_size: %d\n\n", is->audio_st->codec->channels,
+				//		  													is->audio_frame.nb_samples,
+				//															data_size);
+				//	printf("audio format: %d\n", is->audio_frame.format);
+				//   memcpy(is->audio_buf, is->audio_frame.data[0], data_size);
+			}
+		}
+
+		if(pkt->data)
+			av_free_packet(pkt);
+
+		if(atomic_get(&is->quit)) {
+			return -1;
+		}
+
+		/* next packet; a simulation ends instead of waiting at the end */
+		if(packet_queue_get(&is->audioq, pkt, !(simulate && is->eof)) <= 0) {
+			return -1;
+		}
+		if(pkt->data == flush_pkt.data) {
+			avcodec_flush_buffers(is->audio_st->codec);
+			continue;
+		}
+		if(pkt->data == item_pkt.data) {
+			/* empty packets drain the decoder of the delay samples of the
+			   item that is ending before the new one is entered */
+			if(pkt->pos != is->audio_item) {
+				is->audio_drain_item = pkt->pos;
+				pkt->data = NULL;
+				pkt->size = 0;
+				pkt->pts = pkt->dts = AV_NOPTS_VALUE;
+				is->audio_pkt_data = NULL;
+				is->audio_pkt_size = 0;
+			}
+			continue;
+		}
+		is->audio_pkt_data = pkt->data;
+		is->audio_pkt_size = pkt->size;
+		/* if update, update the audio clock w/pts */
+		if(pkt->pts != AV_NOPTS_VALUE) {
+			clock_set(&is->audio_clock, av_q2d(is->audio_st->time_base)*pkt->pts
+				+ playlist_shift(is->audio_item));
+		}
+	}
+}
+
+/* Blocks while the track is more than MIX_FIFO_TIME ahead of playback.
+   Data converted for an earlier target (gen) than the fifo's is dropped. */
+static void mix_track_write(MixTrack *t, uint8_t *data, int size, double end_pts, int gen) {
+	int bytes_per_sec;
+
+	SDL_LockMutex(t->mutex);
+	bytes_per_sec = t->tgt.freq * t->tgt.channels * 2;
+	while(av_fifo_space(t->fifo) < size && !t->flushing && !t->quit && gen == t->tgt_gen)
+		SDL_CondWait(t->cond, t->mutex);
+	if(!t->flushing && !t->quit && gen == t->tgt_gen) {
+		av_fifo_generic_write(t->fifo, data, size, NULL);
+		if(!isnan(end_pts))
+			t->end_pts = end_pts;
+		else if(!isnan(t->end_pts))
+			t->end_pts += (double)size / bytes_per_sec;
+	}
+	SDL_UnlockMutex(t->mutex);
+}
+
+/* Seeks: what the track has buffered is from before */
+static void mix_track_flush(MixTrack *t) {
+	SDL_LockMutex(t->mutex);
+	t->flushing = 1;
+	av_fifo_reset(t->fifo);
+	t->end_pts = NAN;
+	SDL_CondSignal(t->cond);
+	SDL_UnlockMutex(t->mutex);
+}
+
+static int mix_track_thread(void *arg) {
+
+	MixTrack *t = (MixTrack *)arg;
+	AVCodecContext *codecCtx = t->st->codec;
+	AVPacket pkt1, *pkt = &pkt1, rest;
+	AVFrame *frame = avcodec_alloc_frame();
+	uint8_t *out = NULL;
+	unsigned int out_size = 0;
+	int len, got_frame, out_count, n, frame_size, gen, swr_gen = -1;
+	int64_t channel_layout, start;
+	AudioParams tgt;
+	double pts;
+
+	thread_setup(THREAD_ROLE_DECODE);
+
+	while(frame && packet_queue_get(&t->q, pkt, 1) > 0) {
+		if(pkt->data == flush_pkt.data) {
+			avcodec_flush_buffers(codecCtx);
+			SDL_LockMutex(t->mutex);
+			t->flushing = 0;
+			SDL_UnlockMutex(t->mutex);
+			continue;
+		}
+		pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts * av_q2d(t->st->time_base) : NAN;
+		rest = *pkt;
+		while(rest.size > 0) {
+			start = av_gettime();
+			avcodec_get_frame_defaults(frame);
+			len = avcodec_decode_audio4(codecCtx, frame, &got_frame, &rest);
+			if(len < 0)
+				break;
+			rest.data += len;
+			rest.size -= len;
+			if(!got_frame)
+				continue;
+			/* the device's format, which a track switch can change */
+			SDL_LockMutex(t->mutex);
+			tgt = t->tgt;
+			gen = t->tgt_gen;
+			SDL_UnlockMutex(t->mutex);
+			frame_size = tgt.channels * 2;
+			channel_layout = frame->channel_layout &&
+				av_frame_get_channels(frame) == av_get_channel_layout_nb_channels(frame->channel_layout) ?
+				frame->channel_layout : av_get_default_channel_layout(av_frame_get_channels(frame));
+			if(!t->swr_ctx || frame->format != t->src.fmt ||
+					channel_layout != t->src.channel_layout ||
+					frame->sample_rate != t->src.freq || gen != swr_gen) {
+				swr_free(&t->swr_ctx);
+				t->swr_ctx = swr_alloc_set_opts(NULL,
+						tgt.channel_layout, tgt.fmt, tgt.freq,
+						channel_layout, frame->format, frame->sample_rate, 0, NULL);
+				if(!t->swr_ctx || swr_init(t->swr_ctx) < 0) {
+					fprintf(stderr, "-mix: stream %d: cannot convert its audio\n", t->stream_index);
+					swr_free(&t->swr_ctx);
+					break;
+				}
+				t->src.fmt = frame->format;
+				t->src.channel_layout = channel_layout;
+				t->src.freq = frame->sample_rate;
+				swr_gen = gen;
+			}
+			out_count = (int64_t)frame->nb_samples * tgt.freq / frame->sample_rate + 256;
+			av_fast_malloc(&out, &out_size, out_count * frame_size);
+			if(!out)
+				break;
+			n = swr_convert(t->swr_ctx, &out, out_count,
+					(const uint8_t **)frame->extended_data, frame->nb_samples);
+			t->decode_time += av_gettime() - start;
+			if(!isnan(pts))
+				pts += (double)frame->nb_samples / frame->sample_rate;
+			if(n > 0)
+				mix_track_write(t, out, n * frame_size, pts, gen);
+		}
+		av_free_packet(pkt);
+	}
+	av_free(out);
+	av_free(frame);
+	return 0;
+}
+
+/* Mixes the tracks into size bytes the callback just copied to dst,
+   which start playing at pts (NAN for silence). A track that drifted
+   from it is realigned by dropping its samples or by starting later. */
+static void mix_tracks(VideoState *is, uint8_t *dst, int size, double pts) {
+
+	int bytes_per_sec = is->audio_tgt.freq * is->audio_tgt.channels * 2;
+	int frame_size = is->audio_tgt.channels * 2;
+	int i, n, avail, skip, drop;
+	double head;
+	MixTrack *t;
+
+	for(i = 0; i < atomic_get(&is->mix_active); i++) {
+		t = &is->mix[i];
+		skip = 0;
+		SDL_LockMutex(t->mutex);
+		avail = av_fifo_size(t->fifo);
+		if(!isnan(pts) && !isnan(t->end_pts)) {
+			head = t->end_pts - (double)avail / bytes_per_sec;
+			if(head < pts - MIX_SYNC_THRESHOLD) {
+				drop = FFMIN(avail, (int)((pts - head) * bytes_per_sec) / frame_size * frame_size);
+				av_fifo_drain(t->fifo, drop);
+				avail -= drop;
+				t->resyncs++;
+			} else if(head > pts + MIX_SYNC_THRESHOLD) {
+				skip = FFMIN(size, (int)((head - pts) * bytes_per_sec) / frame_size * frame_size);
+			}
+		}
+		n = FFMIN(avail, size - skip);
+		if(n > 0) {
+			av_fifo_generic_read(t->fifo, t->buf, n, NULL);
+			SDL_CondSignal(t->cond);
+		}
+		SDL_UnlockMutex(t->mutex);
+		if(n < size - skip)
+			t->shortfalls++;
+		if(n > 0) {
+			mix_s16((int16_t *)(dst + skip), (const int16_t *)t->buf, n / 2, t->gain_q);
+			t->samples_mixed += n / 2;
+		}
+	}
+}
+
+/* SDL 1.2 doesn't tell how much the device has queued, so it is worked
+   out from the callback times: the device plays in real time, so what
+   we handed it minus the time since ("lead") grows by what is queued.
+   The callback with the lowest lead is taken to come just as the
+   device started its last buffer; latency is then that buffer and the
+   one just written plus the lead above the lowest. Data that reached
+   the device after the earlier data was due to run out is an underrun;
+   too many of those have decode_thread reopen with a larger buffer. */
+static void audio_output_update(VideoState *is, int64_t start, int size) {
+
+	int bytes_per_sec = is->audio_tgt.freq * is->audio_tgt.channels * 2;
+	int64_t end = clock_now();
+	double period, lead, latency, late;
+
+	if(!bytes_per_sec)
+		return;
+	period = (double)size / bytes_per_sec;
+	if(atomic_xchg_sc(&audio_restarted, 0)) {
+		is->audio_settle_time = start + AUDIO_SETTLE_TIME;
+		is->audio_lead_count = 0;
+	} else if(is->audio_lead_count) {
+		late = (end - is->audio_write_time) / 1000000.0 - is->audio_latency;
+		if(late > 0 && start >= is->audio_settle_time) {
+			is->audio_underruns++;
+			/* the device stalled, the lead no longer says what it holds */
+			is->audio_lead_count = 0;
+			if(start - is->audio_underrun_time > AUDIO_UNDERRUN_WINDOW) {
+				is->audio_underrun_time = start;
+				is->audio_window_underruns = 0;
+			}
+			if(++is->audio_window_underruns >= AUDIO_UNDERRUN_LIMIT &&
+					!audio_buffer_samples && is->audio_samples < AUDIO_BUFFER_MAX &&
+					!atomic_get(&is->audio_resize_req))
+				atomic_set(&is->audio_resize_req, is->audio_samples * 2);
+		}
+	}
+	if(!is->audio_lead_count) {
+		is->audio_lead_time = start;
+		is->audio_lead_bytes = 0;
+	}
+	lead = (double)is->audio_lead_bytes / bytes_per_sec -
+		(start - is->audio_lead_time) / 1000000.0;
+	if(!is->audio_lead_count) {
+		is->audio_lead_min = is->audio_lead_next = lead;
+	} else {
+		is->audio_lead_min = FFMIN(is->audio_lead_min, lead);
+		is->audio_lead_next = FFMIN(is->audio_lead_next, lead);
+	}
+	/* forget old lows slowly, the device may have changed pace */
+	if(++is->audio_lead_count % AUDIO_LEAD_WINDOW == 0) {
+		is->audio_lead_min = is->audio_lead_next;
+		is->audio_lead_next = lead;
+	}
+	is->audio_lead_bytes += size;
+	latency = 2 * period + lead - is->audio_lead_min;
+
+	is->audio_latency_sum += latency;
+	if(!is->audio_latency_count++ || latency < is->audio_latency_min)
+		is->audio_latency_min = latency;
+	if(latency > is->audio_latency_max)
+		is->audio_latency_max = latency;
+
+	clock_set(&is->audio_write_clock, clock_get(&is->audio_clock) -
+			(double)(is->audio_buf_size - is->audio_buf_index) / bytes_per_sec);
+	clock_set(&is->audio_latency, latency);
+	atomic_set(&is->audio_write_time, start);
+}
+
+void audio_callback(void *userdata, Uint8 *stream, int len) {
+	VideoState *is = (VideoState *)userdata;
+	int len1, audio_size, size = len;
+	double pts;
+	int64_t start = clock_now();
+
+	/* -simulate calls us from the main thread, which keeps its own */
+	if(!is->audio_thread_placed && !simulate) {
+		thread_setup(THREAD_ROLE_AUDIO);
+		is->audio_thread_placed = 1;
+	}
+	is->audio_callbacks++;
+
+	while(len > 0) {
+		if(is->audio_buf_index >= is->audio_buf_size) {
+			/* We have already sent all our data; get more */
+			audio_size = audio_decode_frame(is, &pts);
+			if(audio_size < 0) {
+				/* If error, output silence */
+				is->audio_buf = is->silence_buf;
+				atomic_set(&is->audio_buf_size, sizeof(is->silence_buf));
+			} else {
+				if(!is->first_audio_time)
+					is->first_audio_time = av_gettime();
+				audio_size = synchronize_audio(is, (int16_t *)is->audio_buf,
+						audio_size, pts);
+				atomic_set(&is->audio_buf_size, audio_size);
+			}
+			atomic_set(&is->audio_buf_index, 0);
+		}
+		len1 = is->audio_buf_size - is->audio_buf_index;
+		if(len1 > len)
+			len1 = len;
+		memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
+		if(is->mix_active)
+			mix_tracks(is, stream, len1, is->audio_buf == is->silence_buf ? NAN :
+					is->audio_clock - (double)(is->audio_buf_size - is->audio_buf_index) /
+					(is->audio_tgt.freq * is->audio_tgt.channels * 2));
+		len -= len1;
+		stream += len1;
+		atomic_set(&is->audio_buf_index, is->audio_buf_index + len1);
+	}
+	audio_output_update(is, start, size);
+}
+
+/* The audio device: SDL's, or the simulated one with -simulate */
+static int audio_open(SDL_AudioSpec *wanted_spec, SDL_AudioSpec *spec) {
+	SimAudio *a = &sim_audio;
+
+	if(!simulate)
+		return SDL_OpenAudio(wanted_spec, spec);
+
+	*spec = *wanted_spec;
+	spec->size = spec->samples * spec->channels * 2; /* AUDIO_S16SYS */
+	SDL_LockMutex(a->mutex);
+	av_free(a->buf);
+	a->buf = av_malloc(spec->size);
+	if(!a->buf) {
+		SDL_UnlockMutex(a->mutex);
+		SDL_SetError("Out of memory");
+		return -1;
+	}
+	a->spec = *spec;
+	a->paused = 1; /* like SDL, until audio_pause(0) */
+	a->open = 1;
+	SDL_UnlockMutex(a->mutex);
+	return 0;
+}
+
+static void audio_pause(int pause_on) {
+	SimAudio *a = &sim_audio;
+
+	if(!pause_on)
+		atomic_set(&audio_restarted, 1);
+	if(!simulate) {
+		SDL_PauseAudio(pause_on);
+		return;
+	}
+	SDL_LockMutex(a->mutex);
+	if(a->paused && !pause_on) {
+		a->start_time = a->next_time = clock_now();
+		a->played = 0;
+	}
+	a->paused = pause_on;
+	SDL_UnlockMutex(a->mutex);
+}
+
+static void audio_close(void) {
+	SimAudio *a = &sim_audio;
+
+	if(!simulate) {
+		SDL_CloseAudio();
+		return;
+	}
+	/* as with SDL_CloseAudio, a running callback finishes first */
+	SDL_LockMutex(a->mutex);
+	a->open = 0;
+	av_freep(&a->buf);
+	SDL_UnlockMutex(a->mutex);
+}
+
+static Uint32 sdl_refresh_timer_cb(Uint32 interval, void *opaque) {
+	SDL_Event event;
+	event.type = FF_REFRESH_EVENT;
+	event.user.data1 = opaque;
+	SDL_PushEvent(&event);
+	return 0; /* 0 means stop timer */
+}
+
+/* schedule a video refresh in 'delay' ms */
+static void schedule_refresh(VideoState *is, int delay) {
+	if(simulate) {
+		/* simulate_run calls us once the virtual clock gets there */
+		is->sim_refresh_time = clock_now() + delay * 1000;
+		return;
+	}
+	SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+}
+
+/* The refresh timer only runs while there is video, so playing audio
+   alone doesn't wake the main thread ten times a second. Opening a
+   video stream starts it, video_refresh_timer stops it when there is
+   none. */
+static void refresh_start(VideoState *is) {
+	if(!atomic_xchg_sc(&is->refresh_running, 1))
+		schedule_refresh(is, 40);
+}
+
+/* Where displayed pictures go. video_display_picture calls alloc when
+   the picture size changes, lock for the planes to convert the picture
+   into (pix_fmt, YUV420P for the display), then present. lock returns
+   >0 when the sink doesn't want the pixels at all. The display sink
+   runs on the main thread, each rendition's on one task at a time. */
+typedef struct VideoSink {
+	const char *name;
+	int (*open)(struct VideoSink *sink, const char *arg);
+	int (*alloc)(struct VideoSink *sink, VideoState *is, int width, int height);
+	int (*lock)(struct VideoSink *sink, AVPicture *pict);
+	void (*present)(struct VideoSink *sink, VideoState *is, double pts);
+	void (*release)(struct VideoSink *sink);
+	void *priv;
+	int keeps_picture; /* lock returns the last picture, still there */
+	int width, height; /* of the last successful alloc */
+	int frames;
+	int64_t bytes;     /* picture data written out */
+	int64_t busy_time; /* in alloc, lock and present */
+	int64_t first_time, last_time;
+	int pix_fmt;       /* lock's planes, renditions set their own */
+	AVRational sample_aspect_ratio; /* set before alloc, for file headers */
+} VideoSink;
+
+/* null: counts frames, converts nothing */
+static int null_sink_alloc(VideoSink *sink, VideoState *is, int width, int height) {
+	return 0;
+}
+
+static int null_sink_lock(VideoSink *sink, AVPicture *pict) {
+	return 1;
+}
+
+static void null_sink_present(VideoSink *sink, VideoState *is, double pts) {
+}
+
+static void null_sink_release(VideoSink *sink) {
+}
+
+/* sdl: the window, through one YV12 overlay */
+typedef struct SDLSink {
+	SDL_Overlay *bmp;
+	int bmp_size;
+} SDLSink;
+
+static void sdl_sink_release(VideoSink *sink) {
+	SDLSink *s = sink->priv;
+
+	if(s->bmp) {
+		SDL_FreeYUVOverlay(s->bmp);
+		mem_charge(MEM_PICTURES, -s->bmp_size);
+		s->bmp = NULL;
+		s->bmp_size = 0;
+	}
+}
+
+static int sdl_sink_alloc(VideoSink *sink, VideoState *is, int width, int height) {
+	SDLSink *s = sink->priv;
+
+	// we already have one make another, bigger/smaller
+	sdl_sink_release(sink);
+	// Allocate a place to put our YUV image on that screen
+	s->bmp = SDL_CreateYUVOverlay(width,
+			height,
+			SDL_YV12_OVERLAY,
+			screen);
+	if(!s->bmp)
+		return -1;
+	s->bmp_size = width * height * 3 / 2;
+	mem_charge(MEM_PICTURES, s->bmp_size);
+	return 0;
+}
+
+static int sdl_sink_lock(VideoSink *sink, AVPicture *pict) {
+	SDLSink *s = sink->priv;
+
+	SDL_LockYUVOverlay(s->bmp);
+
+	/* point pict at the overlay */
+	memset(pict, 0, sizeof(*pict));
+	pict->data[0] = s->bmp->pixels[0];
+	pict->data[1] = s->bmp->pixels[2];
+	pict->data[2] = s->bmp->pixels[1];
+
+	pict->linesize[0] = s->bmp->pitches[0];
+	pict->linesize[1] = s->bmp->pitches[2];
+	pict->linesize[2] = s->bmp->pitches[1];
+	return 0;
+}
+
+static void sdl_sink_present(VideoSink *sink, VideoState *is, double pts) {
+	SDLSink *s = sink->priv;
+	SDL_Rect rect;
+	float aspect_ratio;
+	int w, h, x, y;
+
+	SDL_UnlockYUVOverlay(s->bmp);
+
+	/* the picture's own size: -vf may have changed it */
+	aspect_ratio = (float)sink->width / sink->height;
+	if(sink->sample_aspect_ratio.num > 0 && sink->sample_aspect_ratio.den > 0)
+		aspect_ratio *= av_q2d(sink->sample_aspect_ratio);
+	h = screen->h;
+	w = ((int)rint(h * aspect_ratio)) & -3;
+
+	if(w > screen->w) {
+		w = screen->w;
+		h = ((int)rint(w / aspect_ratio)) & -3;
+	}
+	x = (screen->w - w) / 2;
+	y = (screen->h - h) / 2;
+
+	rect.x = x;
+	rect.y = y;
+	rect.w = w;
+	rect.h = h;
+	SDL_DisplayYUVOverlay(s->bmp, &rect);
+}
+
+#ifdef __linux__
+/* file: raw YUV420P, or YUV4MPEG2 when the name ends in .y4m. Pictures
+   are converted straight into a large page aligned buffer, which goes
+   out in writes of whole pages. */
+typedef struct FileSink {
+	char *filename;
+	int fd;
+	int y4m;
+	uint8_t *buf;
+	int buf_size, buf_used;
+	int frame_size;
+	int header_done; /* y4m: the size is fixed from here on */
+	int failed;
+} FileSink;
+
+static int file_sink_write(FileSink *f, int size) {
+	int n, done = 0;
+
+	while(done < size) {
+		n = write(f->fd, f->buf + done, size - done);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0) {
+			if(!f->failed)
+				fprintf(stderr, "%s: write error: %s\n", f->filename, strerror(errno));
+			f->failed = 1;
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/* write out all whole pages, keep the tail for the next write */
+static void file_sink_flush(FileSink *f, int all) {
+	int size = all ? f->buf_used : f->buf_used & ~(FILE_SINK_ALIGN - 1);
+
+	if(!size)
+		return;
+	file_sink_write(f, size);
+	memmove(f->buf, f->buf + size, f->buf_used - size);
+	f->buf_used -= size;
+}
+
+static int file_sink_open(VideoSink *sink, const char *arg) {
+	FileSink *f;
+	int len = strlen(arg);
+
+	if(!len) {
+		fprintf(stderr, "-vo file needs a file name\n");
+		return -1;
+	}
+	f = av_mallocz(sizeof(FileSink));
+	if(!f)
+		return -1;
+	f->filename = av_strdup(arg);
+	f->y4m = len > 4 && !strcasecmp(arg + len - 4, ".y4m");
+	f->fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(f->fd < 0) {
+		fprintf(stderr, "%s: %s\n", arg, strerror(errno));
+		av_free(f->filename);
+		av_free(f);
+		return -1;
+	}
+	sink->priv = f;
+	return 0;
+}
+
+static int file_sink_alloc(VideoSink *sink, VideoState *is, int width, int height) {
+	FileSink *f = sink->priv;
+	AVRational rate, sar;
+	const char *chroma = NULL;
+	int size;
+
+	if(f->y4m && f->header_done) {
+		fprintf(stderr, "%s: picture size changed to %dx%d, not written\n",
+				f->filename, width, height);
+		return -1;
+	}
+	if(f->y4m) {
+		switch(sink->pix_fmt) {
+			case PIX_FMT_YUV420P: chroma = "420jpeg"; break;
+			case PIX_FMT_YUV422P: chroma = "422"; break;
+			case PIX_FMT_YUV444P: chroma = "444"; break;
+			case PIX_FMT_GRAY8:   chroma = "mono"; break;
+			default:
+				fprintf(stderr, "%s: no YUV4MPEG2 colorspace for %s\n",
+						f->filename, av_get_pix_fmt_name(sink->pix_fmt));
+				return -1;
+		}
+	}
+	f->frame_size = avpicture_get_size(sink->pix_fmt, width, height);
+	/* room for a frame after the unwritten tail of a flush */
+	size = FFMAX(FILE_SINK_BUFFER_SIZE,
+			FFALIGN(f->frame_size + 64, FILE_SINK_ALIGN) + FILE_SINK_ALIGN);
+	if(size > f->buf_size) {
+		uint8_t *buf;
+		if(posix_memalign((void **)&buf, FILE_SINK_ALIGN, size))
+			return -1;
+		memcpy(buf, f->buf, f->buf_used);
+		free(f->buf);
+		mem_charge(MEM_PICTURES, size - f->buf_size);
+		f->buf = buf;
+		f->buf_size = size;
+	}
+	if(f->y4m) {
+		rate = is->video_st->avg_frame_rate;
+		if(!rate.num || !rate.den)
+			rate = is->video_st->r_frame_rate;
+		if(!rate.num || !rate.den)
+			rate = (AVRational){ 25, 1 };
+		sar = sink->sample_aspect_ratio;
+		f->buf_used += snprintf((char *)f->buf + f->buf_used, 128,
+				"YUV4MPEG2 W%d H%d F%d:%d Ip A%d:%d C%s\n",
+				width, height, rate.num, rate.den, sar.num, sar.den, chroma);
+		f->header_done = 1;
+	}
+	return 0;
+}
+
+static int file_sink_lock(VideoSink *sink, AVPicture *pict) {
+	FileSink *f = sink->priv;
+
+	if(f->buf_used + f->frame_size + 6 > f->buf_size)
+		file_sink_flush(f, 0);
+	if(f->y4m) {
+		memcpy(f->buf + f->buf_used, "FRAME\n", 6);
+		f->buf_used += 6;
+	}
+	avpicture_fill(pict, f->buf + f->buf_used, sink->pix_fmt, sink->width, sink->height);
+	return 0;
+}
+
+static void file_sink_present(VideoSink *sink, VideoState *is, double pts) {
+	FileSink *f = sink->priv;
+
+	f->buf_used += f->frame_size;
+	sink->bytes += f->frame_size;
+}
+
+static void file_sink_release(VideoSink *sink) {
+	FileSink *f = sink->priv;
+
+	if(!f)
+		return;
+	file_sink_flush(f, 1);
+	close(f->fd);
+	free(f->buf);
+	mem_charge(MEM_PICTURES, -f->buf_size);
+	av_free(f->filename);
+	av_freep(&sink->priv);
+}
+
+/* shm: a ring of pictures in POSIX shared memory for other processes.
+   The object starts with this header; slot i is at data_offset +
+   i * slot_size and holds the packed planes of pix_fmt. write_count goes up
+   after a slot is complete, so the newest picture is in slot
+   (write_count - 1) % nb_slots. A reader that copies a slot and then
+   finds write_count moved by nb_slots or more has to drop the copy.
+   When the picture size changes the object is resized and generation
+   goes up; readers then have to map it again. */
+typedef struct ShmRingHeader {
+	char magic[8];
+	uint32_t generation;
+	uint32_t width, height;
+	int32_t pix_fmt;  /* libavutil PixelFormat */
+	uint32_t nb_slots;
+	uint64_t data_offset, slot_size;
+	volatile uint64_t write_count;
+	double pts[SHM_RING_SLOTS];
+} ShmRingHeader;
+
+typedef struct ShmSink {
+	char name[256];
+	int fd;
+	ShmRingHeader *ring;
+	size_t map_size;
+	uint32_t generation;
+} ShmSink;
+
+static int shm_sink_open(VideoSink *sink, const char *arg) {
+	ShmSink *m;
+
+	m = av_mallocz(sizeof(ShmSink));
+	if(!m)
+		return -1;
+	snprintf(m->name, sizeof(m->name), "%s%s", arg[0] == '/' ? "" : "/",
+			arg[0] ? arg : "tutorial07");
+	m->fd = shm_open(m->name, O_RDWR | O_CREAT, 0644);
+	if(m->fd < 0) {
+		fprintf(stderr, "shm_open %s: %s\n", m->name, strerror(errno));
+		av_free(m);
+		return -1;
+	}
+	sink->priv = m;
+	return 0;
+}
+
+static int shm_sink_alloc(VideoSink *sink, VideoState *is, int width, int height) {
+	ShmSink *m = sink->priv;
+	uint64_t data_offset = FFALIGN(sizeof(ShmRingHeader), FILE_SINK_ALIGN);
+	uint64_t slot_size = FFALIGN(avpicture_get_size(sink->pix_fmt, width, height), 64);
+	size_t size = data_offset + slot_size * SHM_RING_SLOTS;
+
+	if(m->ring) {
+		munmap(m->ring, m->map_size);
+		mem_charge(MEM_PICTURES, -(int64_t)m->map_size);
+		m->ring = NULL;
+	}
+	if(ftruncate(m->fd, size) < 0) {
+		fprintf(stderr, "%s: %s\n", m->name, strerror(errno));
+		return -1;
+	}
+	m->ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+	if(m->ring == MAP_FAILED) {
+		m->ring = NULL;
+		return -1;
+	}
+	m->map_size = size;
+	mem_charge(MEM_PICTURES, size);
+
+	memset(m->ring, 0, sizeof(ShmRingHeader));
+	m->ring->generation = ++m->generation;
+	m->ring->width = width;
+	m->ring->height = height;
+	m->ring->pix_fmt = sink->pix_fmt;
+	m->ring->nb_slots = SHM_RING_SLOTS;
+	m->ring->data_offset = data_offset;
+	m->ring->slot_size = slot_size;
+	__sync_synchronize();
+	memcpy(m->ring->magic, SHM_RING_MAGIC, 8);
+	return 0;
+}
+
+static int shm_sink_lock(VideoSink *sink, AVPicture *pict) {
+	ShmSink *m = sink->priv;
+	ShmRingHeader *r = m->ring;
+
+	avpicture_fill(pict, (uint8_t *)r + r->data_offset +
+			(r->write_count % r->nb_slots) * r->slot_size,
+			sink->pix_fmt, sink->width, sink->height);
+	return 0;
+}
+
+static void shm_sink_present(VideoSink *sink, VideoState *is, double pts) {
+	ShmSink *m = sink->priv;
+	ShmRingHeader *r = m->ring;
+
+	r->pts[r->write_count % r->nb_slots] = pts;
+	/* the picture must be visible before the count that publishes it */
+	__sync_synchronize();
+	r->write_count++;
+	sink->bytes += avpicture_get_size(sink->pix_fmt, sink->width, sink->height);
+}
+
+static void shm_sink_release(VideoSink *sink) {
+	ShmSink *m = sink->priv;
+
+	if(!m)
+		return;
+	if(m->ring) {
+		munmap(m->ring, m->map_size);
+		mem_charge(MEM_PICTURES, -(int64_t)m->map_size);
+	}
+	close(m->fd);
+	shm_unlink(m->name);
+	av_freep(&sink->priv);
+}
+#endif
+
+static SDLSink sdl_sink_priv;
+
+static VideoSink video_sinks[] = {
+	{ "sdl", NULL, sdl_sink_alloc, sdl_sink_lock, sdl_sink_present, sdl_sink_release, &sdl_sink_priv, 1, .pix_fmt = PIX_FMT_YUV420P },
+	{ "null", NULL, null_sink_alloc, null_sink_lock, null_sink_present, null_sink_release, .pix_fmt = PIX_FMT_YUV420P },
+#ifdef __linux__
+	{ "file", file_sink_open, file_sink_alloc, file_sink_lock, file_sink_present, file_sink_release, .pix_fmt = PIX_FMT_YUV420P },
+	{ "shm", shm_sink_open, shm_sink_alloc, shm_sink_lock, shm_sink_present, shm_sink_release, .pix_fmt = PIX_FMT_YUV420P },
+#endif
+};
+
+static VideoSink *video_sink = &video_sinks[0];
+static const char *video_sink_arg = "";
+
+/* name[:arg] */
+static VideoSink *video_sink_find(const char *spec, const char **arg) {
+	const char *colon = strchr(spec, ':');
+	int i, len = colon ? colon - spec : strlen(spec);
+
+	for(i = 0; i < FF_ARRAY_ELEMS(video_sinks); i++) {
+		if(strlen(video_sinks[i].name) == len && !strncmp(video_sinks[i].name, spec, len)) {
+			*arg = colon ? colon + 1 : "";
+			return &video_sinks[i];
+		}
+	}
+	fprintf(stderr, "unknown video output %s\n", spec);
+	return NULL;
+}
+
+/* -vo */
+static int video_sink_select(const char *spec) {
+	VideoSink *sink = video_sink_find(spec, &video_sink_arg);
+
+	if(!sink)
+		return -1;
+	video_sink = sink;
+	return 0;
+}
+
+static void video_sink_print_stats(VideoSink *sink) {
+	double wall = (sink->last_time - sink->first_time) / 1000000.0;
+
+	if(!sink->frames)
+		return;
+	printf("video output %s: %d frames, %.1f fps, %.1f ms per frame in the sink",
+			sink->name, sink->frames, wall > 0 ? (sink->frames - 1) / wall : 0.0,
+			sink->busy_time / 1000.0 / sink->frames);
+	if(sink->bytes)
+		printf(", %.1f MB/s", wall > 0 ? sink->bytes / wall / 1000000.0 : 0.0);
+	printf("\n");
+}
+
+/* -rendition: every decoded picture is also scaled to each rendition's
+   size and format and handed to its own sink. The scaling runs on the
+   task pool, all renditions of a picture at once, while video_thread
+   waits; the decode is shared. */
+typedef struct Rendition {
+	char spec[256];
+	VideoSink sink;   /* a copy of the video_sinks[] entry */
+	const char *sink_arg;
+	int width, height; /* height 0 keeps the aspect ratio */
+	int pix_fmt;
+	struct SwsContext *sws_ctx;
+	AVFrame *frame;   /* the picture being fanned out */
+	int src_width, src_height, src_pix_fmt;
+	AVRational src_sar;
+	double pts;
+	int64_t scale_time;
+} Rendition;
+
+static Rendition renditions[MAX_RENDITIONS];
+static int nb_renditions;
+
+/* WxH[,pix_fmt]=output */
+static int rendition_add(const char *spec) {
+	Rendition *r;
+	const char *eq = strchr(spec, '='), *comma;
+	char fmt[64];
+	VideoSink *sink;
+	int len;
+
+	if(nb_renditions >= MAX_RENDITIONS) {
+		fprintf(stderr, "at most %d renditions\n", MAX_RENDITIONS);
+		return -1;
+	}
+	r = &renditions[nb_renditions];
+	memset(r, 0, sizeof(Rendition));
+	r->pix_fmt = PIX_FMT_YUV420P;
+	if(!eq || sscanf(spec, "%dx%d", &r->width, &r->height) != 2 ||
+			r->width <= 0 || r->height < 0) {
+		fprintf(stderr, "-rendition %s: expected WxH[,pix_fmt]=output\n", spec);
+		return -1;
+	}
+	comma = strchr(spec, ',');
+	if(comma && comma < eq) {
+		len = FFMIN(eq - comma - 1, sizeof(fmt) - 1);
+		memcpy(fmt, comma + 1, len);
+		fmt[len] = 0;
+		r->pix_fmt = av_get_pix_fmt(fmt);
+		if(r->pix_fmt == PIX_FMT_NONE) {
+			fprintf(stderr, "-rendition %s: unknown pixel format %s\n", spec, fmt);
+			return -1;
+		}
+	}
+	av_strlcpy(r->spec, spec, sizeof(r->spec));
+	sink = video_sink_find(r->spec + (eq - spec) + 1, &r->sink_arg);
+	if(!sink)
+		return -1;
+	if(sink == &video_sinks[0]) {
+		fprintf(stderr, "-rendition %s: the window is for playback only\n", spec);
+		return -1;
+	}
+	r->sink = *sink;
+	r->sink.pix_fmt = r->pix_fmt;
+	nb_renditions++;
+	return 0;
+}
+
+static int renditions_open(void) {
+	int i;
+
+	for(i = 0; i < nb_renditions; i++) {
+		if(renditions[i].sink.open &&
+				renditions[i].sink.open(&renditions[i].sink, renditions[i].sink_arg) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void rendition_task(void *arg) {
+	Rendition *r = (Rendition *)arg;
+	VideoSink *sink = &r->sink;
+	AVPicture pict;
+	int64_t start = av_gettime(), t;
+	int w = r->width, h = r->height, ret;
+
+	if(!h)
+		h = FFMAX(((int64_t)w * r->src_height / r->src_width) & ~1, 2);
+	if(sink->width != w || sink->height != h) {
+		sink->width = w;
+		sink->height = h;
+		/* the scaled picture keeps the source's display aspect */
+		if(r->src_sar.num)
+			av_reduce(&sink->sample_aspect_ratio.num, &sink->sample_aspect_ratio.den,
+					(int64_t)r->src_sar.num * r->src_width * h,
+					(int64_t)r->src_sar.den * r->src_height * w, INT_MAX);
+		if(sink->alloc(sink, global_video_state, w, h) < 0)
+			sink->width = sink->height = 0;
+	}
+	ret = sink->width ? sink->lock(sink, &pict) : -1;
+	sink->busy_time += av_gettime() - start;
+	if(ret < 0)
+		return;
+
+	if(ret == 0) {
+		t = av_gettime();
+		r->sws_ctx = sws_getCachedContext(r->sws_ctx,
+				r->src_width, r->src_height, r->src_pix_fmt,
+				w, h, r->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+		if(r->sws_ctx)
+			sws_scale(r->sws_ctx, (const uint8_t * const *)r->frame->data, r->frame->linesize,
+					0, r->src_height, pict.data, pict.linesize);
+		r->scale_time += av_gettime() - t;
+	}
+
+	t = av_gettime();
+	sink->present(sink, global_video_state, r->pts);
+	sink->last_time = av_gettime();
+	sink->busy_time += sink->last_time - t;
+	if(!sink->frames++)
+		sink->first_time = sink->last_time;
+}
+
+/* called by video_thread with every decoded picture */
+void renditions_run(VideoState *is, AVFrame *frame, double pts) {
+	AVCodecContext *codecCtx = is->video_st->codec;
+	TaskGroup group;
+	int i;
+
+	task_group_init(&group);
+	for(i = 0; i < nb_renditions; i++) {
+		renditions[i].frame = frame;
+		renditions[i].src_width = codecCtx->width;
+		renditions[i].src_height = codecCtx->height;
+		renditions[i].src_pix_fmt = codecCtx->pix_fmt;
+		renditions[i].src_sar = codecCtx->sample_aspect_ratio;
+		renditions[i].pts = pts;
+		task_submit(task_pool, &group, rendition_task, &renditions[i]);
+	}
+	task_group_wait(task_pool, &group);
+}
+
+static void renditions_close(void) {
+	Rendition *r;
+	int i;
+
+	for(i = 0; i < nb_renditions; i++) {
+		r = &renditions[i];
+		if(r->sink.frames) {
+			printf("rendition %s: %.2f ms per picture scaling\n", r->spec,
+					r->scale_time / 1000.0 / r->sink.frames);
+			video_sink_print_stats(&r->sink);
+		}
+		r->sink.release(&r->sink);
+		sws_freeContext(r->sws_ctx);
+		r->sws_ctx = NULL;
+	}
+}
+
+/* One horizontal band of a picture to convert into the video sink */
+typedef struct ConvertSlice {
+	VideoState *is;
+	VideoPicture *vp;
+	AVPicture *dst;
+	int index;
+	int y, h;
+	const uint8_t *dirty; /* only copy the bands set here, or NULL */
+} ConvertSlice;
+
+typedef struct SubtitleBlend {
+	AVPicture *dst;
+	SubPicture *sp;
+	int w, h;
+} SubtitleBlend;
+
+/* Every slice has its own SwsContext; since the picture is not scaled
+   vertically, slices convert independently of each other. */
+static void convert_slice_task(void *arg) {
+
+	ConvertSlice *slice = (ConvertSlice *)arg;
+	VideoPicture *vp = slice->vp;
+	struct SwsContext **sws_ctx = &slice->is->sws_ctx[slice->index];
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(vp->pix_fmt);
+	const uint8_t *src[4];
+	uint8_t *dst[4];
+	int i, b, y, y1;
+
+	if(vp->pix_fmt == PIX_FMT_YUV420P && !slice->dirty) {
+		/* decoded or filtered to what SDL takes, no sws_scale needed */
+		for(i = 0; i < 3; i++) {
+			int shift = i ? 1 : 0, w = i ? (vp->width + 1) >> 1 : vp->width;
+			for(y = slice->y >> shift; y < (slice->y + slice->h + shift) >> shift; y++)
+				memcpy(slice->dst->data[i] + y * slice->dst->linesize[i],
+						vp->pict.data[i] + y * vp->pict.linesize[i], w);
+		}
+		return;
+	}
+	if(slice->dirty) {
+		/* YUV420P already: the changed rows go straight across */
+		for(b = slice->y / DIRTY_BAND_HEIGHT; b * DIRTY_BAND_HEIGHT < slice->y + slice->h; b++) {
+			if(!slice->dirty[b])
+				continue;
+			y1 = FFMIN((b + 1) * DIRTY_BAND_HEIGHT, vp->height);
+			for(i = 0; i < 3; i++) {
+				int shift = i ? 1 : 0, w = i ? (vp->width + 1) >> 1 : vp->width;
+				for(y = (b * DIRTY_BAND_HEIGHT) >> shift; y < (y1 + shift) >> shift; y++)
+					memcpy(slice->dst->data[i] + y * slice->dst->linesize[i],
+							vp->pict.data[i] + y * vp->pict.linesize[i], w);
+			}
+		}
+		return;
+	}
+
+	*sws_ctx = sws_getCachedContext
+		(
+		 *sws_ctx,
+		 vp->width,
+		 slice->h,
+		 vp->pix_fmt,
+		 vp->width,
+		 slice->h,
+		 PIX_FMT_YUV420P,
+		 SWS_BILINEAR,
+		 NULL,
+		 NULL,
+		 NULL
+		);
+	if(!*sws_ctx)
+		return;
+
+	for(i = 0; i < 4; i++) {
+		src[i] = vp->pict.data[i];
+		if(src[i])
+			src[i] += ((i == 1 || i == 2) ? slice->y >> desc->log2_chroma_h : slice->y)
+				* vp->pict.linesize[i];
+	}
+	dst[0] = slice->dst->data[0] + slice->y * slice->dst->linesize[0];
+	dst[1] = slice->dst->data[1] + (slice->y >> 1) * slice->dst->linesize[1];
+	dst[2] = slice->dst->data[2] + (slice->y >> 1) * slice->dst->linesize[2];
+	dst[3] = NULL;
+
+	// Convert the image into YUV format that SDL uses
+	sws_scale
+		(
+		 *sws_ctx,
+		 src,
+		 vp->pict.linesize,
+		 0,
+		 slice->h,
+		 dst,
+		 slice->dst->linesize
+		);
+}
+
+static void subtitle_blend_task(void *arg) {
+
+	SubtitleBlend *blend = (SubtitleBlend *)arg;
+	int i;
+
+	for (i = 0; i < blend->sp->sub.num_rects; i++)
+		blend_subrect(blend->dst, blend->sp->sub.rects[i],
+				blend->w, blend->h);
+}
+
+/* Background and colours; only the luma changes from picture to picture */
+static void vis_picture_init(Vis *v, uint8_t *pict) {
+	int wave_h = v->mode & VIS_WAVES ? (v->mode & VIS_SPECTRUM ? VIS_HEIGHT / 2 : VIS_HEIGHT) : 0;
+	uint8_t *u = pict + VIS_WIDTH * VIS_HEIGHT;
+	uint8_t *cr = u + VIS_WIDTH * VIS_HEIGHT / 4;
+
+	memset(pict, 16, VIS_WIDTH * VIS_HEIGHT);
+	/* waveform in green, spectrum in orange */
+	memset(u, 96, VIS_WIDTH * wave_h / 4);
+	memset(cr, 96, VIS_WIDTH * wave_h / 4);
+	memset(u + VIS_WIDTH * wave_h / 4, 80, VIS_WIDTH * (VIS_HEIGHT - wave_h) / 4);
+	memset(cr + VIS_WIDTH * wave_h / 4, 170, VIS_WIDTH * (VIS_HEIGHT - wave_h) / 4);
+}
+
+/* Log spaced columns from VIS_MIN_FREQ to Nyquist, each at least a bin */
+static void vis_bins_init(Vis *v, int freq) {
+	double nyquist = freq / 2.0, f0, f1;
+	int x;
+
+	for(x = 0; x < VIS_WIDTH; x++) {
+		f0 = VIS_MIN_FREQ * pow(nyquist / VIS_MIN_FREQ, (double)x / VIS_WIDTH);
+		f1 = VIS_MIN_FREQ * pow(nyquist / VIS_MIN_FREQ, (double)(x + 1) / VIS_WIDTH);
+		v->bin_lo[x] = av_clip(f0 * VIS_FFT_SIZE / freq, 1, VIS_FFT_SIZE / 2 - 1);
+		v->bin_hi[x] = av_clip(f1 * VIS_FFT_SIZE / freq, v->bin_lo[x] + 1, VIS_FFT_SIZE / 2);
+	}
+	v->bins_freq = freq;
+}
+
+/* Draws the audio at the audio clock into v->back; -1 if nothing moved */
+static int vis_render(VideoState *is, Vis *v, double *last_clock) {
+
+	int wave_h = v->mode & VIS_WAVES ? (v->mode & VIS_SPECTRUM ? VIS_HEIGHT / 2 : VIS_HEIGHT) : 0;
+	int spec_h = VIS_HEIGHT - wave_h, mid = wave_h / 2;
+	int top[VIS_WIDTH], bottom[VIS_WIDTH];
+	int x, y, i, k, freq, per_column, lo, hi;
+	int64_t pos;
+	double clock = get_audio_clock(is);
+	/* a full scale sine through the Hann window, as 0 dB */
+	double scale = 1.0 / ((32768.0 * VIS_FFT_SIZE / 4) * (32768.0 * VIS_FFT_SIZE / 4));
+	float p;
+	uint8_t *row;
+
+	SDL_LockMutex(v->mutex);
+	if(!v->freq || clock == *last_clock) {
+		SDL_UnlockMutex(v->mutex);
+		return -1;
+	}
+	*last_clock = clock;
+	freq = v->freq;
+	pos = v->ring_pos - (int64_t)((v->ring_end_pts - clock) * freq);
+	pos = FFMAX(FFMIN(pos, v->ring_pos), v->ring_pos - VIS_RING_SIZE + VIS_FFT_SIZE);
+	if(spec_h) {
+		for(i = 0; i < VIS_FFT_SIZE; i++)
+			v->samples[i] = v->ring[(pos - VIS_FFT_SIZE + i) & (VIS_RING_SIZE - 1)];
+	}
+	if(wave_h) {
+		per_column = FFMAX(freq * VIS_WAVE_SECONDS / VIS_WIDTH, 1);
+		/* a seek, or too far behind: start over */
+		if(v->wave_pos > pos || pos - v->wave_pos > VIS_RING_SIZE / 2) {
+			memset(v->wave_min, 0, sizeof(v->wave_min));
+			memset(v->wave_max, 0, sizeof(v->wave_max));
+			v->wave_pos = pos;
+		}
+		for(; v->wave_pos + per_column <= pos; v->wave_pos += per_column) {
+			lo = hi = 0;
+			for(i = 0; i < per_column; i++) {
+				k = v->ring[(v->wave_pos + i) & (VIS_RING_SIZE - 1)];
+				lo = FFMIN(lo, k);
+				hi = FFMAX(hi, k);
+			}
+			v->wave_min[v->wave_head] = lo;
+			v->wave_max[v->wave_head] = hi;
+			v->wave_head = (v->wave_head + 1) % VIS_WIDTH;
+		}
+	}
+	SDL_UnlockMutex(v->mutex);
+
+	/* scrolling waveform, the newest column on the right */
+	if(wave_h) {
+		for(x = 0; x < VIS_WIDTH; x++) {
+			i = (v->wave_head + x) % VIS_WIDTH;
+			top[x] = mid - v->wave_max[i] * mid / 32768;
+			bottom[x] = mid - v->wave_min[i] * mid / 32768;
+		}
+		for(y = 0; y < wave_h; y++) {
+			row = v->back + y * VIS_WIDTH;
+			for(x = 0; x < VIS_WIDTH; x++)
+				row[x] = y >= top[x] && y <= bottom[x] ? 235 : y == mid ? 60 : 16;
+		}
+	}
+
+	/* spectrum: the loudest bin of each column, VIS_RANGE_DB high */
+	if(spec_h) {
+		vis_window(v->fft, v->samples, v->window, VIS_FFT_SIZE);
+		av_rdft_calc(v->rdft, v->fft);
+		vis_power(v->power, v->fft, VIS_FFT_SIZE / 2);
+		if(v->bins_freq != freq)
+			vis_bins_init(v, freq);
+		for(x = 0; x < VIS_WIDTH; x++) {
+			p = 0;
+			for(k = v->bin_lo[x]; k < v->bin_hi[x]; k++)
+				p = FFMAX(p, v->power[k]);
+			y = (int)((10 * log10(p * scale + 1e-20) + VIS_RANGE_DB) * spec_h / VIS_RANGE_DB);
+			top[x] = spec_h - av_clip(y, 0, spec_h);
+		}
+		for(y = 0; y < spec_h; y++) {
+			row = v->back + (wave_h + y) * VIS_WIDTH;
+			for(x = 0; x < VIS_WIDTH; x++)
+				row[x] = y >= top[x] ? 200 : 16;
+		}
+	}
+	return 0;
+}
+
+static int vis_thread(void *arg) {
+
+	VideoState *is = (VideoState *)arg;
+	Vis *v = vis;
+	int64_t next, delay, start;
+	double last_clock = NAN;
+	uint8_t *tmp;
+	SDL_Event event;
+	int pending;
+
+	thread_setup(THREAD_ROLE_VIDEO);
+	next = av_gettime();
+	while(!atomic_get(&v->quit) && !atomic_get(&is->quit)) {
+		next += 1000000 / VIS_FPS;
+		delay = next - av_gettime();
+		if(delay > 0)
+			SDL_Delay(delay / 1000);
+		else if(delay < -1000000 / VIS_FPS)
+			next = av_gettime(); /* fell behind, don't try to catch up */
+		if(!is->first_audio_time)
+			continue;
+		start = av_gettime();
+		if(vis_render(is, v, &last_clock) == 0) {
+			SDL_LockMutex(v->mutex);
+			tmp = v->front;
+			v->front = v->back;
+			v->back = tmp;
+			pending = v->pending;
+			v->pending = 1;
+			SDL_UnlockMutex(v->mutex);
+			/* one event at a time, the main thread shows the newest */
+			if(!pending) {
+				event.type = FF_VIS_EVENT;
+				event.user.data1 = is;
+				SDL_PushEvent(&event);
+			}
+			v->frames++;
+		}
+		v->busy_time += av_gettime() - start;
+	}
+	return 0;
+}
+
+/* Main thread: front to the sink, whose overlay stays for the next one */
+static void vis_display(VideoState *is) {
+
+	VideoSink *sink = video_sink;
+	AVPicture pict;
+	uint8_t *src;
+	int64_t start = av_gettime();
+	int i, plane, w, h;
+
+	if(sink->width != VIS_WIDTH || sink->height != VIS_HEIGHT) {
+		sink->width = VIS_WIDTH;
+		sink->height = VIS_HEIGHT;
+		sink->sample_aspect_ratio = (AVRational){1, 1};
+		if(sink->alloc(sink, is, VIS_WIDTH, VIS_HEIGHT) < 0)
+			sink->width = sink->height = 0;
+	}
+	if(!sink->width || sink->lock(sink, &pict) < 0) {
+		sink->busy_time += av_gettime() - start;
+		return;
+	}
+	SDL_LockMutex(vis->mutex);
+	src = vis->front;
+	for(plane = 0; plane < 3; plane++) {
+		w = plane ? VIS_WIDTH / 2 : VIS_WIDTH;
+		h = plane ? VIS_HEIGHT / 2 : VIS_HEIGHT;
+		for(i = 0; i < h; i++)
+			memcpy(pict.data[plane] + i * pict.linesize[plane], src + i * w, w);
+		src += w * h;
+	}
+	vis->pending = 0;
+	SDL_UnlockMutex(vis->mutex);
+
+	sink->present(sink, is, 0);
+	sink->last_time = av_gettime();
+	sink->busy_time += sink->last_time - start;
+	if(!sink->frames++)
+		sink->first_time = sink->last_time;
+}
+
+static void vis_free(Vis *v) {
+	if(v->rdft)
+		av_rdft_end(v->rdft);
+	av_free(v->fft);
+	av_free(v->window);
+	av_free(v->power);
+	av_free(v->front);
+	av_free(v->back);
+	if(v->mutex)
+		SDL_DestroyMutex(v->mutex);
+	av_free(v);
+}
+
+/* In decode_thread, once it knows there is audio and no video */
+static int vis_open(VideoState *is, int mode) {
+
+	Vis *v = av_mallocz(sizeof(Vis));
+	int size = VIS_WIDTH * VIS_HEIGHT * 3 / 2, i;
+
+	if(!v)
+		return -1;
+	v->mode = mode;
+	v->mutex = SDL_CreateMutex();
+	v->rdft = av_rdft_init(VIS_FFT_BITS, DFT_R2C);
+	v->fft = av_malloc(VIS_FFT_SIZE * sizeof(float));
+	v->window = av_malloc(VIS_FFT_SIZE * sizeof(float));
+	v->power = av_malloc(VIS_FFT_SIZE / 2 * sizeof(float));
+	v->front = av_malloc(size);
+	v->back = av_malloc(size);
+	if(!v->mutex || !v->rdft || !v->fft || !v->window || !v->power || !v->front || !v->back) {
+		fprintf(stderr, "-vis: out of memory\n");
+		vis_free(v);
+		return -1;
+	}
+	for(i = 0; i < VIS_FFT_SIZE; i++)
+		v->window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / (VIS_FFT_SIZE - 1));
+	vis_picture_init(v, v->front);
+	vis_picture_init(v, v->back);
+	v->kernels = vis_kernels_init();
+	v->start_time = av_gettime();
+	vis = v;
+	v->tid = SDL_CreateThread(vis_thread, is);
+	return 0;
+}
+
+/* Main thread, after decode_thread is gone */
+static void vis_close(void) {
+
+	double wall;
+
+	if(!vis)
+		return;
+	atomic_set(&vis->quit, 1);
+	SDL_WaitThread(vis->tid, NULL);
+	wall = (av_gettime() - vis->start_time) / 1000000.0;
+	printf("visualization: %d pictures, %.1f fps, %.2f ms each (%s kernels), %.1f%% of a core\n",
+			vis->frames, wall > 0 ? vis->frames / wall : 0.0,
+			vis->frames ? vis->busy_time / 1000.0 / vis->frames : 0.0, vis->kernels,
+			wall > 0 ? vis->busy_time / 10000.0 / wall : 0.0);
+	vis_free(vis);
+	vis = NULL;
+}
+
+void video_display_picture(VideoState *is, VideoPicture *vp) {
+
+	VideoSink *sink = video_sink;
+    SubPicture *sp = NULL;
+    AVPicture pict;
+	//AVPicture pict;
+	//int i;
+    int i, ret;
+	const AVPixFmtDescriptor *desc;
+	ConvertSlice slices[MAX_CONVERT_SLICES];
+	SubtitleBlend blend;
+	TaskGroup convert_group, frame_group;
+	int nb_slices, slice_h, nb_dirty = 0;
+	uint8_t dirty[MAX_DIRTY_BANDS];
+	int64_t start;
+
+	if(!vp->pict.data[0])
+		return;
+
+	/* we are in the main thread, so the sink can be (re)allocated right here */
+	start = av_gettime();
+	if(sink->width != vp->width || sink->height != vp->height) {
+		sink->width = vp->width;
+		sink->height = vp->height;
+		sink->sample_aspect_ratio = vp->sample_aspect_ratio.num ?
+			vp->sample_aspect_ratio : is->video_st->codec->sample_aspect_ratio;
+		is->shown_bands = 0;
+		if(sink->alloc(sink, is, vp->width, vp->height) < 0)
+			sink->width = sink->height = 0;
+	}
+
+	if(is->subtitle_st && is->subpq_size > 0) {
+		sp = &is->subpq[is->subpq_rindex];
+		if(vp->pts < sp->pts + ((float) sp->sub.start_display_time / 1000))
+			sp = NULL;
+	}
+	/* Compare with the picture the sink still has. Nothing changed:
+	   it stays as it is, not converted and not shown again. Some bands
+	   changed: only those are copied, if no conversion is needed. A
+	   subtitle on it means the next picture is converted whole. */
+	if(sink->keeps_picture && vp->nb_bands && vp->nb_bands == is->shown_bands && !sp) {
+		for(i = 0; i < vp->nb_bands; i++) {
+			dirty[i] = vp->band_hash[i] != is->shown_hash[i];
+			nb_dirty += dirty[i];
+		}
+		if(!nb_dirty) {
+			is->static_skipped++;
+			sink->busy_time += av_gettime() - start;
+			return;
+		}
+		if(vp->pix_fmt != PIX_FMT_YUV420P)
+			nb_dirty = vp->nb_bands;
+	}
+	if(nb_dirty && nb_dirty < vp->nb_bands) {
+		is->static_partial++;
+		is->bands_converted += nb_dirty;
+		is->bands_partial += vp->nb_bands;
+	} else {
+		nb_dirty = 0;
+	}
+	is->shown_bands = sp ? 0 : vp->nb_bands;
+	memcpy(is->shown_hash, vp->band_hash, vp->nb_bands * sizeof(uint64_t));
+
+	ret = sink->width ? sink->lock(sink, &pict) : -1;
+	sink->busy_time += av_gettime() - start;
+	if(ret < 0) {
+		is->shown_bands = 0;
+		return;
+	}
+
+	if(ret == 0) {
+		/* Split the conversion into bands for the task pool. Paletted and
+		   bitstream formats can't be cut at arbitrary rows. Only 4:2:0
+		   YUV keeps its chroma rows as they are; for anything else
+		   swscale filters chroma vertically, and the taps cut off at a
+		   band's edges would show as seams. */
+		desc = av_pix_fmt_desc_get(vp->pix_fmt);
+		nb_slices = 1;
+		if(task_pool && desc && desc->log2_chroma_h == 1 && desc->nb_components >= 3 &&
+				!(desc->flags & (PIX_FMT_PAL | PIX_FMT_PSEUDOPAL | PIX_FMT_BITSTREAM |
+						PIX_FMT_HWACCEL | PIX_FMT_RGB)))
+			nb_slices = FFMIN(FFMIN(task_pool->nb_workers, MAX_CONVERT_SLICES),
+					vp->height / MIN_CONVERT_SLICE_HEIGHT);
+		if(nb_slices < 1)
+			nb_slices = 1;
+		slice_h = FFALIGN((vp->height + nb_slices - 1) / nb_slices, 16);
+		nb_slices = (vp->height + slice_h - 1) / slice_h;
+
+		task_group_init(&convert_group);
+		task_group_init(&frame_group);
+		for(i = 0; i < nb_slices; i++) {
+			slices[i].is = is;
+			slices[i].vp = vp;
+			slices[i].dst = &pict;
+			slices[i].index = i;
+			slices[i].y = i * slice_h;
+			slices[i].h = FFMIN(slice_h, vp->height - slices[i].y);
+			slices[i].dirty = nb_dirty ? dirty : NULL;
+			task_submit(task_pool, &convert_group, convert_slice_task, &slices[i]);
+		}
+		is->frames_converted++;
+		is->frames_copied += vp->pix_fmt == PIX_FMT_YUV420P;
+
+        if (sp)
+		{
+			/* blending must wait for the whole frame to be converted */
+			blend.dst = &pict;
+			blend.sp = sp;
+			blend.w = vp->width;
+			blend.h = vp->height;
+			task_group_then(task_pool, &convert_group, &frame_group,
+					subtitle_blend_task, &blend);
+        }
+
+		task_group_wait(task_pool, &convert_group);
+		task_group_wait(task_pool, &frame_group);
+	}
+
+	start = av_gettime();
+	sink->present(sink, is, vp->pts);
+	sink->last_time = av_gettime();
+	sink->busy_time += sink->last_time - start;
+	if(!sink->frames++)
+		sink->first_time = sink->last_time;
+
+	if(!is->first_video_time)
+		is->first_video_time = av_gettime();
+}
+
+void video_display(VideoState *is) {
+	video_display_picture(is, &is->pictq[is->pictq_rindex]);
+}
+
+static void frame_buffer_unref(VideoState *is, FrameBuffer *buf) {
+
+	SDL_LockMutex(is->buffer_pool_mutex);
+	if(--buf->refcount == 0) {
+		buf->next = is->buffer_pool;
+		is->buffer_pool = buf;
+	}
+	SDL_UnlockMutex(is->buffer_pool_mutex);
+}
+
+static void frame_buffer_free(FrameBuffer *buf) {
+	mem_charge(MEM_FRAMES, -buf->charged);
+#ifdef __linux__
+	if(buf->mapping != FRAME_BLOCK_MALLOC)
+		munmap(buf->block, buf->size);
+	else
+#endif
+	memalign_free(buf->block);
+	av_free(buf);
+}
+
+static void frame_buffer_pool_free(VideoState *is) {
+
+	FrameBuffer *buf;
+
+	SDL_LockMutex(is->buffer_pool_mutex);
+	while((buf = is->buffer_pool) != NULL) {
+		is->buffer_pool = buf->next;
+		frame_buffer_free(buf);
+	}
+	SDL_UnlockMutex(is->buffer_pool_mutex);
+}
+
+/* Drop the queue's reference to a picture (or its private copy) */
+static void picture_release(VideoState *is, VideoPicture *vp) {
+
+	if(vp->picref)
+		avfilter_unref_bufferp(&vp->picref);
+	else if(vp->buf)
+		frame_buffer_unref(is, vp->buf);
+	else if(vp->copied) {
+		avpicture_free(&vp->pict);
+		mem_charge(MEM_PICTURES, -vp->copy_size);
+	}
+	vp->buf = NULL;
+	vp->copied = 0;
+	vp->copy_size = 0;
+	memset(&vp->pict, 0, sizeof(vp->pict));
+}
+
+static void subpicture_free(SubPicture *sp) {
+	mem_charge(MEM_SUBTITLES, -sp->mem_size);
+	sp->mem_size = 0;
+	avsubtitle_free(&sp->sub);
+}
+
+/* Release the picture at rindex and hand its slot back to whoever fills the queue */
+static void pictq_next(VideoState *is) {
+
+	picture_release(is, &is->pictq[is->pictq_rindex]);
+
+	/* update queue for next picture! */
+	if(++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE) {
+		is->pictq_rindex = 0;
+	}
+	SDL_LockMutex(is->pictq_mutex);
+	atomic_add(&is->pictq_size, -1);
+	SDL_CondSignal(is->pictq_cond);
+	SDL_UnlockMutex(is->pictq_mutex);
+}
+
+static void video_refresh(VideoState *is) {
+
+	VideoPicture *vp;
+	double actual_delay, delay, sync_threshold, ref_clock, diff;
+    SubPicture *sp, *sp2;
+	int seek_done = 0;
+
+	is->refreshes++;
+	if(atomic_get(&is->video_st)) {
+		if(is->step_mode) {
+			/* the stepped picture stays until the next key press */
+			schedule_refresh(is, 100);
+		} else if(atomic_get(&is->live_buffering)) {
+			schedule_refresh(is, 10);
+		} else if(atomic_get(&is->pictq_size) == 0) {
+			schedule_refresh(is, 1);
+		} else {
+retry:
+			vp = &is->pictq[is->pictq_rindex];
+
+			if(is->seek_display_pending) {
+				if(fabs(vp->pts - is->seek_from) < fabs(vp->pts - is->seek_to)) {
+					/* decoded before the seek, don't show the old position */
+					pictq_next(is);
+					if(atomic_get(&is->pictq_size) > 0)
+						goto retry;
+					schedule_refresh(is, 1);
+					return;
+				}
+				seek_done = 1;
+			}
+
+			clock_set(&is->video_current_pts, vp->pts);
+			atomic_set(&is->video_current_pts_time, clock_now());
+
+			delay = vp->pts - is->frame_last_pts; /* the pts from last time */
+			if(delay <= 0 || delay >= 1.0) {
+				/* if incorrect delay, use previous one */
+				delay = is->frame_last_delay;
+			}
+			/* save for next time */
+			is->frame_last_delay = delay;
+			is->frame_last_pts = vp->pts;
+
+			/* update delay to sync to audio if not master source */
+			if(is->av_sync_type != AV_SYNC_VIDEO_MASTER) {
+				ref_clock = get_master_clock(is);
+				diff = vp->pts - ref_clock;
+
+				/* Skip or repeat the frame. Take delay into account
+				   FFPlay still doesn't "know if this is the best guess." */
+				sync_threshold = (delay > AV_SYNC_THRESHOLD) ? delay : AV_SYNC_THRESHOLD;
+				if(fabs(diff) < AV_NOSYNC_THRESHOLD) {
+					if(diff <= -sync_threshold) {
+						delay = 0;
+						is->frames_skipped++;
+					} else if(diff >= sync_threshold) {
+						delay = 2 * delay;
+						is->frames_repeated++;
+					}
+				}
+			}
+
+			if(live_mode && is->av_sync_type == AV_SYNC_VIDEO_MASTER &&
+					clock_get(&is->live_buffered) > live_latency + LIVE_CATCHUP_THRESHOLD) {
+				delay = delay * (100 - LIVE_SPEEDUP_PERCENT) / 100;
+				atomic_add(&is->live_speedups, 1);
+			}
+
+			is->frame_timer += delay;
+			/* computer the REAL delay */
+			actual_delay = is->frame_timer - (clock_now() / 1000000.0);
+			if(actual_delay < 0 && atomic_get(&is->pictq_size) > 1) {
+				/* too late and a newer picture is already waiting: skip
+				   this one before any time is spent converting it */
+				is->frames_dropped++;
+				pictq_next(is);
+				goto retry;
+			}
+			if(actual_delay < 0.010) {
+				actual_delay = 0.010;
+			}
+			schedule_refresh(is, (int)(actual_delay * 1000 + 0.5));
+
+			if (is->subpq_size > 0) {
+				sp = &is->subpq[is->subpq_rindex];
+
+				if (is->subpq_size > 1)
+					sp2 = &is->subpq[(is->subpq_rindex + 1) % SUBPICTURE_QUEUE_SIZE];
+				else
+					sp2 = NULL;
+
+				if ((is->video_current_pts > (sp->pts + ((float) sp->sub.end_display_time / 1000)))
+						|| (sp2 && is->video_current_pts > (sp2->pts + ((float) sp2->sub.start_display_time / 1000))))
+				{
+					subpicture_free(sp);
+
+					/* update queue size and signal for next picture */
+					if (++is->subpq_rindex == SUBPICTURE_QUEUE_SIZE)
+						is->subpq_rindex = 0;
+
+					SDL_LockMutex(is->subpq_mutex);
+					is->subpq_size--;
+					SDL_CondSignal(is->subpq_cond);
+					SDL_UnlockMutex(is->subpq_mutex);
+				}
+			}
+
+			if(is->audio_st && !is->seek_display_pending) {
+				double drift = get_audio_clock(is) - is->video_current_pts;
+				if(fabs(drift) < AV_NOSYNC_THRESHOLD) {
+					is->sync_drift_sum += fabs(drift);
+					if(fabs(drift) > is->sync_drift_max)
+						is->sync_drift_max = fabs(drift);
+					is->sync_drift_count++;
+				}
+			}
+
+			/* show the picture! */
+			video_display(is);
+
+			if(seek_done) {
+				if(!is->seek_display_hit)
+					is->seek_miss_latency += (av_gettime() - is->seek_start_time) / 1000000.0;
+				is->seek_display_pending = 0;
+			}
+
+			if(live_mode && atomic_get(&is->live_have_offset)) {
+				/* arrival time of this frame's data, estimated from pts */
+				double latency = av_gettime() / 1000000.0 - (vp->pts + clock_get(&is->live_clock_offset));
+				clock_set(&is->live_latency_last, latency);
+				is->live_latency_sum += latency;
+				is->live_latency_count++;
+				if(latency > is->live_latency_max)
+					is->live_latency_max = latency;
+			}
+
+			pictq_next(is);
+		}
+	} else {
+		/* stop, unless a video stream was opened meanwhile */
+		atomic_set_sc(&is->refresh_running, 0);
+		if(atomic_get_sc(&is->video_st))
+			refresh_start(is);
+	}
+}
+
+void video_refresh_timer(void *userdata) {
+
+	VideoState *is = (VideoState *)userdata;
+
+	/* decode_thread may be closing the video decoder for a track
+	   switch; video_display reads from it */
+	SDL_LockMutex(is->switch_mutex);
+	video_refresh(is);
+	SDL_UnlockMutex(is->switch_mutex);
+}
+
+/* Hash each band of DIRTY_BAND_HEIGHT rows, so video_display_picture
+   can tell which changed from the picture on screen. On the thread
+   that fills the picture queue, see pictq_publish. */
+static void picture_hash_bands(VideoState *is, VideoPicture *vp) {
+
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(vp->pix_fmt);
+	int64_t start = av_gettime();
+	int b, i, y, y1, shift, w, nb_bands;
+	uint64_t h;
+
+	vp->nb_bands = 0;
+	nb_bands = (vp->height + DIRTY_BAND_HEIGHT - 1) / DIRTY_BAND_HEIGHT;
+	if(!desc || nb_bands > MAX_DIRTY_BANDS ||
+			(desc->flags & (PIX_FMT_PAL | PIX_FMT_PSEUDOPAL | PIX_FMT_BITSTREAM | PIX_FMT_HWACCEL)))
+		return;
+	for(b = 0; b < nb_bands; b++) {
+		h = b;
+		y1 = FFMIN((b + 1) * DIRTY_BAND_HEIGHT, vp->height);
+		for(i = 0; i < 4 && vp->pict.data[i]; i++) {
+			shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+			w = av_image_get_linesize(vp->pix_fmt, vp->width, i);
+			for(y = (b * DIRTY_BAND_HEIGHT) >> shift; y < -((-y1) >> shift); y++)
+				h = row_hash(h, vp->pict.data[i] + y * vp->pict.linesize[i], w);
+		}
+		vp->band_hash[b] = h;
+	}
+	vp->nb_bands = nb_bands;
+	atomic_add(&is->pictures_hashed, 1);
+	atomic_add(&is->hash_time, av_gettime() - start);
+}
+
+/* Wait for a free slot in the picture queue; NULL when closing */
+static VideoPicture *pictq_wait(VideoState *is) {
+
+	/* wait until we have space for a new pic */
+	SDL_LockMutex(is->pictq_mutex);
+	while(atomic_get(&is->pictq_size) >= VIDEO_PICTURE_QUEUE_SIZE &&
+			!atomic_get(&is->quit) && !is->videoq.abort_request) {
+		SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+	}
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	if(atomic_get(&is->quit) || is->videoq.abort_request)
+		return NULL;
+
+	// windex is set to 0 initially
+	return &is->pictq[is->pictq_windex];
+}
+
+/* The slot from pictq_wait is filled in, hand it to the main thread.
+   pictq_wait and this run on video_thread, or on filter_thread with -vf. */
+static void pictq_publish(VideoState *is, VideoPicture *vp, double pts) {
+
+	vp->pts = pts;
+	vp->nb_bands = 0;
+	if(skip_static && video_sink->keeps_picture)
+		picture_hash_bands(is, vp);
+
+	/* now we inform our display thread that we have a pic ready */
+	if(++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE) {
+		is->pictq_windex = 0;
+	}
+	SDL_LockMutex(is->pictq_mutex);
+	atomic_add(&is->pictq_size, 1);
+	SDL_CondSignal(is->pictq_cond); /* simulate_run may be waiting for it */
+	SDL_UnlockMutex(is->pictq_mutex);
+}
+
+int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
+
+	VideoPicture *vp;
+	FrameBuffer *buf;
+	int i;
+
+	if(!(vp = pictq_wait(is)))
+		return -1;
+
+	/* Keep the decoded frame as it is; it is only converted for the
+	   screen if video_refresh_timer decides to show it. */
+	if(pFrame->type == FF_BUFFER_TYPE_USER) {
+		/* one of ours: just take a reference */
+		buf = pFrame->opaque;
+		SDL_LockMutex(is->buffer_pool_mutex);
+		buf->refcount++;
+		SDL_UnlockMutex(is->buffer_pool_mutex);
+
+		vp->buf = buf;
+		for(i = 0; i < 4; i++) {
+			vp->pict.data[i] = pFrame->data[i];
+			vp->pict.linesize[i] = pFrame->linesize[i];
+		}
+		vp->width = buf->w;
+		vp->height = buf->h;
+		vp->pix_fmt = buf->pix_fmt;
+	} else {
+		/* the decoder owns this buffer and will reuse it, so copy it */
+		vp->width = is->video_st->codec->width;
+		vp->height = is->video_st->codec->height;
+		vp->pix_fmt = is->video_st->codec->pix_fmt;
+		if(avpicture_alloc(&vp->pict, vp->pix_fmt, vp->width, vp->height) < 0)
+			return -1;
+		av_picture_copy(&vp->pict, (AVPicture *)pFrame,
+				vp->pix_fmt, vp->width, vp->height);
+		vp->copied = 1;
+		vp->copy_size = avpicture_get_size(vp->pix_fmt, vp->width, vp->height);
+		mem_charge(MEM_PICTURES, vp->copy_size);
+	}
+	vp->sample_aspect_ratio = is->video_st->codec->sample_aspect_ratio;
+	pictq_publish(is, vp, pts);
+	return 0;
+}
+
+/* The last reference to a decoded picture given to -vf is gone */
+static void filter_release_frame_buffer(AVFilterBuffer *fb) {
+
+	FrameBuffer *buf = fb->priv;
+
+	av_free(fb);
+	frame_buffer_unref(global_video_state, buf);
+}
+
+static void filter_release_copy(AVFilterBuffer *fb) {
+	mem_charge(MEM_PICTURES, -avpicture_get_size(fb->format, fb->w, fb->h));
+	av_free(fb->data[0]);
+	av_free(fb);
+}
+
+/* A reference to the decoded picture for the filters, pts in
+   AV_TIME_BASE units. Like queue_picture, pictures in our buffers are
+   not copied. */
+static AVFilterBufferRef *filter_wrap_frame(VideoState *is, AVFrame *pFrame, double pts) {
+
+	AVCodecContext *codecCtx = is->video_st->codec;
+	AVFilterBufferRef *ref;
+	FrameBuffer *buf;
+	AVPicture copy;
+	int size;
+
+	if(pFrame->type == FF_BUFFER_TYPE_USER) {
+		buf = pFrame->opaque;
+		ref = avfilter_get_video_buffer_ref_from_arrays(pFrame->data, pFrame->linesize,
+				AV_PERM_READ | AV_PERM_PRESERVE, buf->w, buf->h, buf->pix_fmt);
+		if(!ref)
+			return NULL;
+		SDL_LockMutex(is->buffer_pool_mutex);
+		buf->refcount++;
+		SDL_UnlockMutex(is->buffer_pool_mutex);
+		ref->buf->priv = buf;
+		ref->buf->free = filter_release_frame_buffer;
+	} else {
+		/* the decoder owns this buffer and will reuse it, so copy it */
+		if(avpicture_alloc(&copy, codecCtx->pix_fmt, codecCtx->width, codecCtx->height) < 0)
+			return NULL;
+		av_picture_copy(&copy, (AVPicture *)pFrame,
+				codecCtx->pix_fmt, codecCtx->width, codecCtx->height);
+		ref = avfilter_get_video_buffer_ref_from_arrays(copy.data, copy.linesize,
+				AV_PERM_READ | AV_PERM_WRITE, codecCtx->width, codecCtx->height, codecCtx->pix_fmt);
+		if(!ref) {
+			avpicture_free(&copy);
+			return NULL;
+		}
+		ref->buf->free = filter_release_copy;
+		size = avpicture_get_size(codecCtx->pix_fmt, codecCtx->width, codecCtx->height);
+		mem_charge(MEM_PICTURES, size);
+	}
+	avfilter_copy_frame_props(ref, pFrame);
+	if(!ref->video->sample_aspect_ratio.num)
+		ref->video->sample_aspect_ratio = codecCtx->sample_aspect_ratio;
+	ref->pts = llrint(pts * AV_TIME_BASE);
+	return ref;
+}
+
+static void filter_stage_free(FilterStage *st) {
+	avfilter_graph_free(&st->graph);
+	st->src = st->sink = NULL;
+}
+
+/* Cut -vf at the commas between filters, so each one gets a stage and
+   is timed by itself. Labelled or several chains stay in one stage. */
+static void filter_split(VideoFilter *vf) {
+
+	char *p, *start = vf->desc;
+	int quoted = 0, end;
+
+	vf->nb_stages = 0;
+	if(strpbrk(vf->desc, "[;")) {
+		vf->stages[vf->nb_stages++].desc = vf->desc;
+		return;
+	}
+	for(p = vf->desc; ; p++) {
+		if(*p == '\\' && p[1]) {
+			p++;
+			continue;
+		}
+		if(*p == '\'')
+			quoted = !quoted;
+		if(*p && (*p != ',' || quoted))
+			continue;
+		/* the last stage takes whatever is left */
+		end = !*p || vf->nb_stages == MAX_FILTER_STAGES - 1;
+		if(!end)
+			*p = '\0';
+		vf->stages[vf->nb_stages++].desc = start;
+		if(end)
+			break;
+		start = p + 1;
+	}
+}
+
+/* (Re)build a stage for pictures like in. Only the last one restricts
+   its output, to what the sink takes without sws_scale or else to the
+   decoder's format. */
+static int filter_stage_config(VideoState *is, FilterStage *st, AVFilterBufferRef *in,
+		AVRational time_base, int last) {
+
+	enum PixelFormat pix_fmts[] = { PIX_FMT_YUV420P, is->video_st->codec->pix_fmt, PIX_FMT_NONE };
+	AVFilterInOut *outputs = NULL, *inputs = NULL;
+	AVBufferSinkParams *params = NULL;
+	char args[256];
+	int ret;
+
+	filter_stage_free(st);
+	if(!(st->graph = avfilter_graph_alloc()))
+		return AVERROR(ENOMEM);
+	snprintf(args, sizeof(args), "%d:%d:%d:%d:%d:%d:%d",
+			in->video->w, in->video->h, in->format, time_base.num, time_base.den,
+			in->video->sample_aspect_ratio.num, FFMAX(in->video->sample_aspect_ratio.den, 1));
+	ret = avfilter_graph_create_filter(&st->src, avfilter_get_by_name("buffer"),
+			"in", args, NULL, st->graph);
+	if(ret < 0)
+		goto fail;
+	if(last) {
+		if(!(params = av_buffersink_params_alloc())) {
+			ret = AVERROR(ENOMEM);
+			goto fail;
+		}
+		params->pixel_fmts = pix_fmts;
+	}
+	ret = avfilter_graph_create_filter(&st->sink, avfilter_get_by_name("ffbuffersink"),
+			"out", NULL, params, st->graph);
+	if(ret < 0)
+		goto fail;
+
+	outputs = avfilter_inout_alloc();
+	inputs = avfilter_inout_alloc();
+	if(!outputs || !inputs) {
+		ret = AVERROR(ENOMEM);
+		goto fail;
+	}
+	outputs->name = av_strdup("in");
+	outputs->filter_ctx = st->src;
+	outputs->pad_idx = 0;
+	outputs->next = NULL;
+	inputs->name = av_strdup("out");
+	inputs->filter_ctx = st->sink;
+	inputs->pad_idx = 0;
+	inputs->next = NULL;
+	if((ret = avfilter_graph_parse(st->graph, st->desc, &inputs, &outputs, NULL)) < 0)
+		goto fail;
+	if((ret = avfilter_graph_config(st->graph, NULL)) < 0)
+		goto fail;
+	st->w = in->video->w;
+	st->h = in->video->h;
+	st->format = in->format;
+
+fail:
+	avfilter_inout_free(&outputs);
+	avfilter_inout_free(&inputs);
+	av_free(params);
+	if(ret < 0)
+		filter_stage_free(st);
+	return ret;
+}
+
+/* The last stage's pictures go into the picture queue, by reference */
+static int queue_filtered_picture(VideoState *is, AVFilterBufferRef *ref, AVRational time_base) {
+
+	VideoPicture *vp;
+	int i;
+
+	if(!(vp = pictq_wait(is))) {
+		avfilter_unref_buffer(ref);
+		return -1;
+	}
+	vp->picref = ref;
+	for(i = 0; i < 4; i++) {
+		vp->pict.data[i] = ref->data[i];
+		vp->pict.linesize[i] = ref->linesize[i];
+	}
+	vp->width = ref->video->w;
+	vp->height = ref->video->h;
+	vp->pix_fmt = ref->format;
+	vp->sample_aspect_ratio = ref->video->sample_aspect_ratio;
+	pictq_publish(is, vp, ref->pts == AV_NOPTS_VALUE ? 0 : ref->pts * av_q2d(time_base));
+	return 0;
+}
+
+/* Push in through stage i and the ones after it; takes the reference.
+   A stage that will not set up drops its pictures, -1 is for closing. */
+static int filter_run(VideoState *is, VideoFilter *vf, int i, AVFilterBufferRef *in) {
+
+	FilterStage *st = &vf->stages[i];
+	AVFilterBufferRef *out;
+	AVRational time_base = i ? vf->stages[i - 1].sink->inputs[0]->time_base : AV_TIME_BASE_Q;
+	int64_t start;
+	int ret;
+
+	if(!st->graph || in->video->w != st->w || in->video->h != st->h || in->format != st->format) {
+		if(filter_stage_config(is, st, in, time_base, i == vf->nb_stages - 1) < 0) {
+			if(!st->failed)
+				fprintf(stderr, "-vf: cannot set up \"%s\" for %dx%d %s pictures\n", st->desc,
+						in->video->w, in->video->h, av_get_pix_fmt_name(in->format));
+			st->failed = 1;
+			avfilter_unref_buffer(in);
+			return 0;
+		}
+	}
+
+	start = av_gettime();
+	ret = av_buffersrc_add_ref(st->src, in, AV_BUFFERSRC_FLAG_NO_COPY);
+	st->frames_in++;
+	while(ret >= 0) {
+		/* this is where the filter does its work */
+		ret = av_buffersink_get_buffer_ref(st->sink, &out, 0);
+		st->time += av_gettime() - start;
+		if(ret < 0)
+			break;
+		st->frames_out++;
+		if(i + 1 < vf->nb_stages)
+			ret = filter_run(is, vf, i + 1, out);
+		else
+			ret = queue_filtered_picture(is, out, st->sink->inputs[0]->time_base);
+		if(ret < 0)
+			return ret;
+		start = av_gettime();
+	}
+	return 0;
+}
+
+static int filter_thread(void *arg) {
+
+	VideoState *is = (VideoState *)arg;
+	VideoFilter *vf = &is->vf;
+	AVFilterBufferRef *in;
+	int i;
+
+	thread_setup(THREAD_ROLE_VIDEO);
+
+	for(;;) {
+		SDL_LockMutex(vf->mutex);
+		while(!vf->size && !vf->eof)
+			SDL_CondWait(vf->cond, vf->mutex);
+		if(!vf->size) {
+			SDL_UnlockMutex(vf->mutex);
+			break;
+		}
+		in = vf->queue[vf->rindex];
+		vf->rindex = (vf->rindex + 1) % FILTER_QUEUE_SIZE;
+		vf->size--;
+		SDL_CondSignal(vf->cond);
+		SDL_UnlockMutex(vf->mutex);
+
+		if(!in) {
+			/* a seek: the filters forget the pictures from before it */
+			for(i = 0; i < vf->nb_stages; i++)
+				filter_stage_free(&vf->stages[i]);
+			continue;
+		}
+		if(filter_run(is, vf, 0, in) < 0)
+			break;
+	}
+
+	SDL_LockMutex(vf->mutex);
+	vf->done = 1;
+	while(vf->size) {
+		if(vf->queue[vf->rindex])
+			avfilter_unref_buffer(vf->queue[vf->rindex]);
+		vf->rindex = (vf->rindex + 1) % FILTER_QUEUE_SIZE;
+		vf->size--;
+	}
+	SDL_CondSignal(vf->cond);
+	SDL_UnlockMutex(vf->mutex);
+	for(i = 0; i < vf->nb_stages; i++)
+		filter_stage_free(&vf->stages[i]);
+	return 0;
+}
+
+/* From video_thread: a picture for the filters, or NULL after a seek */
+static int filter_push(VideoFilter *vf, AVFilterBufferRef *ref) {
+
+	SDL_LockMutex(vf->mutex);
+	if(!ref) {
+		/* what is still waiting is from before the seek */
+		while(vf->size) {
+			vf->windex = (vf->windex + FILTER_QUEUE_SIZE - 1) % FILTER_QUEUE_SIZE;
+			if(vf->queue[vf->windex])
+				avfilter_unref_buffer(vf->queue[vf->windex]);
+			vf->size--;
+		}
+	}
+	while(vf->size == FILTER_QUEUE_SIZE && !vf->done)
+		SDL_CondWait(vf->cond, vf->mutex);
+	if(vf->done) {
+		SDL_UnlockMutex(vf->mutex);
+		if(ref)
+			avfilter_unref_buffer(ref);
+		return -1;
+	}
+	vf->queue[vf->windex] = ref;
+	vf->windex = (vf->windex + 1) % FILTER_QUEUE_SIZE;
+	vf->size++;
+	SDL_CondSignal(vf->cond);
+	SDL_UnlockMutex(vf->mutex);
+	return 0;
+}
+
+/* video_thread runs the filters while it runs; their statistics stay */
+static int filter_start(VideoState *is) {
+
+	VideoFilter *vf = &is->vf;
+
+	if(!vf->desc) {
+		vf->desc = av_strdup(vfilter_desc);
+		vf->mutex = SDL_CreateMutex();
+		vf->cond = SDL_CreateCond();
+		if(!vf->desc || !vf->mutex || !vf->cond)
+			return -1;
+		filter_split(vf);
+	}
+	vf->rindex = vf->windex = vf->size = 0;
+	vf->eof = vf->done = 0;
+	vf->tid = SDL_CreateThread(filter_thread, is);
+	return vf->tid ? 0 : -1;
+}
+
+static void filter_stop(VideoState *is) {
+
+	VideoFilter *vf = &is->vf;
+
+	if(!vf->tid)
+		return;
+	SDL_LockMutex(vf->mutex);
+	vf->eof = 1;
+	SDL_CondSignal(vf->cond);
+	SDL_UnlockMutex(vf->mutex);
+	SDL_WaitThread(vf->tid, NULL);
+	vf->tid = NULL;
+}
+
+static void filter_free(VideoState *is) {
+
+	VideoFilter *vf = &is->vf;
+
+	if(vf->mutex)
+		SDL_DestroyMutex(vf->mutex);
+	if(vf->cond)
+		SDL_DestroyCond(vf->cond);
+	av_freep(&vf->desc);
+	vf->nb_stages = 0;
+}
+
+double synchronize_video(VideoState *is, AVFrame *src_frame, double pts) {
+
+	double frame_delay;
+
+	if(pts != 0) {
+		/* if we have pts, set video clock to it */
+		is->video_clock = pts;
+	} else {
+		/* if we aren't given a pts, set it to the clock */
+		pts = is->video_clock;
+	}
+	/* update the video clock */
+	frame_delay = av_q2d(is->video_st->codec->time_base);
+	/* if we are repeating a frame, adjust clock accordingly */
+	frame_delay += src_frame->repeat_pict * (frame_delay * 0.5);
+	is->video_clock += frame_delay;
+	return pts;
+}
+
+uint64_t global_video_pkt_pts = AV_NOPTS_VALUE;
+
+/* Lay the planes of a picture from c out in block, each plane and
+   line starting at FRAME_ALIGN bytes; returns the bytes it takes */
+static int frame_buffer_layout(AVCodecContext *c, uint8_t *block,
+		uint8_t *data[4], int linesize[4]) {
+
+	int w = c->width, h = c->height;
+	int linesize_align[AV_NUM_DATA_POINTERS];
+	int i, size;
+
+	/* the decoder may write past width/height up to its block size */
+	avcodec_align_dimensions2(c, &w, &h, linesize_align);
+	if(av_image_fill_linesizes(linesize, c->pix_fmt, w) < 0)
+		return -1;
+	for(i = 0; i < 4; i++)
+		linesize[i] = FFALIGN(linesize[i], FRAME_ALIGN);
+	size = av_image_fill_pointers(data, c->pix_fmt, h, block, linesize);
+	/* room for SIMD reading past the end of the last line */
+	return size < 0 ? size : size + FRAME_ALIGN;
+}
+
+/* A block of at least size bytes, on 2 MB pages with -framepool huge
+   when the system has them. Big pictures then take a handful of TLB
+   entries instead of thousands; pictures under half a hugepage would
+   mostly waste it, so they get the ordinary size classes. */
+static uint8_t *frame_block_alloc(int *size, int *mapping) {
+
+	uint8_t *p;
+#ifdef __linux__
+	uint8_t *start;
+	size_t len;
+
+	if(frame_pool_mode == FRAME_POOL_HUGE && *size >= HUGEPAGE_SIZE / 2) {
+		len = FFALIGN(*size, HUGEPAGE_SIZE);
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(p != MAP_FAILED) {
+			*size = len;
+			*mapping = FRAME_BLOCK_HUGETLB;
+			return p;
+		}
+		/* none reserved: a 2 MB aligned mapping the kernel can back
+		   with transparent hugepages */
+		p = mmap(NULL, len + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p != MAP_FAILED) {
+			start = (uint8_t *)FFALIGN((uintptr_t)p, HUGEPAGE_SIZE);
+			if(start > p)
+				munmap(p, start - p);
+			munmap(start + len, p + HUGEPAGE_SIZE - start);
+			madvise(start, len, MADV_HUGEPAGE);
+			*size = len;
+			*mapping = FRAME_BLOCK_THP;
+			return start;
+		}
+	}
+#endif
+	*size = FFALIGN(*size, FRAME_POOL_GRANULE);
+	p = memalign_alloc(FRAME_ALIGN, *size);
+	*mapping = FRAME_BLOCK_MALLOC;
+	return p;
+}
+
+static FrameBuffer *frame_buffer_alloc(VideoState *is, int size) {
+
+	FrameBuffer *buf;
+
+	buf = av_mallocz(sizeof(FrameBuffer));
+	if(!buf)
+		return NULL;
+	buf->size = size;
+	buf->block = frame_block_alloc(&buf->size, &buf->mapping);
+	if(!buf->block) {
+		av_free(buf);
+		return NULL;
+	}
+	buf->charged = FFALIGN(size, FRAME_POOL_GRANULE);
+	mem_charge(MEM_FRAMES, buf->charged);
+	is->pool_allocs++;
+	is->pool_hugetlb += buf->mapping == FRAME_BLOCK_HUGETLB;
+	is->pool_thp += buf->mapping == FRAME_BLOCK_THP;
+	return buf;
+}
+
+/* These are called whenever we allocate a frame
+ * buffer. We use this to store the global_pts in
+ * a frame at the time it is allocated. The buffer
+ * comes from our own pool so that queue_picture can
+ * hold on to it after the decoder releases it.
+ */
+int our_get_buffer(struct AVCodecContext *c, AVFrame *pic) {
+
+	VideoState *is = c->opaque;
+	FrameBuffer *buf, **p, *unfit = NULL, *next;
+	uint8_t *data[4];
+	int linesize[4];
+	int i, size;
+
+	size = frame_buffer_layout(c, NULL, data, linesize);
+	if(size < 0)
+		return AVERROR(EINVAL);
+
+	/* the first free block the picture fits without wasting more than
+	   half of it. The others were for another size; the stream has
+	   moved on, so they go. */
+	SDL_LockMutex(is->buffer_pool_mutex);
+	p = &is->buffer_pool;
+	while((buf = *p) != NULL) {
+		*p = buf->next;
+		if(buf->size >= size && buf->size / 2 <= size)
+			break;
+		buf->next = unfit;
+		unfit = buf;
+	}
+	SDL_UnlockMutex(is->buffer_pool_mutex);
+	for(; unfit; unfit = next) {
+		next = unfit->next;
+		frame_buffer_free(unfit);
+	}
+
+	if(buf) {
+		is->pool_reuses++;
+		if(buf->w != c->width || buf->h != c->height || buf->pix_fmt != c->pix_fmt)
+			is->pool_resizes++;
+	} else if(!(buf = frame_buffer_alloc(is, size))) {
+		return AVERROR(ENOMEM);
+	}
+	frame_buffer_layout(c, buf->block, buf->data, buf->linesize);
+	buf->w = c->width;
+	buf->h = c->height;
+	buf->pix_fmt = c->pix_fmt;
+
+	buf->refcount = 1;
+	buf->next = NULL;
+	buf->pts = global_video_pkt_pts;
+
+	pic->opaque = buf;
+	pic->type = FF_BUFFER_TYPE_USER;
+	pic->extended_data = pic->data;
+	pic->width = buf->w;
+	pic->height = buf->h;
+	pic->format = buf->pix_fmt;
+	for(i = 0; i < 4; i++) {
+		pic->base[i] = pic->data[i] = buf->data[i];
+		pic->linesize[i] = buf->linesize[i];
+	}
+	return 0;
+}
+void our_release_buffer(struct AVCodecContext *c, AVFrame *pic) {
+
+	int i;
+
+	if(pic->type != FF_BUFFER_TYPE_USER) {
+		avcodec_default_release_buffer(c, pic);
+		return;
+	}
+	for(i = 0; i < 4; i++)
+		pic->data[i] = NULL;
+	frame_buffer_unref(c->opaque, pic->opaque);
+}
+
+/* The packet pts saved by our_get_buffer, or the one libavcodec tracked
+   itself for decoders we can't give our own buffers to */
+static uint64_t frame_pkt_pts(AVFrame *pic) {
+	if(pic->type == FF_BUFFER_TYPE_USER && pic->opaque)
+		return ((FrameBuffer *)pic->opaque)->pts;
+	return pic->pkt_pts;
+}
+
+/* Subtitle palettes come in RGBA, the overlay wants YUVA */
+static void subtitle_palette_task(void *arg) {
+
+	AVSubtitleRect *rect = (AVSubtitleRect *)arg;
+	int j;
+	int r, g, b, y, u, v, a;
+
+	for (j = 0; j < rect->nb_colors; j++)
+	{
+		RGBA_IN(r, g, b, a, (uint32_t*)rect->pict.data[1] + j);
+		y = RGB_TO_Y_CCIR(r, g, b);
+		u = RGB_TO_U_CCIR(r, g, b, 0);
+		v = RGB_TO_V_CCIR(r, g, b, 0);
+		YUVA_OUT((uint32_t*)rect->pict.data[1] + j, y, u, v, a);
+	}
+}
+
+/* Decodes packet into the next free subpicture. Returns <0 to stop,
+   else whether there was a subtitle. */
+static int subtitle_decode_packet(VideoState *is, AVPacket *pkt) {
+
+	SubPicture *sp;
+	double pts;
+	int got_subtitle;
+	int i;
+	TaskGroup palette_group;
+
+	SDL_LockMutex(is->subpq_mutex);
+	while (is->subpq_size >= SUBPICTURE_QUEUE_SIZE &&
+			!atomic_get(&is->quit) && !is->subtitleq.abort_request) {
+		SDL_CondWait(is->subpq_cond, is->subpq_mutex);
+	}
+	SDL_UnlockMutex(is->subpq_mutex);
+
+	if(atomic_get(&is->quit) || is->subtitleq.abort_request)
+		return -1;
+
+	sp = &is->subpq[is->subpq_windex];
+	pts = 0;
+	if(pkt->pts != AV_NOPTS_VALUE)
+		pts = av_q2d(is->subtitle_st->time_base) * pkt->pts;
+
+	avcodec_decode_subtitle2(is->subtitle_st->codec, &sp->sub, &got_subtitle, pkt);
+	if(got_subtitle && sp->sub.format == 0)
+	{
+		if(sp->sub.pts != AV_NOPTS_VALUE)
+			pts = sp->sub.pts / (double)AV_TIME_BASE;
+		sp->pts = pts + playlist_shift(is->subtitle_item);
+
+		task_group_init(&palette_group);
+		sp->mem_size = 0;
+		for (i = 0; i < sp->sub.num_rects; i++) {
+			task_submit(task_pool, &palette_group, subtitle_palette_task, sp->sub.rects[i]);
+			sp->mem_size += sp->sub.rects[i]->w * sp->sub.rects[i]->h
+				+ sp->sub.rects[i]->nb_colors * 4;
+		}
+		mem_charge(MEM_SUBTITLES, sp->mem_size);
+		task_group_wait(task_pool, &palette_group);
+
+		/* now we can update the picture count */
+		if (++is->subpq_windex == SUBPICTURE_QUEUE_SIZE)
+			is->subpq_windex = 0;
+		SDL_LockMutex(is->subpq_mutex);
+		is->subpq_size++;
+		SDL_UnlockMutex(is->subpq_mutex);
+	}
+	return got_subtitle;
+}
+
+int subtitle_thread(void *arg)
+{
+	VideoState *is = (VideoState *)arg;
+	int ret;
+	AVPacket pkt1, *pkt = &pkt1, drain;
+	AVStream *st;
+
+	thread_setup(THREAD_ROLE_SUBTITLE);
+
+	while(1)
+	{
+		ret = packet_queue_get(&is->subtitleq, pkt, 1);
+		if(ret < 0)
+			break;
+
+		if(pkt->data == flush_pkt.data)
+		{
+			avcodec_flush_buffers(is->subtitle_st->codec);
+			continue;
+		}
+		if(pkt->data == item_pkt.data)
+		{
+			if(pkt->pos == is->subtitle_item)
+				continue;
+			/* a decoder with delay still holds the ending item's last ones */
+			av_init_packet(&drain);
+			drain.data = NULL;
+			drain.size = 0;
+			while((ret = subtitle_decode_packet(is, &drain)) > 0)
+				;
+			if(ret < 0)
+				return 0;
+			avcodec_flush_buffers(is->subtitle_st->codec);
+			if((st = playlist_enter(is, AVMEDIA_TYPE_SUBTITLE, pkt->pos)) != NULL)
+				is->subtitle_st = st;
+			continue;
+		}
+
+		ret = subtitle_decode_packet(is, pkt);
+		av_free_packet(pkt);
+		if(ret < 0)
+			return 0;
+	}
+
+	return 0;
+}
+
+/* Decodes packet and queues the picture it finishes, if any. Returns
+   <0 to stop, else whether there was a picture. */
+static int video_decode_packet(VideoState *is, AVFrame *pFrame, AVPacket *packet) {
+
+	AVFilterBufferRef *ref;
+	int frameFinished;
+	double pts = 0;
+	int64_t t;
+
+	// Save global pts to be stored in pFrame in first call
+	global_video_pkt_pts = packet->pts;
+	// Decode video frame
+	t = av_gettime();
+	avcodec_decode_video2(is->video_st->codec, pFrame, &frameFinished, 
+			packet);
+	is->video_decode_time += av_gettime() - t;
+	is->video_frames_decoded += frameFinished;
+	if(packet->dts == AV_NOPTS_VALUE 
+			&& frame_pkt_pts(pFrame) != AV_NOPTS_VALUE) {
+		pts = frame_pkt_pts(pFrame);
+	} else if(packet->dts != AV_NOPTS_VALUE) {
+		pts = packet->dts;
+	} else {
+		pts = 0;
+	}
+	pts *= av_q2d(is->video_st->time_base);
+	if(pts != 0)
+		pts += playlist_shift(is->video_item);
+
+	// Did we get a video frame?
+	if(!frameFinished)
+		return 0;
+	if(playlist_size > 1 && !playlist[is->video_item].video_first_time)
+		playlist[is->video_item].video_first_time = av_gettime();
+	pts = synchronize_video(is, pFrame, pts);
+	if(analysis)
+		analysis_video(pFrame, is->video_st->codec->pix_fmt,
+				is->video_st->codec->width, is->video_st->codec->height, pts);
+	if(nb_renditions)
+		renditions_run(is, pFrame, pts);
+	if(is->vf.tid) {
+		ref = filter_wrap_frame(is, pFrame, pts);
+		if(ref && filter_push(&is->vf, ref) < 0)
+			return -1;
+	} else if(queue_picture(is, pFrame, pts) < 0) {
+		return -1;
+	}
+	return 1;
+}
+
+int video_thread(void *arg) {
+	VideoState *is = (VideoState *)arg;
+	AVPacket pkt1, *packet = &pkt1, drain;
+	AVFrame *pFrame;
+	AVStream *st;
+	int ret;
+
+	thread_setup(THREAD_ROLE_VIDEO);
+
+	pFrame = avcodec_alloc_frame();
+	if(vfilter_desc && filter_start(is) < 0)
+		fprintf(stderr, "-vf: cannot start the filter thread, playing unfiltered\n");
+
+	for(;;) {
+		if(packet_queue_get(&is->videoq, packet, 1) < 0) {
+			// means we quit getting packets
+			break;
+		}
+		if(packet->data == flush_pkt.data) {
+			avcodec_flush_buffers(is->video_st->codec);
+			if(is->vf.tid && filter_push(&is->vf, NULL) < 0)
+				break;
+			continue;
+		}
+		if(packet->data == item_pkt.data) {
+			if(packet->pos == is->video_item)
+				continue;
+			/* the pictures held back for reordering are the end of the
+			   item that is ending, not dropped */
+			av_init_packet(&drain);
+			drain.data = NULL;
+			drain.size = 0;
+			while((ret = video_decode_packet(is, pFrame, &drain)) > 0)
+				;
+			if(ret < 0)
+				break;
+			avcodec_flush_buffers(is->video_st->codec);
+			if((st = playlist_enter(is, AVMEDIA_TYPE_VIDEO, packet->pos)) != NULL)
+				atomic_set_sc(&is->video_st, st);
+			continue;
+		}
+		ret = video_decode_packet(is, pFrame, packet);
+		av_free_packet(packet);
+		if(ret < 0)
+			break;
+	}
+	filter_stop(is);
+	av_free(pFrame);
+	return 0;
+}
+
+int stream_component_close(VideoState *is, int stream_index) 
+{
+	AVCodecContext *codecCtx = NULL;
+	AVFormatContext *pFormatCtx = is->pFormatCtx;
+	AVStream *st = NULL;
+	int i;
+
+	if(stream_index < 0 || stream_index >= pFormatCtx->nb_streams) {
+		return -1;
+	}
+
+	/* After a gapless playlist advance pFormatCtx is the next item's,
+	   while a decoder can still be on the previous item's stream: the
+	   open decoder is the one to close. */
+	codecCtx = pFormatCtx->streams[stream_index]->codec;
+	if(codecCtx->codec_type == AVMEDIA_TYPE_AUDIO)
+		st = is->audio_st;
+	else if(codecCtx->codec_type == AVMEDIA_TYPE_VIDEO)
+		st = atomic_get(&is->video_st);
+	else if(codecCtx->codec_type == AVMEDIA_TYPE_SUBTITLE)
+		st = is->subtitle_st;
+	if(st)
+		codecCtx = st->codec;
+	switch(codecCtx->codec_type)
+	{
+		case AVMEDIA_TYPE_AUDIO:
+			/* abort first so the callback doesn't block in packet_queue_get
+			   while audio_close waits for it */
+			packet_queue_abort(&is->audioq);
+			audio_close();
+
+			packet_queue_flush(&is->audioq);
+			av_free_packet(&is->audio_pkt);
+			swr_free(&is->swr_ctx);
+			av_freep(&is->audio_buf1);
+			mem_charge(MEM_AUDIO, -(int64_t)is->audio_buf1_size);
+			is->audio_buf1_size = 0;
+			is->audio_buf = NULL;
+			is->audio_pkt_size = 0;
+			is->audio_drain_item = -1;
+			break;
+
+		case AVMEDIA_TYPE_VIDEO:
+			packet_queue_abort(&is->videoq);
+
+			/* note: we also signal this mutex to make sure we deblock the
+			   video thread in all cases */
+			SDL_LockMutex(is->pictq_mutex);
+			SDL_CondSignal(is->pictq_cond);
+			SDL_UnlockMutex(is->pictq_mutex);
+
+			SDL_WaitThread(is->video_tid, NULL);
+			packet_queue_flush(&is->videoq);
+
+			SDL_LockMutex(is->pictq_mutex);
+			for(i = 0; i < VIDEO_PICTURE_QUEUE_SIZE; i++)
+				picture_release(is, &is->pictq[i]);
+			atomic_set(&is->pictq_size, 0);
+			is->pictq_rindex = 0;
+			is->pictq_windex = 0;
+			SDL_UnlockMutex(is->pictq_mutex);
+			break;
+
+		case AVMEDIA_TYPE_SUBTITLE:
+			packet_queue_abort(&is->subtitleq);
+
+			SDL_LockMutex(is->subpq_mutex);
+			SDL_CondSignal(is->subpq_cond);
+			SDL_UnlockMutex(is->subpq_mutex);
+
+			SDL_WaitThread(is->subtitle_tid, NULL);
+			packet_queue_flush(&is->subtitleq);
+
+			SDL_LockMutex(is->subpq_mutex);
+			while(is->subpq_size > 0) {
+				subpicture_free(&is->subpq[is->subpq_rindex]);
+				if(++is->subpq_rindex == SUBPICTURE_QUEUE_SIZE)
+					is->subpq_rindex = 0;
+				is->subpq_size--;
+			}
+			is->subpq_rindex = 0;
+			is->subpq_windex = 0;
+			SDL_UnlockMutex(is->subpq_mutex);
+			break;
+		default:
+			break;
+	}
+
+	/* let the demuxer skip this stream from now on */
+	pFormatCtx->streams[stream_index]->discard = AVDISCARD_ALL;
+	avcodec_close(codecCtx);
+
+	switch(codecCtx->codec_type)
+	{
+		case AVMEDIA_TYPE_AUDIO:
+			is->audio_st = NULL;
+			is->audioStream = -1;
+			break;
+		case AVMEDIA_TYPE_VIDEO:
+			atomic_set_sc(&is->video_st, NULL);
+			is->videoStream = -1;
+			/* avcodec_close has returned every buffer the decoder held */
+			frame_buffer_pool_free(is);
+			break;
+		case AVMEDIA_TYPE_SUBTITLE:
+			is->subtitle_st = NULL;
+			is->subtitleStream = -1;
+			break;
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+/* Find and open the decoder of one of our streams. Touches nothing but
+   codecCtx, so playlist items can do this on their own thread. */
+static int stream_codec_open(VideoState *is, AVCodecContext *codecCtx) {
+
+	AVCodec *codec = NULL;
+	AVDictionary *optionsDict = NULL;
+
+	if(avcodec_is_open(codecCtx))
+		return 0; /* opened ahead of time, see playlist_prepare_thread */
+
+	if(live_mode && codecCtx->codec_type == AVMEDIA_TYPE_VIDEO)
+		codecCtx->flags |= CODEC_FLAG_LOW_DELAY;
+
+	codec = avcodec_find_decoder(codecCtx->codec_id);
+	if(codec && codecCtx->codec_type == AVMEDIA_TYPE_VIDEO &&
+			frame_pool_mode != FRAME_POOL_OFF &&
+			(codec->capabilities & CODEC_CAP_DR1)) {
+		/* decode straight into our refcounted buffers, see queue_picture */
+		codecCtx->flags |= CODEC_FLAG_EMU_EDGE;
+		codecCtx->get_buffer = our_get_buffer;
+		codecCtx->release_buffer = our_release_buffer;
+	}
+	codecCtx->opaque = is;
+	if(!codec || (avcodec_open2(codecCtx, codec, &optionsDict) < 0))
+		return -1;
+	return 0;
+}
+
+static int mix_track_open(VideoState *is, int stream_index, double gain) {
+
+	AVFormatContext *pFormatCtx = is->pFormatCtx;
+	MixTrack *t = &is->mix[is->nb_mix];
+	int i, size;
+
+	if(stream_index < 0 || stream_index >= pFormatCtx->nb_streams ||
+			pFormatCtx->streams[stream_index]->codec->codec_type != AVMEDIA_TYPE_AUDIO) {
+		fprintf(stderr, "-mix: stream %d is not an audio stream\n", stream_index);
+		return -1;
+	}
+	if(stream_index == is->audioStream)
+		return 0;
+	for(i = 0; i < is->nb_mix; i++)
+		if(is->mix[i].stream_index == stream_index)
+			return 0;
+	if(is->nb_mix == MAX_MIX_TRACKS) {
+		fprintf(stderr, "-mix: at most %d tracks\n", MAX_MIX_TRACKS);
+		return -1;
+	}
+
+	memset(t, 0, sizeof(*t));
+	t->is = is;
+	t->stream_index = stream_index;
+	t->st = pFormatCtx->streams[stream_index];
+	if(stream_codec_open(is, t->st->codec) < 0) {
+		fprintf(stderr, "-mix: stream %d: unsupported codec\n", stream_index);
+		return -1;
+	}
+	t->gain = FFMIN(FFMAX(gain, 0), 32767.0 / (1 << MIX_GAIN_BITS));
+	t->gain_q = lrint(t->gain * (1 << MIX_GAIN_BITS));
+	size = (int)(MIX_FIFO_TIME * is->audio_tgt.freq) * is->audio_tgt.channels * 2;
+	t->fifo = av_fifo_alloc(size);
+	t->buf = av_malloc(size);
+	if(!t->fifo || !t->buf) {
+		av_fifo_free(t->fifo);
+		av_free(t->buf);
+		avcodec_close(t->st->codec);
+		return -1;
+	}
+	t->end_pts = NAN;
+	t->tgt = is->audio_tgt;
+	t->mutex = SDL_CreateMutex();
+	t->cond = SDL_CreateCond();
+	packet_queue_init(&t->q);
+	t->st->discard = AVDISCARD_DEFAULT;
+	t->tid = SDL_CreateThread(mix_track_thread, t);
+	printf("mixing stream %d at gain %.2f\n", stream_index, t->gain);
+	/* audio_callback may start using it now */
+	is->nb_mix++;
+	atomic_set(&is->mix_active, is->nb_mix);
+	return 0;
+}
+
+/* -mix all, or a list of stream[:gain] like 2,3:0.5 */
+static void mix_open(VideoState *is) {
+
+	AVFormatContext *pFormatCtx = is->pFormatCtx;
+	const char *p = mix_spec;
+	char *end;
+	int i, stream_index;
+	double gain;
+
+	if(is->audioStream < 0) {
+		fprintf(stderr, "-mix: no audio track to mix into\n");
+		return;
+	}
+	if(playlist_size > 1) {
+		fprintf(stderr, "-mix: not supported with a playlist\n");
+		return;
+	}
+	mix_kernels_init();
+	if(!strcmp(p, "all")) {
+		for(i = 0; i < pFormatCtx->nb_streams; i++)
+			if(pFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
+				mix_track_open(is, i, 1.0);
+		return;
+	}
+	while(*p) {
+		stream_index = strtol(p, &end, 10);
+		if(end == p) {
+			fprintf(stderr, "-mix: expected a stream number at '%s'\n", p);
+			return;
+		}
+		p = end;
+		gain = 1.0;
+		if(*p == ':') {
+			gain = strtod(p + 1, &end);
+			p = end;
+		}
+		if(*p == ',')
+			p++;
+		mix_track_open(is, stream_index, gain);
+	}
+}
+
+/* After the audio device is closed, so no callback is mixing */
+static void mix_close(VideoState *is) {
+
+	MixTrack *t;
+	int i;
+
+	atomic_set(&is->mix_active, 0);
+	for(i = 0; i < is->nb_mix; i++) {
+		t = &is->mix[i];
+		packet_queue_abort(&t->q);
+		SDL_LockMutex(t->mutex);
+		t->quit = 1;
+		SDL_CondSignal(t->cond);
+		SDL_UnlockMutex(t->mutex);
+		SDL_WaitThread(t->tid, NULL);
+		packet_queue_destroy(&t->q);
+		avcodec_close(t->st->codec);
+		swr_free(&t->swr_ctx);
+		av_fifo_free(t->fifo);
+		av_freep(&t->buf);
+		SDL_DestroyMutex(t->mutex);
+		SDL_DestroyCond(t->cond);
+	}
+}
+
+/* audio_tgt changed (a track switch, or a reopened device that came
+   back different) while the device is closed: what the fifos hold is in
+   the old format, and the track threads convert to the new one from
+   their next frame on. */
+static void mix_retarget(VideoState *is) {
+
+	MixTrack *t;
+	uint8_t *buf;
+	int i, size;
+
+	for(i = 0; i < is->nb_mix; i++) {
+		t = &is->mix[i];
+		SDL_LockMutex(t->mutex);
+		if(t->tgt.freq != is->audio_tgt.freq || t->tgt.channels != is->audio_tgt.channels ||
+				t->tgt.channel_layout != is->audio_tgt.channel_layout ||
+				t->tgt.fmt != is->audio_tgt.fmt) {
+			t->tgt = is->audio_tgt;
+			t->tgt_gen++;
+			av_fifo_reset(t->fifo);
+			t->end_pts = NAN;
+			size = (int)(MIX_FIFO_TIME * t->tgt.freq) * t->tgt.channels * 2;
+			/* buf first: the callback reads up to what fifo holds into it */
+			if(size > av_fifo_space(t->fifo) && (buf = av_realloc(t->buf, size))) {
+				t->buf = buf;
+				av_fifo_realloc2(t->fifo, size);
+			}
+			SDL_CondSignal(t->cond);
+		}
+		SDL_UnlockMutex(t->mutex);
+	}
+}
+
+/* Mixed tracks are charged to MEM_PACKETS by packet_queue_put like
+   the rest, this bounds them for the demuxer's throttle */
+static int mix_queues_full(VideoState *is) {
+
+	int i;
+
+	for(i = 0; i < is->nb_mix; i++)
+		if(is->mix[i].q.size > MAX_AUDIOQ_SIZE)
+			return 1;
+	return 0;
+}
+
+/* Runs in decode_thread when audio_output_update asked for a larger
+   device buffer. SDL 1.2 can only change it by reopening the device,
+   which costs a short gap; the decoded audio waiting in audio_buf
+   stays. */
+static void audio_reopen(VideoState *is) {
+
+	SDL_AudioSpec wanted_spec, spec;
+	int samples = atomic_get(&is->audio_resize_req);
+
+	wanted_spec.freq = is->audio_tgt.freq;
+	wanted_spec.format = AUDIO_S16SYS;
+	wanted_spec.channels = is->audio_tgt.channels;
+	wanted_spec.silence = 0;
+	wanted_spec.samples = samples;
+	wanted_spec.callback = audio_callback;
+	wanted_spec.userdata = is;
+
+	/* as in stream_component_close, but the packets stay queued */
+	packet_queue_abort(&is->audioq);
+	audio_close();
+	packet_queue_start(&is->audioq);
+	is->audio_thread_placed = 0;
+	if(audio_open(&wanted_spec, &spec) < 0 || spec.freq != wanted_spec.freq ||
+			spec.channels != wanted_spec.channels) {
+		fprintf(stderr, "audio: could not reopen with %d samples\n", samples);
+		audio_close();
+		/* we asked for what worked before */
+		wanted_spec.samples = is->audio_samples;
+		if(audio_open(&wanted_spec, &spec) < 0) {
+			fprintf(stderr, "SDL_OpenAudio: %s\n", SDL_GetError());
+			atomic_set(&is->audio_resize_req, 0);
+			return;
+		}
+		if(spec.freq != is->audio_tgt.freq || spec.channels != is->audio_tgt.channels) {
+			/* not even that: convert to what we got */
+			is->audio_tgt.freq = spec.freq;
+			is->audio_tgt.channels = spec.channels;
+			is->audio_tgt.channel_layout = av_get_default_channel_layout(spec.channels);
+			is->audio_src.freq = 0; /* audio_decode_frame makes a new swr_ctx */
+			mix_retarget(is);
+		}
+		/* don't try again */
+		audio_buffer_samples = is->audio_samples;
+	} else {
+		printf("audio: %d underruns, device buffer now %d samples (%.1f ms)\n",
+				is->audio_underruns, spec.samples, 1000.0 * spec.samples / spec.freq);
+		is->audio_reopens++;
+	}
+	is->audio_hw_buf_size = spec.size;
+	is->audio_samples = spec.samples;
+	is->audio_window_underruns = 0;
+	atomic_set(&is->audio_resize_req, 0);
+	if(!is->step_mode && !atomic_get(&is->live_buffering))
+		audio_pause(0);
+}
+
+int stream_component_open(VideoState *is, int stream_index) {
+
+	AVFormatContext *pFormatCtx = is->pFormatCtx;
+	AVCodecContext *codecCtx = NULL;
+	SDL_AudioSpec wanted_spec, spec;
+	int64_t wanted_channel_layout;
+	int wanted_nb_channels;
+	const char *env;
+
+	if(stream_index < 0 || stream_index >= pFormatCtx->nb_streams) {
+		return -1;
+	}
+
+	// Get a pointer to the codec context for the video stream
+	codecCtx = pFormatCtx->streams[stream_index]->codec;
+
+	if(codecCtx->codec_type == AVMEDIA_TYPE_AUDIO) {
+		// Set audio settings from codec info
+		wanted_spec.freq = codecCtx->sample_rate;
+		wanted_spec.format = AUDIO_S16SYS;
+		wanted_spec.channels = codecCtx->channels;
+		wanted_spec.silence = 0;
+		/* start small, audio_output_update asks for more on underruns */
+		wanted_spec.samples = audio_buffer_samples ? audio_buffer_samples :
+			FFMAX(AUDIO_BUFFER_MIN, 2 << av_log2(codecCtx->sample_rate / AUDIO_MAX_CALLBACKS_PER_SEC));
+		wanted_spec.callback = audio_callback;
+		wanted_spec.userdata = is;
+
+		/* SDL may start a new audio thread, which needs its own placement */
+		is->audio_thread_placed = 0;
+		if(audio_open(&wanted_spec, &spec) < 0) {
+			fprintf(stderr, "SDL_OpenAudio: %s\n", SDL_GetError());
+			return -1;
+		}
+		is->audio_hw_buf_size = spec.size;
+		is->audio_samples = spec.samples;
+
+		wanted_channel_layout = codecCtx->channel_layout;
+		wanted_nb_channels = codecCtx->channels;
+		env = SDL_getenv("SDL_AUDIO_CHANNELS");
+		if (env) {
+			wanted_nb_channels = atoi(env);
+			wanted_channel_layout = av_get_default_channel_layout(wanted_nb_channels);
+		}
+		if (!wanted_channel_layout || wanted_nb_channels != av_get_channel_layout_nb_channels(wanted_channel_layout)) {
+			wanted_channel_layout = av_get_default_channel_layout(wanted_nb_channels);
+			wanted_channel_layout &= ~AV_CH_LAYOUT_STEREO_DOWNMIX;
+		}
+
+		is->audio_tgt.fmt = AV_SAMPLE_FMT_S16;
+		is->audio_tgt.freq = spec.freq;
+		is->audio_tgt.channel_layout = wanted_channel_layout;
+		is->audio_tgt.channels = spec.channels;
+		/* a switched-to track may want another rate or layout */
+		mix_retarget(is);
+
+		is->audio_src = is->audio_tgt;
+		printf("samples: %u, bytes: %u\n", spec.samples, spec.size);
+		printf("codec id: %u, VORBIS = %d\n", codecCtx->codec_id, AV_CODEC_ID_VORBIS);
+		printf("channel_layout: %d\n", codecCtx->channel_layout);
+	}
+
+	if(stream_codec_open(is, codecCtx) < 0) {
+		fprintf(stderr, "Unsupported codec!\n");
+		if(codecCtx->codec_type == AVMEDIA_TYPE_AUDIO)
+			audio_close();
+		return -1;
+	}
+
+	pFormatCtx->streams[stream_index]->discard = AVDISCARD_DEFAULT;
+
+	switch(codecCtx->codec_type) {
+		case AVMEDIA_TYPE_AUDIO:
+			is->audioStream = stream_index;
+			is->audio_st = pFormatCtx->streams[stream_index];
+			atomic_set(&is->audio_buf_size, 0);
+			atomic_set(&is->audio_buf_index, 0);
+			atomic_set(&is->audio_write_time, 0);
+
+			/* averaging filter for audio sync */
+			is->audio_diff_avg_coef = exp(log(0.01 / AUDIO_DIFF_AVG_NB));
+			is->audio_diff_avg_count = 0;
+			/* Correct audio only if larger error than this */
+			is->audio_diff_threshold = 2.0 * SDL_AUDIO_BUFFER_SIZE / codecCtx->sample_rate;
+
+			memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
+			is->audio_drain_item = -1;
+			packet_queue_start(&is->audioq);
+			/* in live mode decode_thread unpauses once the jitter buffer is full */
+			if(!atomic_get(&is->live_buffering))
+				audio_pause(0);
+			break;
+		case AVMEDIA_TYPE_VIDEO:
+			is->videoStream = stream_index;
+			atomic_set_sc(&is->video_st, pFormatCtx->streams[stream_index]);
+
+			is->frame_timer = (double)clock_now() / 1000000.0;
+			is->frame_last_delay = 40e-3;
+			atomic_set(&is->video_current_pts_time, clock_now());
+
+			packet_queue_start(&is->videoq);
+			is->video_tid = SDL_CreateThread(video_thread, is);
+			refresh_start(is);
+			break;
+		case AVMEDIA_TYPE_SUBTITLE:
+			is->subtitleStream = stream_index;
+			is->subtitle_st = pFormatCtx->streams[stream_index];
+			packet_queue_start(&is->subtitleq);
+			is->subtitle_tid = SDL_CreateThread(subtitle_thread, is);
+			break;
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+/* Runs in decode_thread, between two av_read_frame calls, so the
+   demuxer never sees a half-closed stream. */
+static void stream_component_switch(VideoState *is, int codec_type, int stream_index) {
+
+	PacketQueue *q;
+	int old_index;
+
+	switch(codec_type) {
+		case AVMEDIA_TYPE_AUDIO:
+			old_index = is->audioStream;
+			q = &is->audioq;
+			break;
+		case AVMEDIA_TYPE_VIDEO:
+			old_index = is->videoStream;
+			q = &is->videoq;
+			break;
+		case AVMEDIA_TYPE_SUBTITLE:
+			old_index = is->subtitleStream;
+			q = &is->subtitleq;
+			break;
+		default:
+			return;
+	}
+	if(old_index == stream_index)
+		return;
+
+	/* the main thread shows no picture until the new decoder is open */
+	SDL_LockMutex(is->switch_mutex);
+	if(old_index >= 0)
+		stream_component_close(is, old_index);
+	if(stream_index < 0) {
+		SDL_UnlockMutex(is->switch_mutex);
+		return;
+	}
+
+	if(stream_component_open(is, stream_index) < 0) {
+		fprintf(stderr, "%s: could not switch to stream %d\n", is->filename, stream_index);
+		if(old_index < 0 || stream_component_open(is, old_index) < 0) {
+			SDL_UnlockMutex(is->switch_mutex);
+			return;
+		}
+		stream_index = old_index;
+	}
+	SDL_UnlockMutex(is->switch_mutex);
+	/* the new decoder starts clean, same as after a seek */
+	packet_queue_put(q, &flush_pkt);
+	printf("switched to stream %d\n", stream_index);
+}
+
+/* The cache key is the path plus size and modification time, so a file
+   that is replaced or rewritten is probed again. */
+static int streaminfo_cache_key(const char *filename, char *key, int key_size,
+		char *path, int path_size) {
+
+	struct stat st;
+	uint64_t hash = 0xcbf29ce484222325ULL; /* FNV-1a */
+	const char *dir;
+	const char *c;
+
+	if(stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+		return -1;
+	snprintf(key, key_size, "%s %lld %lld", filename,
+			(long long)st.st_size, (long long)st.st_mtime);
+	for(c = key; *c; c++) {
+		hash ^= (uint8_t)*c;
+		hash *= 0x100000001b3ULL;
+	}
+
+	/* per user: anyone can plant a file in /tmp for us to trust */
+	if(cache_dir) {
+		snprintf(path, path_size, "%s", cache_dir);
+	} else if((dir = getenv("XDG_CACHE_HOME")) && *dir) {
+		snprintf(path, path_size, "%s/tutorial07", dir);
+	} else if((dir = getenv("HOME")) && *dir) {
+		snprintf(path, path_size, "%s/.cache", dir);
+		mkdir(path, 0700);
+		av_strlcat(path, "/tutorial07", path_size);
+	} else {
+		return -1;
+	}
+	if(mkdir(path, 0700) < 0 && errno != EEXIST)
+		return -1;
+	av_strlcatf(path, path_size, "/%016llx.streaminfo", (unsigned long long)hash);
+	return 0;
+}
+
+static void streaminfo_cache_save(AVFormatContext *pFormatCtx,
+		const char *key, const char *path) {
+
+	FILE *f;
+	AVStream *st;
+	AVCodecContext *c;
+	char tmp[1024 + 8]; /* cache_path and the mkstemp suffix */
+	int i, j, fd, err;
+
+	/* written aside and renamed into place, so a reader never sees
+	   half a file, and never through a link someone left there */
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if(fd < 0 || !(f = fdopen(fd, "w"))) {
+		if(fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		fprintf(stderr, "cannot write stream info cache %s\n", path);
+		return;
+	}
+	fprintf(f, "%s\n%s\n", STREAMINFO_CACHE_MAGIC, key);
+	fprintf(f, "%u %lld %lld\n", pFormatCtx->nb_streams,
+			(long long)pFormatCtx->start_time, (long long)pFormatCtx->duration);
+	for(i = 0; i < pFormatCtx->nb_streams; i++) {
+		st = pFormatCtx->streams[i];
+		c = st->codec;
+		fprintf(f, "%d %d %u %d %d %d %d %d %d %d %d %d %d %d %llu %d %d\n",
+				c->codec_type, c->codec_id, c->codec_tag,
+				c->time_base.num, c->time_base.den,
+				c->width, c->height, c->pix_fmt,
+				c->sample_aspect_ratio.num, c->sample_aspect_ratio.den,
+				st->avg_frame_rate.num, st->avg_frame_rate.den,
+				c->sample_rate, c->channels,
+				(unsigned long long)c->channel_layout, c->sample_fmt,
+				c->extradata ? c->extradata_size : 0);
+		if(c->extradata) {
+			for(j = 0; j < c->extradata_size; j++)
+				fprintf(f, "%02x", c->extradata[j]);
+			fprintf(f, "\n");
+		}
+	}
+	err = ferror(f);
+	if(fclose(f) || err || rename(tmp, path) < 0) {
+		unlink(tmp);
+		fprintf(stderr, "cannot write stream info cache %s\n", path);
+	}
+}
+
+/* Fill the codec contexts from a previous run instead of probing.
+   Returns 0 only if every stream matched what the demuxer reported. */
+static int streaminfo_cache_load(AVFormatContext *pFormatCtx,
+		const char *key, const char *path) {
+
+	FILE *f;
+	char line[2048];
+	AVStream *st;
+	AVCodecContext *c;
+	unsigned int nb_streams;
+	long long start_time, duration;
+	unsigned long long channel_layout;
+	int type, codec_id, tb_num, tb_den, width, height, pix_fmt;
+	int sar_num, sar_den, fr_num, fr_den, sample_rate, channels, sample_fmt;
+	int extradata_size;
+	unsigned int codec_tag, byte;
+	int i, j, fd, ret = -1;
+	struct stat sb;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if(fd < 0)
+		return -1;
+	if(fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_uid != getuid() ||
+			!(f = fdopen(fd, "r"))) {
+		close(fd);
+		return -1;
+	}
+
+	if(!fgets(line, sizeof(line), f) ||
+			strncmp(line, STREAMINFO_CACHE_MAGIC, strlen(STREAMINFO_CACHE_MAGIC)))
+		goto fail;
+	if(!fgets(line, sizeof(line), f))
+		goto fail;
+	line[strcspn(line, "\n")] = 0;
+	if(strcmp(line, key))
+		goto fail;
+	if(fscanf(f, "%u %lld %lld", &nb_streams, &start_time, &duration) != 3 ||
+			nb_streams != pFormatCtx->nb_streams)
+		goto fail;
+
+	for(i = 0; i < nb_streams; i++) {
+		if(fscanf(f, "%d %d %u %d %d %d %d %d %d %d %d %d %d %d %llu %d %d",
+				&type, &codec_id, &codec_tag, &tb_num, &tb_den,
+				&width, &height, &pix_fmt, &sar_num, &sar_den,
+				&fr_num, &fr_den, &sample_rate, &channels,
+				&channel_layout, &sample_fmt, &extradata_size) != 17)
+			goto fail;
+		/* whatever is in there gets used without probing: only take
+		   what the decoders can live with */
+		if(type < 0 || type >= AVMEDIA_TYPE_NB || codec_id < 0 ||
+				tb_num < 0 || tb_den <= 0 || sar_num < 0 || sar_den < 0 ||
+				fr_num < 0 || fr_den < 0 ||
+				extradata_size < 0 || extradata_size > STREAMINFO_MAX_EXTRADATA)
+			goto fail;
+		if(type == AVMEDIA_TYPE_VIDEO && (width <= 0 || height <= 0 ||
+				av_image_check_size(width, height, 0, NULL) < 0 ||
+				pix_fmt < PIX_FMT_NONE || pix_fmt >= PIX_FMT_NB))
+			goto fail;
+		if(type == AVMEDIA_TYPE_AUDIO && (sample_rate <= 0 ||
+				channels <= 0 || channels > STREAMINFO_MAX_CHANNELS ||
+				sample_fmt < AV_SAMPLE_FMT_NONE || sample_fmt >= AV_SAMPLE_FMT_NB))
+			goto fail;
+
+		st = pFormatCtx->streams[i];
+		c = st->codec;
+		if(c->codec_type != type && c->codec_type != AVMEDIA_TYPE_UNKNOWN)
+			goto fail;
+		if(c->codec_id != codec_id && c->codec_id != AV_CODEC_ID_NONE)
+			goto fail;
+
+		c->codec_type = type;
+		c->codec_id = codec_id;
+		c->codec_tag = codec_tag;
+		c->time_base.num = tb_num;
+		c->time_base.den = tb_den;
+		c->width = width;
+		c->height = height;
+		c->pix_fmt = pix_fmt;
+		c->sample_aspect_ratio.num = sar_num;
+		c->sample_aspect_ratio.den = sar_den;
+		st->avg_frame_rate.num = fr_num;
+		st->avg_frame_rate.den = fr_den;
+		c->sample_rate = sample_rate;
+		c->channels = channels;
+		c->channel_layout = channel_layout;
+		c->sample_fmt = sample_fmt;
+
+		if(extradata_size > 0) {
+			uint8_t *extradata = av_mallocz(extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+			if(!extradata)
+				goto fail;
+			for(j = 0; j < extradata_size; j++) {
+				if(fscanf(f, "%2x", &byte) != 1) {
+					av_free(extradata);
+					goto fail;
+				}
+				extradata[j] = byte;
+			}
+			if(c->extradata) {
+				/* the demuxer already knows better */
+				av_free(extradata);
+			} else {
+				c->extradata = extradata;
+				c->extradata_size = extradata_size;
+			}
+		}
+	}
+
+	if(pFormatCtx->start_time == AV_NOPTS_VALUE)
+		pFormatCtx->start_time = start_time;
+	if(pFormatCtx->duration == AV_NOPTS_VALUE)
+		pFormatCtx->duration = duration;
+	ret = 0;
+
+fail:
+	fclose(f);
+	return ret;
+}
+
+/* pts is the newest demuxed master stream timestamp, in seconds */
+static void live_drop_to_keyframe(VideoState *is, double pts) {
+
+	int64_t key_pts;
+
+	if(is->videoStream >= 0) {
+		key_pts = packet_queue_drop_to_keyframe(&is->videoq);
+		if(key_pts == AV_NOPTS_VALUE)
+			return;
+		if(is->audioStream >= 0)
+			packet_queue_drop_before(&is->audioq, av_rescale_q(key_pts,
+						is->video_st->time_base, is->audio_st->time_base));
+	} else if(is->audioStream >= 0) {
+		/* audio only: keep just live_latency worth of packets */
+		key_pts = (int64_t)((pts - live_latency) / av_q2d(is->audio_st->time_base));
+		if(!packet_queue_drop_before(&is->audioq, key_pts))
+			return;
+	} else {
+		return;
+	}
+	is->live_keyframe_drops++;
+}
+
+/* Jitter buffer bookkeeping for every demuxed packet of the master
+   stream: hold playback until live_latency is buffered, then keep the
+   buffer near that target. */
+static void live_update(VideoState *is, AVPacket *pkt) {
+
+	AVStream *st;
+	int64_t ts, now;
+	double pts, arrival;
+	int master_index = is->audioStream >= 0 ? is->audioStream : is->videoStream;
+
+	if(pkt->stream_index != master_index)
+		return;
+	ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+	if(ts == AV_NOPTS_VALUE)
+		return;
+
+	st = is->pFormatCtx->streams[master_index];
+	pts = ts * av_q2d(st->time_base);
+	now = av_gettime();
+	arrival = now / 1000000.0;
+	if(!is->live_have_offset || arrival - pts < is->live_clock_offset) {
+		clock_set(&is->live_clock_offset, arrival - pts);
+		atomic_set(&is->live_have_offset, 1);
+	}
+
+	if(is->live_buffering) {
+		/* a stream may well start at pts 0 */
+		if(is->live_first_ts == AV_NOPTS_VALUE)
+			is->live_first_ts = ts;
+		if((ts - is->live_first_ts) * av_q2d(st->time_base) >= live_latency) {
+			/* frame_timer before the release that lets the main thread at it */
+			is->frame_timer = arrival;
+			atomic_set(&is->live_buffering, 0);
+			if(is->audioStream >= 0)
+				audio_pause(0);
+		}
+		return;
+	}
+
+	/* nothing has been played yet, the master clock means nothing */
+	if(!(is->audioStream >= 0 ? is->first_audio_time : is->first_video_time))
+		return;
+
+	clock_set(&is->live_buffered, pts - get_master_clock(is));
+	if(is->live_buffered > live_latency + LIVE_DROP_THRESHOLD)
+		live_drop_to_keyframe(is, pts);
+
+	if(now - is->live_report_time >= LIVE_REPORT_INTERVAL) {
+		printf("live: buffered %.0f ms, latency %.0f ms, %d speed-ups, %d keyframe drops\n",
+				is->live_buffered * 1000, clock_get(&is->live_latency_last) * 1000,
+				atomic_get(&is->live_speedups), is->live_keyframe_drops);
+		is->live_report_time = now;
+	}
+}
 
-				if(is->audio_frame.format != is->audio_src.fmt
-						|| dec_channel_layout != is->audio_src.channel_layout
-						|| is->audio_frame.sample_rate != is->audio_src.freq
-						|| is->swr_ctx == NULL)
-				{
-					if(is->swr_ctx)
-						swr_free(is->swr_ctx);
+static void spec_entry_free(SpecEntry *e) {
+	if(e->pict.data[0]) {
+		avpicture_free(&e->pict);
+		mem_charge(MEM_PICTURES, -e->size);
+	}
+	memset(e, 0, sizeof(SpecEntry));
+	e->stream = -1;
+}
 
-					is->swr_ctx = swr_alloc_set_opts(NULL,
-							is->audio_tgt.channel_layout, is->audio_tgt.fmt, is->audio_tgt.freq,
-							dec_channel_layout, is->audio_frame.format, is->audio_frame.sample_rate,
-							0, NULL);
-					if(is->swr_ctx == NULL || swr_init(is->swr_ctx) < 0)
-					{
-						printf("create swr_ctx error\n");
-						break;
-					}
+static void speculate_clear(VideoState *is) {
 
-					is->audio_src.channel_layout = dec_channel_layout;
-					is->audio_src.channels = av_frame_get_channels(&(is->audio_frame));
-					is->audio_src.freq = is->audio_frame.sample_rate;
-					is->audio_src.fmt = is->audio_frame.format;
-				}
+	int i;
 
-				if(is->swr_ctx)
-				{
-					const uint8_t **in = (const uint8_t **)is->audio_frame.extended_data;
-					uint8_t **out = &is->audio_buf1;
-					int out_count = (int64_t)is->audio_frame.nb_samples * is->audio_tgt.freq / is->audio_frame.sample_rate + 256;
-					int out_size = av_samples_get_buffer_size(NULL, is->audio_tgt.channels, out_count, is->audio_tgt.fmt, 0);
-					if(out_size < 0)
-					{
-						printf("av_samples_get_buffer_size error\n");
-						break;
-					}
+	SDL_LockMutex(is->spec_mutex);
+	for(i = 0; i < SPEC_CACHE_SIZE; i++)
+		spec_entry_free(&is->spec_cache[i]);
+	SDL_UnlockMutex(is->spec_mutex);
+}
 
-					av_fast_malloc(&is->audio_buf1, &is->audio_buf1_size, out_size);
-					if(!is->audio_buf1)
-						return AVERROR(ENOMEM);
-					len2 = swr_convert(is->swr_ctx, out, out_count, in, is->audio_frame.nb_samples);
-					if(len2 < 0)
-					{
-						printf("swr_convert error\n");
-						break;
-					}
-					if(len2 == out_count)
-					{
-						printf("warning: audio buffer is probably too small\n");
-						swr_init(is->swr_ctx);
-					}
+static int spec_entry_match(SpecEntry *e, int stream, double target) {
+	return e->stream >= 0 && e->stream == stream &&
+		target >= e->lo && target <= e->hi;
+}
 
-					is->audio_buf = is->audio_buf1;
-					resampled_data_size = len2 * is->audio_tgt.channels * av_get_bytes_per_sample(is->audio_tgt.fmt);
+/* The seek targets that av_seek_frame sends to the same keyframe as ts:
+   up to the next keyframe for a backward seek, back to the previous one
+   for a forward seek. Without an index, a small window around ts. */
+static void speculate_range(AVStream *st, int64_t ts, int backward,
+		double *lo, double *hi) {
 
-				}
-				else
-				{
-					is->audio_buf = is->audio_frame.data[0];
-					resampled_data_size = data_size;
-				}
+	double tb = av_q2d(st->time_base);
+	int i, j;
 
-				pts = is->audio_clock;
-				if(is->audio_frame.pts != AV_NOPTS_VALUE)
-				{
-					is->audio_clock = is->audio_frame.pts * av_q2d(tb) + (double)is->audio_frame.nb_samples / is->audio_frame.sample_rate;
-				}
-				*pts_ptr = pts;
+	i = av_index_search_timestamp(st, ts, backward ? AVSEEK_FLAG_BACKWARD : 0);
+	if(i < 0) {
+		*lo = ts * tb - SPEC_TOLERANCE;
+		*hi = ts * tb + SPEC_TOLERANCE;
+		return;
+	}
+	if(backward) {
+		*lo = st->index_entries[i].timestamp * tb;
+		for(j = i + 1; j < st->nb_index_entries &&
+				!(st->index_entries[j].flags & AVINDEX_KEYFRAME); j++);
+		*hi = j < st->nb_index_entries ?
+			st->index_entries[j].timestamp * tb : ts * tb + SPEC_TOLERANCE;
+	} else {
+		*hi = st->index_entries[i].timestamp * tb;
+		for(j = i - 1; j >= 0 && !(st->index_entries[j].flags & AVINDEX_KEYFRAME); j--);
+		*lo = j >= 0 ? st->index_entries[j].timestamp * tb : ts * tb - SPEC_TOLERANCE;
+	}
+}
 
-				return resampled_data_size;
-				// printf("channels: %u, nb_samples: %d, data_size: %d\n\n", is->audio_st->codec->channels,
-				//		  													is->audio_frame.nb_samples,
-				//															data_size);
-				//	printf("audio format: %d\n", is->audio_frame.format);
-				//   memcpy(is->audio_buf, is->audio_frame.data[0], data_size);
-			}
-		}
+static int speculate_open(AVFormatContext *fmt, int index) {
 
-		if(pkt->data)
-			av_free_packet(pkt);
+	AVCodecContext *codecCtx;
+	AVCodec *codec;
+	int i;
 
-		if(is->quit) {
-			return -1;
-		}
+	if(index < 0 || index >= fmt->nb_streams)
+		return -1;
+	for(i = 0; i < fmt->nb_streams; i++)
+		fmt->streams[i]->discard = i == index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+	codecCtx = fmt->streams[index]->codec;
+	codec = avcodec_find_decoder(codecCtx->codec_id);
+	if(!codec || avcodec_open2(codecCtx, codec, NULL) < 0)
+		return -1;
+	return 0;
+}
 
-		/* next packet */
-		if(packet_queue_get(&is->audioq, pkt, 1) < 0) {
-			return -1;
+/* Seek our own context the way decode_thread will for a seek to target
+   and keep the first picture that comes out of the decoder */
+static int speculate_decode(VideoState *is, AVFormatContext *fmt, int index,
+		AVFrame *frame, double target, int backward, SpecEntry *e) {
+
+	AVStream *st = fmt->streams[index];
+	AVCodecContext *codecCtx = st->codec;
+	AVPacket pkt;
+	int64_t ts, pts;
+	int got_picture = 0, n = 0;
+
+	ts = av_rescale_q((int64_t)(target * AV_TIME_BASE), AV_TIME_BASE_Q, st->time_base);
+	/* even a failure is remembered, seek or decode, so the target
+	   isn't retried; seek_display_start skips an entry without pict */
+	e->stream = index;
+	speculate_range(st, ts, backward, &e->lo, &e->hi);
+	if(av_seek_frame(fmt, index, ts, backward ? AVSEEK_FLAG_BACKWARD : 0) < 0)
+		return -1;
+	avcodec_flush_buffers(codecCtx);
+
+	while(!got_picture && n++ < SPEC_MAX_PACKETS &&
+			!atomic_get(&is->quit) && !atomic_get(&is->spec_quit)) {
+		if(av_read_frame(fmt, &pkt) < 0)
+			break;
+		if(pkt.stream_index == index)
+			avcodec_decode_video2(codecCtx, frame, &got_picture, &pkt);
+		av_free_packet(&pkt);
+	}
+	if(!got_picture)
+		return -1;
+
+	if(avpicture_alloc(&e->pict, codecCtx->pix_fmt, codecCtx->width, codecCtx->height) < 0)
+		return -1;
+	av_picture_copy(&e->pict, (AVPicture *)frame,
+			codecCtx->pix_fmt, codecCtx->width, codecCtx->height);
+	e->width = codecCtx->width;
+	e->height = codecCtx->height;
+	e->pix_fmt = codecCtx->pix_fmt;
+	e->size = avpicture_get_size(e->pix_fmt, e->width, e->height);
+	mem_charge(MEM_PICTURES, e->size);
+
+	pts = frame->pkt_pts != AV_NOPTS_VALUE ? frame->pkt_pts : frame->pkt_dts;
+	e->pts = pts != AV_NOPTS_VALUE ? pts * av_q2d(st->time_base) : target;
+	return 0;
+}
+
+static int speculate_interrupt_cb(void *opaque) {
+	VideoState *is = opaque;
+	return atomic_get(&is->quit) || atomic_get(&is->spec_quit);
+}
+
+/* The file and video stream on screen. With a playlist the decoders
+   can still be an item behind the demuxer. */
+static const char *video_item_source(VideoState *is, int *stream) {
+	if(playlist_size > 1 && is->video_item != is->demux_item) {
+		*stream = playlist[is->video_item].video_index;
+		return playlist[is->video_item].filename;
+	}
+	*stream = is->videoStream;
+	return is->filename;
+}
+
+/* Open the playing file a second time, for decoding away from the
+   playback pipeline */
+static AVFormatContext *input_open_secondary(VideoState *is, const char *filename,
+		const char *who, int (*interrupt_cb)(void *)) {
+
+	AVFormatContext *fmt;
+	AVIOInterruptCB callback;
+
+	callback.callback = interrupt_cb;
+	callback.opaque = is;
+	fmt = avformat_alloc_context();
+	if(!fmt)
+		return NULL;
+	fmt->interrupt_callback = callback;
+	if(avformat_open_input(&fmt, filename, NULL, NULL) != 0) {
+		printf("%s: can't open %s\n", who, filename);
+		return NULL;
+	}
+	if(avformat_find_stream_info(fmt, NULL) < 0) {
+		printf("%s: avformat_find_stream_info\n", who);
+		avformat_close_input(&fmt);
+		return NULL;
+	}
+	return fmt;
+}
+
+/* Keeps the pictures the arrow keys would seek to decoded ahead of time,
+   from a second demuxer so the playing one is never disturbed. One
+   target is refreshed per round, the one that went stale first. */
+int speculate_thread(void *arg) {
+
+	VideoState *is = (VideoState *)arg;
+	AVFormatContext *fmt = NULL;
+	AVFrame *frame = NULL;
+	SpecEntry e, old;
+	const char *filename;
+	double clock, target;
+	int index = -1, stream, opened = 0, fresh, i;
+
+	thread_setup(THREAD_ROLE_SPECULATE);
+
+	frame = avcodec_alloc_frame();
+	if(!frame)
+		return -1;
+
+	while(!atomic_get(&is->quit) && !atomic_get(&is->spec_quit)) {
+		filename = video_item_source(is, &stream);
+		if(!fmt || is->spec_item != is->video_item) {
+			/* the next playlist item is on screen: open its file */
+			if(opened)
+				avcodec_close(fmt->streams[index]->codec);
+			opened = 0;
+			if(fmt)
+				avformat_close_input(&fmt);
+			speculate_clear(is);
+			is->spec_item = is->video_item;
+			fmt = input_open_secondary(is, filename, "speculate", speculate_interrupt_cb);
+			if(!fmt)
+				break;
+			index = -1;
 		}
-		if(pkt->data == flush_pkt.data) {
-			avcodec_flush_buffers(is->audio_st->codec);
+		if(index != stream) {
+			/* the video track changed, what we have shows the old one */
+			if(opened)
+				avcodec_close(fmt->streams[index]->codec);
+			speculate_clear(is);
+			index = stream;
+			opened = speculate_open(fmt, index) == 0;
+		}
+
+		SDL_Delay(SPEC_POLL_INTERVAL);
+		if(!opened || atomic_get(&is->seek_req) || mem_over_budget())
 			continue;
+
+		/* our demuxer has the item's own timestamps */
+		clock = get_master_clock(is) - playlist_shift(is->spec_item);
+		for(i = 0; i < SPEC_CACHE_SIZE; i++) {
+			target = clock + spec_offsets[i];
+			SDL_LockMutex(is->spec_mutex);
+			fresh = spec_entry_match(&is->spec_cache[i], index, target);
+			SDL_UnlockMutex(is->spec_mutex);
+			if(fresh)
+				continue;
+
+			memset(&e, 0, sizeof(e));
+			if(speculate_decode(is, fmt, index, frame, target, spec_offsets[i] < 0, &e) == 0)
+				is->spec_decoded++;
+			SDL_LockMutex(is->spec_mutex);
+			old = is->spec_cache[i];
+			is->spec_cache[i] = e;
+			SDL_UnlockMutex(is->spec_mutex);
+			spec_entry_free(&old);
+			break;
 		}
-		is->audio_pkt_data = pkt->data;
-		is->audio_pkt_size = pkt->size;
-		/* if update, update the audio clock w/pts */
-		if(pkt->pts != AV_NOPTS_VALUE) {
-			is->audio_clock = av_q2d(is->audio_st->time_base)*pkt->pts;
+	}
+
+	if(opened)
+		avcodec_close(fmt->streams[index]->codec);
+	av_free(frame);
+	if(fmt)
+		avformat_close_input(&fmt);
+	return 0;
+}
+
+/* Called by the main thread when a seek is requested: show the
+   speculated picture for the target right away if we have it, and
+   time how long it takes until the new position is on screen. */
+static void seek_display_start(VideoState *is, double from, double to) {
+
+	SpecEntry *e;
+	VideoPicture vp;
+	double shift = playlist_shift(is->video_item);
+	int i, stream;
+
+	if(!atomic_get(&is->video_st))
+		return;
+	is->seek_from = from;
+	is->seek_to = to;
+	is->seek_start_time = av_gettime();
+	is->seek_display_pending = 1;
+	is->seek_display_hit = 0;
+	is->seek_count++;
+	if(!is->spec_tid || is->spec_item != is->video_item)
+		return;
+
+	video_item_source(is, &stream);
+	SDL_LockMutex(is->switch_mutex);
+	SDL_LockMutex(is->spec_mutex);
+	for(i = 0; i < SPEC_CACHE_SIZE; i++) {
+		e = &is->spec_cache[i];
+		if(e->pict.data[0] && spec_entry_match(e, stream, to - shift))
+			break;
+	}
+	/* is->video_st: not closed by a track switch meanwhile */
+	if(i < SPEC_CACHE_SIZE && atomic_get(&is->video_st)) {
+		memset(&vp, 0, sizeof(vp));
+		vp.pict = e->pict;
+		vp.width = e->width;
+		vp.height = e->height;
+		vp.pix_fmt = e->pix_fmt;
+		vp.pts = e->pts + shift;
+		video_display_picture(is, &vp);
+		is->seek_display_hit = 1;
+		is->seek_hits++;
+		is->seek_hit_latency += (av_gettime() - is->seek_start_time) / 1000000.0;
+	}
+	SDL_UnlockMutex(is->spec_mutex);
+	SDL_UnlockMutex(is->switch_mutex);
+}
+
+void stream_seek(VideoState *is, int64_t pos, int rel) {
+
+	if(!atomic_get(&is->seek_req)) {
+		is->seek_pos = pos;
+		is->seek_flags = rel < 0 ? AVSEEK_FLAG_BACKWARD : 0;
+		atomic_set(&is->seek_req, 1);
+	}
+}
+
+static void gop_free(Gop *gop) {
+
+	int i;
+
+	for(i = 0; i < gop->nb_frames; i++)
+		avpicture_free(&gop->frames[i].pict);
+	mem_charge(MEM_GOPS, -gop->size);
+	av_free(gop->frames);
+	av_free(gop);
+}
+
+static void gop_cache_clear(VideoState *is) {
+
+	Gop *gop;
+
+	while((gop = is->gop_cache) != NULL) {
+		is->gop_cache = gop->next;
+		gop_free(gop);
+	}
+	is->gop_cache_size = 0;
+	is->step_gop = NULL;
+}
+
+/* Drop least recently used GOPs over the limit, never the newest one
+   nor the one the main thread is about to show. With a process budget
+   the cache keeps to half of it, so a paused session can't starve
+   playback afterwards. Under step_mutex. */
+static void gop_cache_trim(VideoState *is) {
+
+	int64_t limit = gop_cache_limit;
+	Gop **prev, **last, *gop;
+
+	if(mem_governor.budget && limit > mem_governor.budget / 2)
+		limit = mem_governor.budget / 2;
+	while(is->gop_cache_size > limit && is->gop_cache && is->gop_cache->next) {
+		last = NULL;
+		for(prev = &is->gop_cache->next; *prev; prev = &(*prev)->next)
+			if(*prev != is->step_gop)
+				last = prev;
+		if(!last)
+			break;
+		gop = *last;
+		*last = gop->next;
+		is->gop_cache_size -= gop->size;
+		gop_free(gop);
+		is->gop_evictions++;
+	}
+}
+
+/* Find the cached GOP holding pts and make it the most recently used */
+static Gop *gop_cache_find(VideoState *is, double pts) {
+
+	Gop **prev, *gop;
+
+	for(prev = &is->gop_cache; (gop = *prev) != NULL; prev = &gop->next) {
+		if(pts >= gop->start && pts < gop->end) {
+			*prev = gop->next;
+			gop->next = is->gop_cache;
+			is->gop_cache = gop;
+			return gop;
 		}
 	}
+	return NULL;
 }
 
-void audio_callback(void *userdata, Uint8 *stream, int len) {
-	VideoState *is = (VideoState *)userdata;
-	int len1, audio_size;
-	double pts;
+static int step_interrupt_cb(void *opaque) {
+	VideoState *is = opaque;
+	return atomic_get(&is->quit);
+}
 
-	while(len > 0) {
-		if(is->audio_buf_index >= is->audio_buf_size) {
-			/* We have already sent all our data; get more */
-			audio_size = audio_decode_frame(is, &pts);
-			if(audio_size < 0) {
-				/* If error, output silence */
-				is->audio_buf_size = 1024;
-				memset(is->audio_buf, 0, is->audio_buf_size);
-			} else {
-				audio_size = synchronize_audio(is, (int16_t *)is->audio_buf,
-						audio_size, pts);
-				is->audio_buf_size = audio_size;
+static int gop_add_frame(Gop *gop, AVFrame *frame, AVCodecContext *codecCtx, double pts) {
+
+	GopFrame *frames, *f;
+	int size;
+
+	frames = av_realloc(gop->frames, (gop->nb_frames + 1) * sizeof(GopFrame));
+	if(!frames)
+		return -1;
+	gop->frames = frames;
+	f = &gop->frames[gop->nb_frames];
+	if(avpicture_alloc(&f->pict, codecCtx->pix_fmt, codecCtx->width, codecCtx->height) < 0)
+		return -1;
+	av_picture_copy(&f->pict, (AVPicture *)frame,
+			codecCtx->pix_fmt, codecCtx->width, codecCtx->height);
+	f->pts = pts;
+	gop->nb_frames++;
+
+	size = avpicture_get_size(codecCtx->pix_fmt, codecCtx->width, codecCtx->height);
+	gop->size += size;
+	mem_charge(MEM_GOPS, size);
+	return 0;
+}
+
+/* Decode the GOP whose keyframe is the last one at or before target.
+   Decoding goes on past the next keyframe until a picture at or after
+   it comes out, so the leading B-frames of an open GOP are kept too. */
+static Gop *gop_decode(VideoState *is, double target) {
+
+	AVStream *st = is->step_fmt->streams[is->step_stream];
+	AVCodecContext *codecCtx = st->codec;
+	AVFrame *frame = is->step_frame;
+	AVPacket pkt;
+	Gop *gop, *cached;
+	int64_t ts, start_time = av_gettime();
+	double tb = av_q2d(st->time_base), pts, last_pts = 0;
+	int got_picture, have_key = 0, eof = 0, done = 0;
+
+	gop = av_mallocz(sizeof(Gop));
+	if(!gop)
+		return NULL;
+	gop->start = gop->end = DBL_MAX;
+	gop->width = codecCtx->width;
+	gop->height = codecCtx->height;
+	gop->pix_fmt = codecCtx->pix_fmt;
+
+	ts = av_rescale_q((int64_t)(target * AV_TIME_BASE), AV_TIME_BASE_Q, st->time_base);
+	if(av_seek_frame(is->step_fmt, is->step_stream, ts, AVSEEK_FLAG_BACKWARD) < 0)
+		av_seek_frame(is->step_fmt, is->step_stream, ts, 0);
+	avcodec_flush_buffers(codecCtx);
+
+	while(!done && !atomic_get(&is->quit)) {
+		/* at the end of the file, end stays where the next keyframe put it */
+		if(!eof && av_read_frame(is->step_fmt, &pkt) < 0)
+			eof = 1;
+		if(eof) {
+			/* drain the pictures still held by the decoder */
+			av_init_packet(&pkt);
+			pkt.data = NULL;
+			pkt.size = 0;
+			pkt.stream_index = is->step_stream;
+		}
+		if(pkt.stream_index != is->step_stream) {
+			av_free_packet(&pkt);
+			continue;
+		}
+		if(!eof && (pkt.flags & AV_PKT_FLAG_KEY)) {
+			pts = (pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts) * tb;
+			if(!have_key) {
+				gop->start = pts;
+				have_key = 1;
+			} else if(gop->end == DBL_MAX) {
+				gop->end = pts;
 			}
-			is->audio_buf_index = 0;
 		}
-		len1 = is->audio_buf_size - is->audio_buf_index;
-		if(len1 > len)
-			len1 = len;
-		memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
-		len -= len1;
-		stream += len1;
-		is->audio_buf_index += len1;
+		if(!have_key) {
+			/* the demuxer didn't land on a keyframe */
+			av_free_packet(&pkt);
+			continue;
+		}
+		got_picture = 0;
+		avcodec_decode_video2(codecCtx, frame, &got_picture, &pkt);
+		if(!eof)
+			av_free_packet(&pkt);
+		if(!got_picture) {
+			if(eof)
+				break;
+			continue;
+		}
+		if(frame->pkt_pts != AV_NOPTS_VALUE)
+			pts = frame->pkt_pts * tb;
+		else if(frame->pkt_dts != AV_NOPTS_VALUE)
+			pts = frame->pkt_dts * tb;
+		else
+			pts = last_pts + av_q2d(codecCtx->time_base);
+		last_pts = pts;
+		if(pts < gop->start)
+			continue; /* references the GOP before ours */
+		if(pts >= gop->end) {
+			done = 1;
+			break;
+		}
+		if(gop_add_frame(gop, frame, codecCtx, pts) < 0)
+			break;
+	}
+
+	is->gop_decode_time += av_gettime() - start_time;
+	if(!gop->nb_frames) {
+		gop_free(gop);
+		return NULL;
+	}
+	if(gop->end == DBL_MAX)
+		gop->end = gop->frames[gop->nb_frames - 1].pts + 1.0; /* end of file */
+	/* stepping past either end of the file lands on a GOP we have */
+	if((cached = gop_cache_find(is, gop->start)) != NULL && cached->start == gop->start) {
+		gop_free(gop);
+		return cached;
 	}
+	SDL_LockMutex(is->step_mutex);
+	gop->next = is->gop_cache;
+	is->gop_cache = gop;
+	is->gop_cache_size += gop->size;
+	gop_cache_trim(is);
+	SDL_UnlockMutex(is->step_mutex);
+	return gop;
 }
 
-static Uint32 sdl_refresh_timer_cb(Uint32 interval, void *opaque) {
+static Gop *gop_get(VideoState *is, double pts) {
+
+	Gop *gop = gop_cache_find(is, pts);
+
+	if(gop) {
+		is->gop_hits++;
+		return gop;
+	}
+	is->gop_misses++;
+	return gop_decode(is, pts);
+}
+
+/* Main thread, on FF_STEP_EVENT: show what step_task picked */
+static void step_show(VideoState *is) {
+
+	VideoPicture vp;
+	Gop *gop;
+
+	SDL_LockMutex(is->switch_mutex);
+	SDL_LockMutex(is->step_mutex);
+	gop = is->step_gop;
+	if(gop && is->step_mode && atomic_get(&is->video_st)) {
+		memset(&vp, 0, sizeof(vp));
+		vp.pict = gop->frames[is->step_index].pict;
+		vp.width = gop->width;
+		vp.height = gop->height;
+		vp.pix_fmt = gop->pix_fmt;
+		vp.pts = gop->frames[is->step_index].pts + is->step_shift;
+		video_display_picture(is, &vp);
+	}
+	SDL_UnlockMutex(is->step_mutex);
+	SDL_UnlockMutex(is->switch_mutex);
+}
+
+/* Pick the next (dir 1) or previous (dir -1) picture. Within a cached
+   GOP that is just an index; crossing into a GOP that isn't cached
+   decodes it once. */
+static void step_frame(VideoState *is, int dir) {
+
+	Gop *gop, *next;
+	const char *filename;
+	double step_pts;
+	int i, stream;
 	SDL_Event event;
-	event.type = FF_REFRESH_EVENT;
-	event.user.data1 = opaque;
+
+	filename = video_item_source(is, &stream);
+	if(!is->step_fmt || is->step_stream != stream || is->step_item != is->video_item) {
+		/* first step, or the video track or playlist item changed */
+		if(is->step_fmt && is->step_stream >= 0)
+			avcodec_close(is->step_fmt->streams[is->step_stream]->codec);
+		is->step_stream = -1;
+		if(is->step_fmt && is->step_item != is->video_item)
+			avformat_close_input(&is->step_fmt);
+		SDL_LockMutex(is->step_mutex);
+		gop_cache_clear(is);
+		is->step_item = is->video_item;
+		is->step_shift = playlist_shift(is->step_item);
+		SDL_UnlockMutex(is->step_mutex);
+		if(!is->step_fmt)
+			is->step_fmt = input_open_secondary(is, filename, "step", step_interrupt_cb);
+		if(!is->step_fmt || speculate_open(is->step_fmt, stream) < 0)
+			return;
+		is->step_stream = stream;
+		if(!is->step_frame && !(is->step_frame = avcodec_alloc_frame()))
+			return;
+	}
+
+	SDL_LockMutex(is->step_mutex);
+	step_pts = is->step_pts;
+	SDL_UnlockMutex(is->step_mutex);
+	gop = gop_get(is, step_pts);
+	if(!gop)
+		return;
+	/* the picture on screen, or the one just after its pts */
+	for(i = 0; i < gop->nb_frames - 1 && gop->frames[i].pts < step_pts; i++);
+	if(gop->frames[i].pts <= step_pts || dir < 0)
+		i += dir;
+
+	if(i < 0) {
+		next = gop->start > 0 ? gop_get(is, gop->start - 0.001) : NULL;
+		if(!next || next->start >= gop->start) {
+			i = 0; /* first picture of the file */
+		} else {
+			gop = next;
+			i = gop->nb_frames - 1;
+		}
+	} else if(i >= gop->nb_frames) {
+		next = gop_get(is, gop->end);
+		if(!next || next->start <= gop->start) {
+			i = gop->nb_frames - 1; /* last picture of the file */
+		} else {
+			gop = next;
+			i = 0;
+		}
+	}
+	is->steps++;
+	SDL_LockMutex(is->step_mutex);
+	is->step_gop = gop;
+	is->step_index = i;
+	is->step_pts = gop->frames[i].pts;
+	SDL_UnlockMutex(is->step_mutex);
+
+	event.type = FF_STEP_EVENT;
+	event.user.data1 = is;
 	SDL_PushEvent(&event);
-	return 0; /* 0 means stop timer */
 }
 
-/* schedule a video refresh in 'delay' ms */
-static void schedule_refresh(VideoState *is, int delay) {
-	SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+/* On the task pool, so decoding a long GOP doesn't stall the event
+   loop; steps asked for meanwhile are taken one after another */
+static void step_task(void *arg) {
+
+	VideoState *is = arg;
+	int dir;
+
+	for(;;) {
+		SDL_LockMutex(is->step_mutex);
+		dir = is->step_requests > 0 ? 1 : is->step_requests < 0 ? -1 : 0;
+		if(!dir || atomic_get(&is->quit)) {
+			is->step_requests = 0;
+			is->step_busy = 0;
+			SDL_UnlockMutex(is->step_mutex);
+			break;
+		}
+		is->step_requests -= dir;
+		SDL_UnlockMutex(is->step_mutex);
+		step_frame(is, dir);
+	}
 }
 
-void video_display(VideoState *is) {
+/* Main thread: the . and , keys */
+static void step_request(VideoState *is, int dir) {
 
-	SDL_Rect rect;
-	VideoPicture *vp;
-    SubPicture *sp;
-    AVPicture pict;
-	//AVPicture pict;
-	float aspect_ratio;
-	int w, h, x, y;
-	//int i;
-    int i;
+	int start;
 
-	vp = &is->pictq[is->pictq_rindex];
-	if(vp->bmp) {
-        if (is->subtitle_st) 
-		{
-            if (is->subpq_size > 0) {
-                sp = &is->subpq[is->subpq_rindex];
+	SDL_LockMutex(is->step_mutex);
+	is->step_requests += dir;
+	start = !is->step_busy;
+	is->step_busy = 1;
+	SDL_UnlockMutex(is->step_mutex);
+	if(start)
+		task_submit(task_pool, &is->step_group, step_task, is);
+}
+
+/* Pause playback for stepping, or resume from the stepped position */
+static void step_mode_toggle(VideoState *is) {
+
+	double pts;
 
-                if (vp->pts >= sp->pts + ((float) sp->sub.start_display_time / 1000)) {
-                    SDL_LockYUVOverlay (vp->bmp);
+	if(!atomic_get(&is->video_st) || live_mode)
+		return;
+	/* step_pts is in the item's own time, like the GOPs */
+	SDL_LockMutex(is->step_mutex);
+	if(!is->step_mode) {
+		is->step_mode = 1;
+		is->step_pts = is->video_current_pts - playlist_shift(is->video_item);
+		SDL_UnlockMutex(is->step_mutex);
+		audio_pause(1);
+		return;
+	}
+	is->step_mode = 0;
+	pts = is->step_pts + playlist_shift(is->video_item);
+	SDL_UnlockMutex(is->step_mutex);
+	if(!atomic_get(&is->seek_req)) {
+		seek_display_start(is, is->video_current_pts, pts);
+		stream_seek(is, (int64_t)(pts * AV_TIME_BASE), -1);
+	}
+	/* don't make up for the time spent paused */
+	is->frame_timer = clock_now() / 1000000.0;
+	if(!atomic_get(&is->live_buffering))
+		audio_pause(0);
+}
 
-                    pict.data[0] = vp->bmp->pixels[0];
-                    pict.data[1] = vp->bmp->pixels[2];
-                    pict.data[2] = vp->bmp->pixels[1];
+int decode_interrupt_cb(void *opaque) {
+	return (global_video_state && atomic_get(&global_video_state->quit));
+}
 
-                    pict.linesize[0] = vp->bmp->pitches[0];
-                    pict.linesize[1] = vp->bmp->pitches[2];
-                    pict.linesize[2] = vp->bmp->pitches[1];
+/* The first stream of each type; everything is skipped by the demuxer
+   until stream_component_open */
+static void find_default_streams(AVFormatContext *pFormatCtx,
+		int *video_index, int *audio_index, int *subtitle_index) {
 
-                    for (i = 0; i < sp->sub.num_rects; i++)
-                        blend_subrect(&pict, sp->sub.rects[i],
-                                      vp->bmp->w, vp->bmp->h);
+	int i;
 
-                    SDL_UnlockYUVOverlay (vp->bmp);
-                }
-            }
-        }
-		
-		if(is->video_st->codec->sample_aspect_ratio.num == 0) {
-			aspect_ratio = 0;
-		} else {
-			aspect_ratio = av_q2d(is->video_st->codec->sample_aspect_ratio) *
-				is->video_st->codec->width / is->video_st->codec->height;
+	*video_index = *audio_index = *subtitle_index = -1;
+	for(i=0; i<pFormatCtx->nb_streams; i++) {
+		pFormatCtx->streams[i]->discard = AVDISCARD_ALL;
+		if(pFormatCtx->streams[i]->codec->codec_type==AVMEDIA_TYPE_VIDEO &&
+				*video_index < 0) {
+			*video_index=i;
 		}
-		if(aspect_ratio <= 0.0) {
-			aspect_ratio = (float)is->video_st->codec->width /
-				(float)is->video_st->codec->height;
+		if(pFormatCtx->streams[i]->codec->codec_type==AVMEDIA_TYPE_AUDIO &&
+				*audio_index < 0) {
+			*audio_index=i;
 		}
-		h = screen->h;
-		w = ((int)rint(h * aspect_ratio)) & -3;
+		if(pFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_SUBTITLE &&
+				*subtitle_index < 0)
+			*subtitle_index = i;
+	}
+}
 
-		if(w > screen->w) {
-			w = screen->w;
-			h = ((int)rint(w / aspect_ratio)) & -3;
-		}
-		x = (screen->w - w) / 2;
-		y = (screen->h - h) / 2;
+/* Close the decoders and the input of a playlist item */
+static void playlist_item_close(PlaylistItem *item) {
+
+	int i;
 
-		rect.x = x;
-		rect.y = y;
-		rect.w = w;
-		rect.h = h;
-		SDL_DisplayYUVOverlay(vp->bmp, &rect);
+	if(!item->fmt)
+		return;
+	for(i = 0; i < item->fmt->nb_streams; i++) {
+		if(avcodec_is_open(item->fmt->streams[i]->codec))
+			avcodec_close(item->fmt->streams[i]->codec);
 	}
+	avformat_close_input(&item->fmt);
 }
 
-void video_refresh_timer(void *userdata) {
+/* At exit, the items are closed already */
+static void playlist_free(void) {
 
-	VideoState *is = (VideoState *)userdata;
-	VideoPicture *vp;
-	double actual_delay, delay, sync_threshold, ref_clock, diff;
-    SubPicture *sp, *sp2;
+	int i;
 
-	if(is->video_st) {
-		if(is->pictq_size == 0) {
-			schedule_refresh(is, 1);
-		} else {
-			vp = &is->pictq[is->pictq_rindex];
+	for(i = 0; i < playlist_size; i++)
+		av_freep(&playlist[i].filename);
+	av_freep(&playlist);
+	playlist_size = 0;
+}
 
-			is->video_current_pts = vp->pts;
-			is->video_current_pts_time = av_gettime();
+/* Everything decode_thread does before it can read packets, for the
+   next playlist item, while the current one plays */
+static int playlist_prepare_thread(void *arg) {
 
-			delay = vp->pts - is->frame_last_pts; /* the pts from last time */
-			if(delay <= 0 || delay >= 1.0) {
-				/* if incorrect delay, use previous one */
-				delay = is->frame_last_delay;
-			}
-			/* save for next time */
-			is->frame_last_delay = delay;
-			is->frame_last_pts = vp->pts;
+	PlaylistItem *item = (PlaylistItem *)arg;
+	VideoState *is = global_video_state;
+	AVFormatContext *fmt;
+	AVIOInterruptCB callback;
+	int64_t start = av_gettime();
+	int *index[3], i;
 
-			/* update delay to sync to audio if not master source */
-			if(is->av_sync_type != AV_SYNC_VIDEO_MASTER) {
-				ref_clock = get_master_clock(is);
-				diff = vp->pts - ref_clock;
+	thread_setup(THREAD_ROLE_DECODE);
 
-				/* Skip or repeat the frame. Take delay into account
-				   FFPlay still doesn't "know if this is the best guess." */
-				sync_threshold = (delay > AV_SYNC_THRESHOLD) ? delay : AV_SYNC_THRESHOLD;
-				if(fabs(diff) < AV_NOSYNC_THRESHOLD) {
-					if(diff <= -sync_threshold) {
-						delay = 0;
-					} else if(diff >= sync_threshold) {
-						delay = 2 * delay;
-					}
-				}
-			}
+	callback.callback = decode_interrupt_cb;
+	callback.opaque = is;
+	fmt = avformat_alloc_context();
+	fmt->interrupt_callback = callback;
+	if(fast_start) {
+		fmt->probesize = FAST_PROBESIZE;
+		fmt->max_analyze_duration = FAST_ANALYZE_DURATION;
+	}
+	if(avformat_open_input(&fmt, item->filename, NULL, NULL) != 0) {
+		printf("avformat_open_input: %s\n", item->filename);
+		item->prepared = -1;
+		return -1;
+	}
+	item->fmt = fmt;
+	if(avformat_find_stream_info(fmt, NULL) < 0) {
+		printf("avformat_find_stream_info: %s\n", item->filename);
+		item->prepared = -1;
+		return -1;
+	}
 
-			is->frame_timer += delay;
-			/* computer the REAL delay */
-			actual_delay = is->frame_timer - (av_gettime() / 1000000.0);
-			if(actual_delay < 0.010) {
-				/* Really it should skip the picture instead */
-				actual_delay = 0.010;
-			}
-			schedule_refresh(is, (int)(actual_delay * 1000 + 0.5));
+	find_default_streams(fmt, &item->video_index, &item->audio_index, &item->subtitle_index);
+	index[0] = &item->video_index;
+	index[1] = &item->audio_index;
+	index[2] = &item->subtitle_index;
+	for(i = 0; i < 3; i++) {
+		if(*index[i] < 0)
+			continue;
+		if(stream_codec_open(is, fmt->streams[*index[i]]->codec) < 0) {
+			fprintf(stderr, "%s: unsupported codec in stream %d\n", item->filename, *index[i]);
+			*index[i] = -1;
+		} else {
+			fmt->streams[*index[i]]->discard = AVDISCARD_DEFAULT;
+		}
+	}
+	item->prepare_time = av_gettime() - start;
+	item->prepared = item->video_index >= 0 || item->audio_index >= 0 ? 1 : -1;
+	return 0;
+}
 
-			if (is->subpq_size > 0) {
-				sp = &is->subpq[is->subpq_rindex];
+static void playlist_prepare(int index) {
+	if(index < playlist_size && !playlist[index].prepare_tid && !playlist[index].prepared)
+		playlist[index].prepare_tid = SDL_CreateThread(playlist_prepare_thread, &playlist[index]);
+}
 
-				if (is->subpq_size > 1)
-					sp2 = &is->subpq[(is->subpq_rindex + 1) % SUBPICTURE_QUEUE_SIZE];
-				else
-					sp2 = NULL;
+/* Close the items that the demuxer and every decoder are done with */
+static void playlist_release_finished(VideoState *is) {
 
-				if ((is->video_current_pts > (sp->pts + ((float) sp->sub.end_display_time / 1000)))
-						|| (sp2 && is->video_current_pts > (sp2->pts + ((float) sp2->sub.start_display_time / 1000))))
-				{
-					avsubtitle_free(&sp->sub);
+	int i, done = is->demux_item;
 
-					/* update queue size and signal for next picture */
-					if (++is->subpq_rindex == SUBPICTURE_QUEUE_SIZE)
-						is->subpq_rindex = 0;
+	if(is->audio_st && is->audio_item < done)
+		done = is->audio_item;
+	if(atomic_get(&is->video_st) && is->video_item < done)
+		done = is->video_item;
+	if(is->subtitle_st && is->subtitle_item < done)
+		done = is->subtitle_item;
+	for(i = 0; i < done; i++)
+		playlist_item_close(&playlist[i]);
+}
 
-					SDL_LockMutex(is->subpq_mutex);
-					is->subpq_size--;
-					SDL_CondSignal(is->subpq_cond);
-					SDL_UnlockMutex(is->subpq_mutex);
-				}
-			}
+/* The current item has run out: go on with the next one. If it has the
+   same kinds of streams, the decoders just follow the item markers and
+   the audio device keeps playing (the resampler adapts to the new
+   format). Otherwise every component is closed and opened again. */
+static int playlist_advance(VideoState *is) {
 
-			/* show the picture! */
-			video_display(is);
+	PlaylistItem *next;
+	int64_t now = av_gettime(), start;
+	int gapless;
 
-			/* update queue for next picture! */
-			if(++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE) {
-				is->pictq_rindex = 0;
-			}
-			SDL_LockMutex(is->pictq_mutex);
-			is->pictq_size--;
-			SDL_CondSignal(is->pictq_cond);
-			SDL_UnlockMutex(is->pictq_mutex);
+	for(;;) {
+		if(is->demux_item + 1 >= playlist_size)
+			return -1;
+		next = &playlist[is->demux_item + 1];
+		playlist_prepare(is->demux_item + 1);
+		start = av_gettime();
+		if(next->prepare_tid)
+			SDL_WaitThread(next->prepare_tid, NULL);
+		next->prepare_tid = NULL;
+		next->wait_time = av_gettime() - start;
+		if(atomic_get(&is->quit))
+			return -1;
+		if(next->prepared > 0)
+			break;
+		/* can't be played: skip it */
+		fprintf(stderr, "%s: skipped\n", next->filename);
+		playlist_item_close(next);
+		is->demux_item++;
+	}
+	next->eof_time = now;
+	next->shift = is->demux_end;
+	if(next->fmt->start_time != AV_NOPTS_VALUE)
+		next->shift -= next->fmt->start_time / (double)AV_TIME_BASE;
+
+	gapless = (next->audio_index >= 0) == (is->audioStream >= 0) &&
+		(next->video_index >= 0) == (is->videoStream >= 0);
+	if(!gapless) {
+		if(is->audioStream >= 0)
+			stream_component_close(is, is->audioStream);
+		if(is->videoStream >= 0)
+			stream_component_close(is, is->videoStream);
+	}
+	/* subtitles come and go between items */
+	if(is->subtitleStream >= 0 && (!gapless || next->subtitle_index < 0))
+		stream_component_close(is, is->subtitleStream);
+
+	av_strlcpy(is->filename, next->filename, sizeof(is->filename));
+	is->pFormatCtx = next->fmt;
+	is->demux_item++;
+	next->gapless = gapless;
+
+	if(gapless) {
+		if(is->audioStream >= 0) {
+			is->audioStream = next->audio_index;
+			packet_queue_put_item(&is->audioq, is->demux_item);
+		}
+		if(is->videoStream >= 0) {
+			is->videoStream = next->video_index;
+			packet_queue_put_item(&is->videoq, is->demux_item);
+		}
+		if(is->subtitleStream >= 0) {
+			is->subtitleStream = next->subtitle_index;
+			packet_queue_put_item(&is->subtitleq, is->demux_item);
+		} else if(next->subtitle_index >= 0) {
+			is->subtitle_item = is->demux_item;
+			stream_component_open(is, next->subtitle_index);
 		}
 	} else {
-		schedule_refresh(is, 100);
+		/* the new decoders start with this item */
+		is->audio_item = is->video_item = is->subtitle_item = is->demux_item;
+		next->audio_switch_time = next->video_switch_time = now;
+		if(next->audio_index >= 0)
+			stream_component_open(is, next->audio_index);
+		if(next->video_index >= 0)
+			stream_component_open(is, next->video_index);
+		if(next->subtitle_index >= 0)
+			stream_component_open(is, next->subtitle_index);
 	}
+	printf("playlist: %s\n", next->filename);
+
+	playlist_prepare(is->demux_item + 1);
+	playlist_release_finished(is);
+	return 0;
 }
 
-void alloc_picture(void *userdata) {
+/* Where the current item ends in playlist time, so the next one can
+   start right after it */
+static void playlist_track_end(VideoState *is, AVPacket *pkt) {
 
-	VideoState *is = (VideoState *)userdata;
-	VideoPicture *vp;
+	AVStream *st = is->pFormatCtx->streams[pkt->stream_index];
+	int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+	double end;
 
-	vp = &is->pictq[is->pictq_windex];
-	if(vp->bmp) {
-		// we already have one make another, bigger/smaller
-		SDL_FreeYUVOverlay(vp->bmp);
-	}
-	// Allocate a place to put our YUV image on that screen
-	vp->bmp = SDL_CreateYUVOverlay(is->video_st->codec->width,
-			is->video_st->codec->height,
-			SDL_YV12_OVERLAY,
-			screen);
-	vp->width = is->video_st->codec->width;
-	vp->height = is->video_st->codec->height;
+	if(ts == AV_NOPTS_VALUE)
+		return;
+	end = (ts + pkt->duration) * av_q2d(st->time_base) + playlist_shift(is->demux_item);
+	if(end > is->demux_end)
+		is->demux_end = end;
+}
+int decode_thread(void *arg) {
 
-	SDL_LockMutex(is->pictq_mutex);
-	vp->allocated = 1;
-	SDL_CondSignal(is->pictq_cond);
-	SDL_UnlockMutex(is->pictq_mutex);
+	VideoState *is = (VideoState *)arg;
+	AVFormatContext *pFormatCtx = NULL;
+	AVPacket pkt1, *packet = &pkt1;
 
-}
+	AVIOInterruptCB callback;
+	char cache_key[1100];
+	char cache_path[1024];
+	int have_cache_key = 0;
 
-int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
+	int video_index = -1;
+	int audio_index = -1;
+	int subtitle_index = -1;
+	int i, fail_flag = 0;
 
-	VideoPicture *vp;
-	//int dst_pix_fmt;
-	AVPicture pict;
+	is->videoStream=-1;
+	is->audioStream=-1;
+	is->subtitleStream=-1;
 
-	/* wait until we have space for a new pic */
-	SDL_LockMutex(is->pictq_mutex);
-	while(is->pictq_size >= VIDEO_PICTURE_QUEUE_SIZE &&
-			!is->quit) {
-		SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+	thread_setup(THREAD_ROLE_DECODE);
+
+	global_video_state = is;
+	// will interrupt blocking functions if we quit!
+	callback.callback = decode_interrupt_cb;
+	callback.opaque = is;
+
+	// Open video file
+	pFormatCtx = avformat_alloc_context();
+	pFormatCtx->interrupt_callback = callback;
+	if(live_mode) {
+		pFormatCtx->probesize = LIVE_PROBESIZE;
+		pFormatCtx->max_analyze_duration = LIVE_ANALYZE_DURATION;
+		pFormatCtx->flags |= AVFMT_FLAG_NOBUFFER;
+	} else if(fast_start) {
+		pFormatCtx->probesize = FAST_PROBESIZE;
+		pFormatCtx->max_analyze_duration = FAST_ANALYZE_DURATION;
+	}
+	if(avformat_open_input(&pFormatCtx, is->filename, NULL, NULL)!=0)
+	{
+		printf("avformat_open_input: %s\n", is->filename);
+		goto open_failed;
 	}
-	SDL_UnlockMutex(is->pictq_mutex);
 
-	if(is->quit)
-		return -1;
+	is->pFormatCtx = pFormatCtx;
+	is->open_done_time = av_gettime();
+
+	if(fast_start) {
+		have_cache_key = streaminfo_cache_key(is->filename,
+				cache_key, sizeof(cache_key), cache_path, sizeof(cache_path)) == 0;
+		if(have_cache_key)
+			is->streaminfo_cached =
+				streaminfo_cache_load(pFormatCtx, cache_key, cache_path) == 0;
+	}
 
-	// windex is set to 0 initially
-	vp = &is->pictq[is->pictq_windex];
-
-	/* allocate or resize the buffer! */
-	if(!vp->bmp ||
-			vp->width != is->video_st->codec->width ||
-			vp->height != is->video_st->codec->height) {
-		SDL_Event event;
-
-		vp->allocated = 0;
-		/* we have to do it in the main thread */
-		event.type = FF_ALLOC_EVENT;
-		event.user.data1 = is;
-		SDL_PushEvent(&event);
-
-		/* wait until we have a picture allocated */
-		SDL_LockMutex(is->pictq_mutex);
-		while(!vp->allocated && !is->quit) {
-			SDL_CondWait(is->pictq_cond, is->pictq_mutex);
-		}
-		SDL_UnlockMutex(is->pictq_mutex);
-		if(is->quit) {
-			return -1;
+	// Retrieve stream information
+	if(!is->streaminfo_cached) {
+		if(avformat_find_stream_info(pFormatCtx, NULL)<0)
+		{
+			printf("avformat_find_stream_info\n");
+			goto open_failed;
 		}
+		if(have_cache_key)
+			streaminfo_cache_save(pFormatCtx, cache_key, cache_path);
 	}
-	/* We have a place to put our picture on the queue */
-	/* If we are skipping a frame, do we set this to null 
-	   but still return vp->allocated = 1? */
+	is->probe_done_time = av_gettime();
 
+	// Dump information about file onto standard error
+	if(!fast_start)
+		av_dump_format(pFormatCtx, 0, is->filename, 0);
+
+	// Find the first video stream
+	find_default_streams(pFormatCtx, &video_index, &audio_index, &subtitle_index);
+	if(audio_index >= 0) {
+		stream_component_open(is, audio_index);
+	}
+	if(video_index >= 0) {
+		stream_component_open(is, video_index);
+	}   
+	if(subtitle_index >= 0){
+		stream_component_open(is, subtitle_index);
+	}
 
-	if(vp->bmp) {
+open_failed:
+	/* with a playlist, go on with the next item that plays */
+	while(is->videoStream < 0 && is->audioStream < 0) {
+		fprintf(stderr, "%s: no audio or video to play\n", is->filename);
+		if(playlist_size <= 1 || atomic_get(&is->quit))
+			goto READ_RET;
+		if(is->subtitleStream >= 0)
+			stream_component_close(is, is->subtitleStream);
+		playlist[is->demux_item].fmt = pFormatCtx;
+		playlist_item_close(&playlist[is->demux_item]);
+		is->pFormatCtx = NULL;
+		if(playlist_advance(is) < 0)
+			goto READ_RET;
+		pFormatCtx = is->pFormatCtx;
+	}
+	/* the master clock has to be one that runs */
+	if(is->audioStream < 0 && is->av_sync_type == AV_SYNC_AUDIO_MASTER)
+		is->av_sync_type = AV_SYNC_VIDEO_MASTER;
+	if(is->videoStream < 0 && is->av_sync_type == AV_SYNC_VIDEO_MASTER)
+		is->av_sync_type = AV_SYNC_AUDIO_MASTER;
+	if(mix_spec)
+		mix_open(is);
+	if(vis_mode && is->videoStream < 0 && !strcmp(video_sink->name, "sdl"))
+		vis_open(is, vis_mode);
+
+	if(playlist_size > 1 && is->demux_item == 0) {
+		playlist[0].fmt = pFormatCtx;
+		playlist[0].video_index = is->videoStream;
+		playlist[0].audio_index = is->audioStream;
+		playlist[0].subtitle_index = is->subtitleStream;
+		playlist[0].prepared = 1;
+		playlist_prepare(1);
+	}
 
-		SDL_LockYUVOverlay(vp->bmp);
+	/* a live source runs at the sender's pace, so let audio lead and have
+	   video follow it when catching up */
+	if(live_mode)
+		is->av_sync_type = is->audioStream >= 0 ? AV_SYNC_AUDIO_MASTER : AV_SYNC_VIDEO_MASTER;
 
-		//dst_pix_fmt = PIX_FMT_YUV420P;
-		/* point pict at the queue */
+	/* a live source can't seek */
+	if(speculate && !live_mode && is->videoStream >= 0)
+		is->spec_tid = SDL_CreateThread(speculate_thread, is);
 
-		pict.data[0] = vp->bmp->pixels[0];
-		pict.data[1] = vp->bmp->pixels[2];
-		pict.data[2] = vp->bmp->pixels[1];
+	is->demux_ready = 1;
 
-		pict.linesize[0] = vp->bmp->pitches[0];
-		pict.linesize[1] = vp->bmp->pitches[2];
-		pict.linesize[2] = vp->bmp->pitches[1];
+	// main decode loop
 
-		// Convert the image into YUV format that SDL uses
-		sws_scale
-			(
-			 is->sws_ctx,
-			 (uint8_t const * const *)pFrame->data,
-			 pFrame->linesize,
-			 0, 
-			 is->video_st->codec->height, 
-			 pict.data, 
-			 pict.linesize
-			);
+	for(;;) {
+		if(atomic_get(&is->quit)) {
+			break;
+		}
+		// seek stuff goes here
+		if(atomic_get(&is->seek_req)) {
+			int stream_index= -1;
+			int64_t seek_target = is->seek_pos;
 
-		SDL_UnlockYUVOverlay(vp->bmp);
-		vp->pts = pts;
+			if     (is->videoStream >= 0) stream_index = is->videoStream;
+			else if(is->audioStream >= 0) stream_index = is->audioStream;
 
-		/* now we inform our display thread that we have a pic ready */
-		if(++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE) {
-			is->pictq_windex = 0;
+			/* seeks stay within the current playlist item */
+			seek_target -= (int64_t)(playlist_shift(is->demux_item) * AV_TIME_BASE);
+			if(stream_index>=0){
+				seek_target= av_rescale_q(seek_target, AV_TIME_BASE_Q, is->pFormatCtx->streams[stream_index]->time_base);
+			}
+			if(av_seek_frame(is->pFormatCtx, stream_index, seek_target, is->seek_flags) < 0) {
+				fprintf(stderr, "%s: error while seeking\n", is->pFormatCtx->filename);
+				/* nothing new is coming, keep showing what we have */
+				is->seek_display_pending = 0;
+			} else {
+				if(is->audioStream >= 0) {
+					packet_queue_flush(&is->audioq);
+					packet_queue_put(&is->audioq, &flush_pkt);
+					/* the flush may have taken an item marker with it */
+					if(playlist_size > 1)
+						packet_queue_put_item(&is->audioq, is->demux_item);
+				}
+				if(is->videoStream >= 0) {
+					packet_queue_flush(&is->videoq);
+					packet_queue_put(&is->videoq, &flush_pkt);
+					if(playlist_size > 1)
+						packet_queue_put_item(&is->videoq, is->demux_item);
+				}
+				for(i = 0; i < is->nb_mix; i++) {
+					packet_queue_flush(&is->mix[i].q);
+					mix_track_flush(&is->mix[i]);
+					packet_queue_put(&is->mix[i].q, &flush_pkt);
+				}
+				is->demux_end = 0;
+				is->eof = 0;
+			}
+			atomic_set(&is->seek_req, 0);
+		}
+		if(atomic_get(&is->switch_req)) {
+			stream_component_switch(is, is->switch_type, is->switch_stream);
+			atomic_set(&is->switch_req, 0);
+		}
+		if(is->audioStream >= 0 && atomic_get(&is->audio_resize_req))
+			audio_reopen(is);
+
+		/* a live source must never be throttled, the jitter buffer
+		   bounds the queues instead. A simulation plays audio and video
+		   from one thread, which can't get to a full queue while it waits
+		   on an empty one. A full mixed track only holds us back while
+		   the main audio has something to play, or its callback, which
+		   drains the track, would starve. */
+		if(!live_mode && (is->audioq.size > MAX_AUDIOQ_SIZE ||
+				is->videoq.size > MAX_VIDEOQ_SIZE ||
+				(is->audioq.nb_packets && mix_queues_full(is))) &&
+				!(simulate && ((is->audioStream >= 0 && !is->audioq.nb_packets) ||
+				(is->videoStream >= 0 && !is->videoq.nb_packets)))) {
+			/* a full audio queue lasts seconds, no need to poll it often */
+			SDL_Delay(is->videoStream >= 0 ? 10 : 100);
+			continue;
+		}
+		if(mem_governor.report_interval &&
+				av_gettime() - mem_governor.report_time >= mem_governor.report_interval) {
+			mem_print_usage("memory: ", 0);
+			mem_governor.report_time = av_gettime();
+		}
+		/* Over the process budget: let the pipeline drain. Keep reading
+		   if a stream we play has run dry though, or it would stall with
+		   the memory held by the other one. A live source can't wait,
+		   so it loses its backlog instead. */
+		if(mem_over_budget()) {
+			if(live_mode) {
+				live_drop_to_keyframe(is, get_master_clock(is) + live_latency);
+			} else if((is->audioStream < 0 || is->audioq.nb_packets) &&
+					(is->videoStream < 0 || is->videoq.nb_packets)) {
+				mem_governor.throttles++;
+				mem_governor.throttle_time += MEM_THROTTLE_DELAY * 1000;
+				SDL_Delay(MEM_THROTTLE_DELAY);
+				continue;
+			}
+		}
+		if(playlist_size > 1)
+			playlist_release_finished(is);
+		if(av_read_frame(is->pFormatCtx, packet) < 0) {
+			if(playlist_size > 1 && playlist_advance(is) == 0)
+				continue;
+			if(is->pFormatCtx->pb->error == 0) {
+				is->eof = 1;
+				SDL_Delay(100); /* no error; wait for user input */
+				continue;
+			} else {
+				fail_flag = 1;
+				break;
+			}
+		}
+		if(live_mode)
+			live_update(is, packet);
+		if(playlist_size > 1 && (packet->stream_index == is->videoStream ||
+					packet->stream_index == is->audioStream))
+			playlist_track_end(is, packet);
+		// Is this a packet from the video stream?
+		if(packet->stream_index == is->videoStream) {
+			packet_queue_put(&is->videoq, packet);
+		} else if(packet->stream_index == is->audioStream) {
+			packet_queue_put(&is->audioq, packet);
+		} else if(packet->stream_index == is->subtitleStream)
+		{
+			packet_queue_put(&is->subtitleq, packet);
+		}	
+		else {
+			for(i = 0; i < is->nb_mix; i++)
+				if(packet->stream_index == is->mix[i].stream_index)
+					break;
+			if(i < is->nb_mix && is->mix[i].q.size > MAX_MIXQ_SIZE) {
+				is->mix[i].dropped++;
+				av_free_packet(packet);
+			} else if(i < is->nb_mix)
+				packet_queue_put(&is->mix[i].q, packet);
+			else
+				av_free_packet(packet);
 		}
-		SDL_LockMutex(is->pictq_mutex);
-		is->pictq_size++;
-		SDL_UnlockMutex(is->pictq_mutex);
 	}
-	return 0;
-}
-
-double synchronize_video(VideoState *is, AVFrame *src_frame, double pts) {
+	/* all done - wait for it */
+	while(!atomic_get(&is->quit)) {
+		SDL_Delay(100);
+	}
 
-	double frame_delay;
+READ_RET:
+	{
+		is->eof = 1;
+		if(is->spec_tid) {
+			atomic_set(&is->spec_quit, 1);
+			SDL_WaitThread(is->spec_tid, NULL);
+			is->spec_tid = NULL;
+			speculate_clear(is);
+		}
+		if (is->audioStream >= 0)
+			stream_component_close(is, is->audioStream);
+		mix_close(is);
+		if (is->videoStream >= 0)
+			stream_component_close(is, is->videoStream);
+		if (is->subtitleStream >= 0)
+			stream_component_close(is, is->subtitleStream);
+		for (i = 0; i < playlist_size; i++)
+		{
+			if (playlist[i].prepare_tid)
+				SDL_WaitThread(playlist[i].prepare_tid, NULL);
+			playlist[i].prepare_tid = NULL;
+			if (playlist[i].fmt != is->pFormatCtx)
+				playlist_item_close(&playlist[i]);
+		}
+		if(is->pFormatCtx)
+		{
+			/* a playlist item's decoders are opened ahead of time */
+			for(i = 0; i < is->pFormatCtx->nb_streams; i++) {
+				if(avcodec_is_open(is->pFormatCtx->streams[i]->codec))
+					avcodec_close(is->pFormatCtx->streams[i]->codec);
+			}
+			avformat_close_input(&is->pFormatCtx);
+		}
 
-	if(pts != 0) {
-		/* if we have pts, set video clock to it */
-		is->video_clock = pts;
-	} else {
-		/* if we aren't given a pts, set it to the clock */
-		pts = is->video_clock;
+		if(fail_flag)
+		{
+			SDL_Event event;
+			event.type = FF_QUIT_EVENT;
+			event.user.data1 = is;
+			SDL_PushEvent(&event);
+		}
 	}
-	/* update the video clock */
-	frame_delay = av_q2d(is->video_st->codec->time_base);
-	/* if we are repeating a frame, adjust clock accordingly */
-	frame_delay += src_frame->repeat_pict * (frame_delay * 0.5);
-	is->video_clock += frame_delay;
-	return pts;
+	return 0;
 }
 
-uint64_t global_video_pkt_pts = AV_NOPTS_VALUE;
-
-/* These are called whenever we allocate a frame
- * buffer. We use this to store the global_pts in
- * a frame at the time it is allocated.
- */
-int our_get_buffer(struct AVCodecContext *c, AVFrame *pic) {
-	int ret = avcodec_default_get_buffer(c, pic);
-	uint64_t *pts = av_malloc(sizeof(uint64_t));
-	*pts = global_video_pkt_pts;
-	pic->opaque = pts;
-	return ret;
-}
-void our_release_buffer(struct AVCodecContext *c, AVFrame *pic) {
-	if(pic) av_freep(&pic->opaque);
-	avcodec_default_release_buffer(c, pic);
-}
+/* Ask decode_thread to switch the audio/video/subtitle track to
+   stream_index (-1 turns subtitles off). */
+int stream_select(VideoState *is, int codec_type, int stream_index) {
 
-int subtitle_thread(void *arg)
-{
-	VideoState *is = (VideoState *)arg;
-    SubPicture *sp;
-	double pts;
-	int ret, got_subtitle;
-	AVPacket pkt1, *pkt = &pkt1;
-    int i, j;
-    int r, g, b, y, u, v, a;
+	if(stream_index >= (int)is->pFormatCtx->nb_streams)
+		return -1;
+	if(stream_index >= 0 &&
+			is->pFormatCtx->streams[stream_index]->codec->codec_type != codec_type)
+		return -1;
+	if(stream_index < 0 && codec_type != AVMEDIA_TYPE_SUBTITLE)
+		return -1;
+	if(atomic_get(&is->switch_req))
+		return -1;
 
-	while(1)
-	{
-		ret = packet_queue_get(&is->subtitleq, pkt, 1);
-		if(ret < 0)
-			break;
+	is->switch_type = codec_type;
+	is->switch_stream = stream_index;
+	atomic_set(&is->switch_req, 1);
+	return 0;
+}
 
-		if(pkt->data == flush_pkt.data)
-		{
-			avcodec_flush_buffers(is->subtitle_st->codec);
-			continue;
-		}
-		
-        SDL_LockMutex(is->subpq_mutex);
-        while (is->subpq_size >= SUBPICTURE_QUEUE_SIZE &&
-               !is->quit) {
-            SDL_CondWait(is->subpq_cond, is->subpq_mutex);
-        }
-        SDL_UnlockMutex(is->subpq_mutex);
+/* Select the next track of the given type, wrapping around; for
+   subtitles the cycle goes through "off" as well */
+void stream_cycle_channel(VideoState *is, int codec_type) {
 
-		if(is->quit)
-			return 0;
+	AVFormatContext *pFormatCtx = is->pFormatCtx;
+	AVStream *st;
+	int start_index, stream_index;
 
-		sp = &is->subpq[is->subpq_windex];
-		pts = 0;
-		if(pkt->pts != AV_NOPTS_VALUE)
-			pts = av_q2d(is->subtitle_st->time_base) * pkt->pts;
+	if(!pFormatCtx)
+		return;
 
-		avcodec_decode_subtitle2(is->subtitle_st->codec, &sp->sub, &got_subtitle, pkt);
-		if(got_subtitle && sp->sub.format == 0)
-		{
-			if(sp->sub.pts != AV_NOPTS_VALUE)
-				pts = sp->sub.pts / (double)AV_TIME_BASE;
-			sp->pts = pts;
-
-
-            for (i = 0; i < sp->sub.num_rects; i++)
-            {
-                for (j = 0; j < sp->sub.rects[i]->nb_colors; j++)
-                {
-                    RGBA_IN(r, g, b, a, (uint32_t*)sp->sub.rects[i]->pict.data[1] + j);
-                    y = RGB_TO_Y_CCIR(r, g, b);
-                    u = RGB_TO_U_CCIR(r, g, b, 0);
-                    v = RGB_TO_V_CCIR(r, g, b, 0);
-                    YUVA_OUT((uint32_t*)sp->sub.rects[i]->pict.data[1] + j, y, u, v, a);
-                }
-            }
-			
-            /* now we can update the picture count */
-            if (++is->subpq_windex == SUBPICTURE_QUEUE_SIZE)
-                is->subpq_windex = 0;
-            SDL_LockMutex(is->subpq_mutex);
-            is->subpq_size++;
-            SDL_UnlockMutex(is->subpq_mutex);
+	if(codec_type == AVMEDIA_TYPE_VIDEO)
+		start_index = is->videoStream;
+	else if(codec_type == AVMEDIA_TYPE_AUDIO)
+		start_index = is->audioStream;
+	else
+		start_index = is->subtitleStream;
+	if(start_index < (codec_type == AVMEDIA_TYPE_SUBTITLE ? -1 : 0))
+		return;
 
+	stream_index = start_index;
+	for(;;) {
+		if(++stream_index >= (int)pFormatCtx->nb_streams) {
+			if(codec_type == AVMEDIA_TYPE_SUBTITLE) {
+				stream_index = -1;
+				break;
+			}
+			stream_index = 0;
 		}
-		av_free_packet(pkt);
+		if(stream_index == start_index)
+			return;
+		st = pFormatCtx->streams[stream_index];
+		if(st->codec->codec_type != codec_type)
+			continue;
+		if(codec_type == AVMEDIA_TYPE_AUDIO &&
+				(st->codec->sample_rate == 0 || st->codec->channels == 0))
+			continue;
+		break;
 	}
-
-	return 0;
+	stream_select(is, codec_type, stream_index);
 }
 
-int video_thread(void *arg) {
-	VideoState *is = (VideoState *)arg;
-	AVPacket pkt1, *packet = &pkt1;
-	int frameFinished;
-	AVFrame *pFrame;
-	double pts;
+/* -segments: decode the video of one file on all cores, one time range
+   per task. Each range starts at a keyframe; its task seeks there,
+   drops the pictures that belong to the range before (leading pictures
+   of an open GOP) and stops once the first picture of the next range
+   comes out of the decoder. Pictures come out in pts order, so the
+   ranges put one after the other are exactly what a serial decode
+   gives, which the per-picture checksums confirm. */
+typedef struct SegmentFrame {
+	int64_t pts;
+	uint32_t crc;
+} SegmentFrame;
+
+typedef struct Segment {
+	const char *filename;
+	int stream;
+	int64_t seek_ts;            /* AV_NOPTS_VALUE: from the start */
+	int64_t start_pts, end_pts; /* pictures in [start_pts, end_pts) */
+	SegmentFrame *frames;
+	int nb_frames;
+	unsigned int frames_size;
+	int64_t time;
+	int error;
+} Segment;
+
+/* pts of the keyframe a backward seek to ts lands on */
+static int64_t segment_keyframe_pts(AVFormatContext *fmt, int index, int64_t ts) {
+
+	AVPacket pkt;
+	int64_t pts = AV_NOPTS_VALUE;
+
+	if(av_seek_frame(fmt, index, ts, AVSEEK_FLAG_BACKWARD) < 0)
+		return AV_NOPTS_VALUE;
+	while(av_read_frame(fmt, &pkt) >= 0) {
+		if(pkt.stream_index == index && (pkt.flags & AV_PKT_FLAG_KEY)) {
+			pts = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+			av_free_packet(&pkt);
+			break;
+		}
+		av_free_packet(&pkt);
+	}
+	return pts;
+}
 
-	pFrame = avcodec_alloc_frame();
+static void segment_task(void *arg) {
+
+	Segment *seg = (Segment *)arg;
+	AVFormatContext *fmt;
+	AVCodecContext *codecCtx;
+	AVFrame *frame = NULL;
+	AVPacket pkt;
+	SegmentFrame *f;
+	int64_t pts, start = av_gettime();
+	int got, eof = 0;
+
+	fmt = input_open_secondary(NULL, seg->filename, "segment", decode_interrupt_cb);
+	if(!fmt) {
+		seg->error = 1;
+		return;
+	}
+	if(speculate_open(fmt, seg->stream) < 0 ||
+			(seg->seek_ts != AV_NOPTS_VALUE &&
+			 av_seek_frame(fmt, seg->stream, seg->seek_ts, AVSEEK_FLAG_BACKWARD) < 0) ||
+			!(frame = avcodec_alloc_frame())) {
+		seg->error = 1;
+		goto end;
+	}
+	codecCtx = fmt->streams[seg->stream]->codec;
 
 	for(;;) {
-		if(packet_queue_get(&is->videoq, packet, 1) < 0) {
-			// means we quit getting packets
-			break;
+		if(!eof && av_read_frame(fmt, &pkt) < 0) {
+			/* drain the pictures the decoder still holds */
+			eof = 1;
 		}
-		if(packet->data == flush_pkt.data) {
-			avcodec_flush_buffers(is->video_st->codec);
+		if(eof) {
+			av_init_packet(&pkt);
+			pkt.data = NULL;
+			pkt.size = 0;
+		} else if(pkt.stream_index != seg->stream) {
+			av_free_packet(&pkt);
 			continue;
 		}
-		pts = 0;
-
-		// Save global pts to be stored in pFrame in first call
-		global_video_pkt_pts = packet->pts;
-		// Decode video frame
-		avcodec_decode_video2(is->video_st->codec, pFrame, &frameFinished, 
-				packet);
-		if(packet->dts == AV_NOPTS_VALUE 
-				&& pFrame->opaque && *(uint64_t*)pFrame->opaque != AV_NOPTS_VALUE) {
-			pts = *(uint64_t *)pFrame->opaque;
-		} else if(packet->dts != AV_NOPTS_VALUE) {
-			pts = packet->dts;
-		} else {
-			pts = 0;
+		avcodec_decode_video2(codecCtx, frame, &got, &pkt);
+		if(!eof)
+			av_free_packet(&pkt);
+		if(!got) {
+			if(eof)
+				break;
+			continue;
 		}
-		pts *= av_q2d(is->video_st->time_base);
-
-		// Did we get a video frame?
-		if(frameFinished) {
-			pts = synchronize_video(is, pFrame, pts);
-			if(queue_picture(is, pFrame, pts) < 0) {
+		pts = av_frame_get_best_effort_timestamp(frame);
+		if(pts != AV_NOPTS_VALUE) {
+			if(seg->start_pts != AV_NOPTS_VALUE && pts < seg->start_pts)
+				continue;
+			if(seg->end_pts != AV_NOPTS_VALUE && pts >= seg->end_pts)
 				break;
-			}
 		}
-		av_free_packet(packet);
+		f = av_fast_realloc(seg->frames, &seg->frames_size,
+				(seg->nb_frames + 1) * sizeof(SegmentFrame));
+		if(!f) {
+			seg->error = 1;
+			break;
+		}
+		seg->frames = f;
+		f += seg->nb_frames++;
+		f->pts = pts;
+		f->crc = picture_checksum((AVPicture *)frame, codecCtx->pix_fmt,
+				codecCtx->width, codecCtx->height);
 	}
-	av_free(pFrame);
-	return 0;
+
+end:
+	/* speculate_open may have opened it before a later step failed */
+	if(seg->stream >= 0 && seg->stream < fmt->nb_streams &&
+			avcodec_is_open(fmt->streams[seg->stream]->codec))
+		avcodec_close(fmt->streams[seg->stream]->codec);
+	av_free(frame);
+	avformat_close_input(&fmt);
+	seg->time = av_gettime() - start;
 }
 
-int stream_component_close(VideoState *is, int stream_index) 
-{
-	AVCodecContext *codecCtx = NULL;
-	AVFormatContext *pFormatCtx = is->pFormatCtx;
+int segment_decode(const char *filename) {
 
-	if(stream_index < 0 || stream_index >= pFormatCtx->nb_streams) {
+	AVFormatContext *fmt;
+	AVStream *st;
+	Segment *segs;
+	FILE *out = NULL;
+	int64_t ts, pts, last_pts = AV_NOPTS_VALUE, duration, start_time, start;
+	unsigned long total_crc = 1;
+	int i, j, n, nb_segs, index, frames = 0, disorder = 0, ret = 0;
+	TaskGroup group;
+
+	fmt = input_open_secondary(NULL, filename, "segments", decode_interrupt_cb);
+	if(!fmt)
+		return -1;
+	index = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	if(index < 0) {
+		fprintf(stderr, "%s: no video stream\n", filename);
+		avformat_close_input(&fmt);
 		return -1;
 	}
+	st = fmt->streams[index];
 
-	codecCtx = pFormatCtx->streams[stream_index]->codec;
-	switch(codecCtx->codec_type)
-	{
-		case AVMEDIA_TYPE_AUDIO:
-			SDL_CloseAudio();
-
-			packet_queue_flush(&is->audioq);
-			av_free_packet(&is->audio_pkt);
-			swr_free(&is->swr_ctx);
-			av_freep(&is->audio_buf1);
-			is->audio_buf1_size = 0;
-			is->audio_buf = NULL;
-			break;
-
-		case AVMEDIA_TYPE_VIDEO:
+	n = segments ? segments : cpu_count();
+	segs = av_mallocz(n * sizeof(Segment));
+	if(!segs) {
+		avformat_close_input(&fmt);
+		return -1;
+	}
 
-			/* note: we also signal this mutex to make sure we deblock the
-			   video thread in all cases */
-			SDL_LockMutex(is->pictq_mutex);
-			SDL_CondSignal(is->pictq_cond);
-			SDL_UnlockMutex(is->pictq_mutex);
-			packet_queue_flush(&is->videoq);
+	/* evenly spaced, each moved back to its keyframe; ranges that end
+	   up on the same keyframe are merged */
+	start_time = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+	duration = st->duration;
+	if(duration == AV_NOPTS_VALUE && fmt->duration != AV_NOPTS_VALUE)
+		duration = av_rescale_q(fmt->duration, AV_TIME_BASE_Q, st->time_base);
+	if(duration == AV_NOPTS_VALUE || duration <= 0)
+		n = 1;
+	segs[0].seek_ts = segs[0].start_pts = AV_NOPTS_VALUE;
+	nb_segs = 1;
+	for(i = 1; i < n; i++) {
+		ts = start_time + duration * i / n;
+		pts = segment_keyframe_pts(fmt, index, ts);
+		if(pts == AV_NOPTS_VALUE ||
+				(nb_segs > 1 && pts <= segs[nb_segs - 1].start_pts))
+			continue;
+		segs[nb_segs].seek_ts = ts;
+		segs[nb_segs].start_pts = pts;
+		nb_segs++;
+	}
+	avformat_close_input(&fmt);
 
-			SDL_WaitThread(is->video_tid, NULL);
-			break;
+	for(i = 0; i < nb_segs; i++) {
+		segs[i].filename = filename;
+		segs[i].stream = index;
+		segs[i].end_pts = i + 1 < nb_segs ? segs[i + 1].start_pts : AV_NOPTS_VALUE;
+	}
 
-		case AVMEDIA_TYPE_SUBTITLE:
-			packet_queue_flush(&is->subtitleq);
-			SDL_WaitThread(is->subtitle_tid, NULL);
-		default:
-			break;
+	start = av_gettime();
+	task_group_init(&group);
+	for(i = 0; i < nb_segs; i++)
+		task_submit(task_pool, &group, segment_task, &segs[i]);
+	task_group_wait(task_pool, &group);
+
+	/* put the ranges back together */
+	if(framecrc_file) {
+		out = fopen(framecrc_file, "w");
+		if(!out)
+			fprintf(stderr, "%s: %s\n", framecrc_file, strerror(errno));
+	}
+	for(i = 0; i < nb_segs; i++) {
+		if(segs[i].error) {
+			fprintf(stderr, "%s: segment %d failed\n", filename, i);
+			ret = -1;
+		}
+		for(j = 0; j < segs[i].nb_frames; j++) {
+			SegmentFrame *f = &segs[i].frames[j];
+			if(f->pts != AV_NOPTS_VALUE) {
+				if(last_pts != AV_NOPTS_VALUE && f->pts <= last_pts)
+					disorder++;
+				last_pts = f->pts;
+			}
+			if(out)
+				fprintf(out, "%d, %lld, 0x%08x\n", frames, (long long)f->pts, f->crc);
+			total_crc = av_adler32_update(total_crc, (const uint8_t *)&f->crc, sizeof(f->crc));
+			frames++;
+		}
 	}
+	if(out)
+		fclose(out);
+
+	printf("segmented decode: %d segments, %d pictures in %.2f s, %.1f fps, checksum 0x%08lx\n",
+			nb_segs, frames, (av_gettime() - start) / 1000000.0,
+			frames * 1000000.0 / FFMAX(av_gettime() - start, 1), total_crc);
+	for(i = 0; i < nb_segs; i++)
+		printf("  segment %d from %s: %d pictures in %.2f s\n", i,
+				segs[i].start_pts == AV_NOPTS_VALUE ? "start" : "keyframe",
+				segs[i].nb_frames, segs[i].time / 1000000.0);
+	if(disorder)
+		printf("  %d pictures out of pts order\n", disorder);
+	if(task_pool)
+		task_pool_print_stats(task_pool);
+
+	for(i = 0; i < nb_segs; i++)
+		av_free(segs[i].frames);
+	av_free(segs);
+	return ret;
+}
 
+/* -clip: copy the packets of [start, end) to a new file, nothing is
+   decoded. A keyframe cut starts at the keyframe at or before start,
+   which becomes time 0. A smart cut has to start copying there too,
+   as the pictures up to start need it to decode, but puts time 0 at
+   start: those pictures get negative timestamps, which containers with
+   edit lists (mp4, mov) hide, and audio and subtitles begin exactly
+   at start. Video ends at the first packet decoded at or after end. */
+typedef struct ClipStream {
+	int out;       /* output stream, -1: not copied */
+	int started;   /* seen the keyframe everything begins with */
+	int finished;  /* past end */
+} ClipStream;
+
+static int clip_write(void *opaque, uint8_t *buf, int size) {
+	if(fwrite(buf, 1, size, (FILE *)opaque) != (size_t)size)
+		return AVERROR(errno);
+	return size;
+}
 
+static int64_t clip_seek(void *opaque, int64_t offset, int whence) {
+	FILE *f = (FILE *)opaque;
 
+	if(whence == AVSEEK_SIZE)
+		return -1;
+	if(fseeko(f, offset, whence & ~AVSEEK_FORCE) < 0)
+		return AVERROR(errno);
+	return ftello(f);
 }
 
-int stream_component_open(VideoState *is, int stream_index) {
+static int clip_parse(const char *spec) {
 
-	AVFormatContext *pFormatCtx = is->pFormatCtx;
-	AVCodecContext *codecCtx = NULL;
-	AVCodec *codec = NULL;
-	AVDictionary *optionsDict = NULL;
-	SDL_AudioSpec wanted_spec, spec;
-	int64_t wanted_channel_layout;
-	int wanted_nb_channels;
-	const char *env;
+	const char *eq = strchr(spec, '=');
+	char *p;
 
-	if(stream_index < 0 || stream_index >= pFormatCtx->nb_streams) {
+	if(!eq || !eq[1]) {
+		fprintf(stderr, "-clip %s: expected start,end=output\n", spec);
 		return -1;
 	}
+	clip_start = (int64_t)(strtod(spec, &p) * AV_TIME_BASE);
+	if(p == spec || clip_start < 0 || (*p != ',' && p != eq)) {
+		fprintf(stderr, "-clip %s: bad start time\n", spec);
+		return -1;
+	}
+	clip_end = INT64_MAX;
+	if(*p == ',' && p + 1 != eq) {
+		spec = p + 1;
+		clip_end = (int64_t)(strtod(spec, &p) * AV_TIME_BASE);
+		if(p != eq || clip_end <= clip_start) {
+			fprintf(stderr, "-clip %s: bad end time\n", spec);
+			return -1;
+		}
+	}
+	clip_output = eq + 1;
+	return 0;
+}
 
-	// Get a pointer to the codec context for the video stream
-	codecCtx = pFormatCtx->streams[stream_index]->codec;
+int clip_copy(const char *filename) {
 
-	if(codecCtx->codec_type == AVMEDIA_TYPE_AUDIO) {
-		// Set audio settings from codec info
-		wanted_spec.freq = codecCtx->sample_rate;
-		wanted_spec.format = AUDIO_S16SYS;
-		wanted_spec.channels = codecCtx->channels;
-		wanted_spec.silence = 0;
-		wanted_spec.samples = SDL_AUDIO_BUFFER_SIZE;
-		wanted_spec.callback = audio_callback;
-		wanted_spec.userdata = is;
+	AVFormatContext *in, *out = NULL;
+	AVStream *ist, *ost;
+	AVPacket pkt;
+	ClipStream *cs = NULL;
+	FILE *f = NULL;
+	unsigned char *iobuf;
+	int64_t start, end, offset = AV_NOPTS_VALUE, ts, shift, bytes = 0, time;
+	int i, index, remaining = 0, packets = 0, dropped = 0, ret = -1;
 
-		if(SDL_OpenAudio(&wanted_spec, &spec) < 0) {
-			fprintf(stderr, "SDL_OpenAudio: %s\n", SDL_GetError());
-			return -1;
+	in = input_open_secondary(NULL, filename, "clip", decode_interrupt_cb);
+	if(!in)
+		return -1;
+	/* the stream the cut is made on */
+	index = av_find_best_stream(in, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	if(index < 0)
+		index = av_find_best_stream(in, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+	if(index < 0) {
+		fprintf(stderr, "%s: no audio or video stream\n", filename);
+		goto end;
+	}
+	/* clip times count from the start of the file */
+	ts = in->start_time != AV_NOPTS_VALUE ? in->start_time : 0;
+	start = ts + clip_start;
+	end = clip_end == INT64_MAX ? INT64_MAX : ts + clip_end;
+
+	if(avformat_alloc_output_context2(&out, NULL, NULL, clip_output) < 0 || !out) {
+		fprintf(stderr, "%s: unknown output format\n", clip_output);
+		goto end;
+	}
+	cs = av_malloc(in->nb_streams * sizeof(ClipStream));
+	if(!cs)
+		goto end;
+	for(i = 0; i < (int)in->nb_streams; i++) {
+		ist = in->streams[i];
+		cs[i].out = -1;
+		cs[i].started = cs[i].finished = 0;
+		if(ist->codec->codec_type != AVMEDIA_TYPE_VIDEO &&
+				ist->codec->codec_type != AVMEDIA_TYPE_AUDIO &&
+				ist->codec->codec_type != AVMEDIA_TYPE_SUBTITLE) {
+			ist->discard = AVDISCARD_ALL;
+			continue;
 		}
-		is->audio_hw_buf_size = spec.size;
+		ost = avformat_new_stream(out, NULL);
+		if(!ost || avcodec_copy_context(ost->codec, ist->codec) < 0)
+			goto end;
+		/* let the muxer pick its own tag for the codec */
+		ost->codec->codec_tag = 0;
+		ost->time_base = ist->time_base;
+		ost->sample_aspect_ratio = ist->sample_aspect_ratio;
+		if(out->oformat->flags & AVFMT_GLOBALHEADER)
+			ost->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+		cs[i].out = ost->index;
+		/* sparse subtitles don't hold up the end of the clip */
+		if(ist->codec->codec_type != AVMEDIA_TYPE_SUBTITLE)
+			remaining++;
+	}
 
-		wanted_channel_layout = codecCtx->channel_layout;
-		wanted_nb_channels = codecCtx->channels;
-		env = SDL_getenv("SDL_AUDIO_CHANNELS");
-		if (env) {
-			wanted_nb_channels = atoi(env);
-			wanted_channel_layout = av_get_default_channel_layout(wanted_nb_channels);
+	/* unbuffered stdio under a big avio buffer: every write goes
+	   straight to the disk in CLIP_IO_BUFFER_SIZE pieces */
+	if(!(out->oformat->flags & AVFMT_NOFILE)) {
+		f = fopen(clip_output, "wb");
+		if(!f) {
+			fprintf(stderr, "%s: %s\n", clip_output, strerror(errno));
+			goto end;
 		}
-		if (!wanted_channel_layout || wanted_nb_channels != av_get_channel_layout_nb_channels(wanted_channel_layout)) {
-			wanted_channel_layout = av_get_default_channel_layout(wanted_nb_channels);
-			wanted_channel_layout &= ~AV_CH_LAYOUT_STEREO_DOWNMIX;
+		setvbuf(f, NULL, _IONBF, 0);
+		iobuf = av_malloc(CLIP_IO_BUFFER_SIZE);
+		if(!iobuf)
+			goto end;
+		out->pb = avio_alloc_context(iobuf, CLIP_IO_BUFFER_SIZE, 1, f,
+				NULL, clip_write, clip_seek);
+		if(!out->pb) {
+			av_free(iobuf);
+			goto end;
 		}
+	}
+	if(avformat_write_header(out, NULL) < 0) {
+		fprintf(stderr, "%s: could not write header\n", clip_output);
+		goto end;
+	}
 
-		is->audio_tgt.fmt = AV_SAMPLE_FMT_S16;
-		is->audio_tgt.freq = spec.freq;
-		is->audio_tgt.channel_layout = wanted_channel_layout;
-		is->audio_tgt.channels = spec.channels;
-
-		is->audio_src = is->audio_tgt;
-		printf("samples: %u, bytes: %u\n", spec.samples, spec.size);
-		printf("codec id: %u, VORBIS = %d\n", codecCtx->codec_id, AV_CODEC_ID_VORBIS);
-		printf("channel_layout: %d\n", codecCtx->channel_layout);
+	/* the same backward seek as the player's, onto the keyframe at or
+	   before start */
+	if(clip_start > 0 && av_seek_frame(in, index,
+				av_rescale_q(start, AV_TIME_BASE_Q, in->streams[index]->time_base),
+				AVSEEK_FLAG_BACKWARD) < 0) {
+		fprintf(stderr, "%s: could not seek to %.3f\n", filename,
+				clip_start / (double)AV_TIME_BASE);
+		goto write_trailer;
 	}
+	if(clip_smart)
+		offset = start;
+
+	time = av_gettime();
+	/* a stream that ends before end never finishes, the cut stream
+	   past end closes the clip anyway */
+	while(remaining > 0 && !cs[index].finished && av_read_frame(in, &pkt) >= 0) {
+		ClipStream *c = &cs[pkt.stream_index];
+
+		ist = in->streams[pkt.stream_index];
+		if(c->out < 0 || c->finished) {
+			av_free_packet(&pkt);
+			continue;
+		}
+		ts = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+		if(ts != AV_NOPTS_VALUE)
+			ts = av_rescale_q(ts, ist->time_base, AV_TIME_BASE_Q);
+
+		if(!c->started) {
+			if(ist->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+				/* nothing before a keyframe can be decoded */
+				if(!(pkt.flags & AV_PKT_FLAG_KEY) ||
+						(pkt.stream_index != index && offset == AV_NOPTS_VALUE)) {
+					av_free_packet(&pkt);
+					dropped++;
+					continue;
+				}
+				if(offset == AV_NOPTS_VALUE)
+					offset = ts != AV_NOPTS_VALUE ? ts : start;
+			} else if(offset == AV_NOPTS_VALUE && pkt.stream_index == index) {
+				/* no video: the cut is on audio, where every packet
+				   starts a frame */
+				offset = ts != AV_NOPTS_VALUE ? ts : start;
+			} else if(offset == AV_NOPTS_VALUE) {
+				/* wait for the keyframe the clip starts at */
+				av_free_packet(&pkt);
+				dropped++;
+				continue;
+			}
+			c->started = 1;
+		}
+		if(ist->codec->codec_type != AVMEDIA_TYPE_VIDEO &&
+				ts != AV_NOPTS_VALUE && ts < offset) {
+			av_free_packet(&pkt);
+			dropped++;
+			continue;
+		}
+		/* by decode order, so no picture loses one it refers to */
+		if(pkt.dts != AV_NOPTS_VALUE && ist->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+			ts = av_rescale_q(pkt.dts, ist->time_base, AV_TIME_BASE_Q);
+		if(ts != AV_NOPTS_VALUE && ts >= end) {
+			c->finished = 1;
+			if(ist->codec->codec_type != AVMEDIA_TYPE_SUBTITLE)
+				remaining--;
+			av_free_packet(&pkt);
+			continue;
+		}
 
-	codec = avcodec_find_decoder(codecCtx->codec_id);
-	if(!codec || (avcodec_open2(codecCtx, codec, &optionsDict) < 0)) {
-		fprintf(stderr, "Unsupported codec!\n");
-		return -1;
+		ost = out->streams[c->out];
+		shift = av_rescale_q(offset, AV_TIME_BASE_Q, ist->time_base);
+		if(pkt.pts != AV_NOPTS_VALUE)
+			pkt.pts = av_rescale_q(pkt.pts - shift, ist->time_base, ost->time_base);
+		if(pkt.dts != AV_NOPTS_VALUE)
+			pkt.dts = av_rescale_q(pkt.dts - shift, ist->time_base, ost->time_base);
+		pkt.duration = av_rescale_q(pkt.duration, ist->time_base, ost->time_base);
+		pkt.stream_index = c->out;
+		pkt.pos = -1;
+		bytes += pkt.size;
+		packets++;
+		/* the muxer owns the packet from here */
+		if(av_interleaved_write_frame(out, &pkt) < 0) {
+			fprintf(stderr, "%s: write error\n", clip_output);
+			goto write_trailer;
+		}
+	}
+	ret = 0;
+	time = av_gettime() - time;
+	printf("clip: %.3f s to %.3f s of %s, %s cut at %.3f s\n",
+			clip_start / (double)AV_TIME_BASE,
+			clip_end == INT64_MAX ? -1.0 : clip_end / (double)AV_TIME_BASE,
+			filename, clip_smart ? "smart" : "keyframe",
+			offset == AV_NOPTS_VALUE ? 0.0 : (offset - (start - clip_start)) / (double)AV_TIME_BASE);
+	printf("  %d packets, %.1f MiB in %.2f s, %.1f MiB/s, %d packets outside the range dropped\n",
+			packets, bytes / (1024.0 * 1024.0), time / 1000000.0,
+			bytes / (1024.0 * 1024.0) * 1000000.0 / FFMAX(time, 1), dropped);
+
+write_trailer:
+	if(av_write_trailer(out) < 0)
+		ret = -1;
+
+end:
+	if(out) {
+		if(f) {
+			if(out->pb) {
+				avio_flush(out->pb);
+				av_free(out->pb->buffer);
+				av_free(out->pb);
+			}
+			if(fclose(f) < 0)
+				ret = -1;
+		}
+		avformat_free_context(out);
 	}
+	av_free(cs);
+	avformat_close_input(&in);
+	return ret;
+}
 
-	switch(codecCtx->codec_type) {
-		case AVMEDIA_TYPE_AUDIO:
-			is->audioStream = stream_index;
-			is->audio_st = pFormatCtx->streams[stream_index];
-			is->audio_buf_size = 0;
-			is->audio_buf_index = 0;
+/* -thumbs: a picture every thumb_interval seconds of each file, tiled
+   into sprite sheets with a WebVTT and a JSON index next to them. A
+   thumbnail is the keyframe at or before its time, found with the
+   player's backward seek; skip_frame keeps the decoder from doing
+   anything but keyframes and a keyframe already shown is reused
+   without decoding it again. Scaling into the sheet runs on the task
+   pool while the next keyframe is read, and the files of a batch are
+   done at the same time, one thread each. */
+typedef struct Thumb {
+	double time;       /* asked for, from the start of the file */
+	double pts;        /* of the keyframe shown, -1: none found */
+	int sheet, x, y;
+	int same_as;       /* earlier thumbnail of the same keyframe, or -1 */
+} Thumb;
+
+typedef struct ThumbFile {
+	const char *filename;
+	char base[1024];   /* the outputs, less the extension */
+	const char *name;  /* base without the directory */
+	Thumb *thumbs;
+	int nb_thumbs;
+	int width, height; /* of one thumbnail */
+	double duration;
+	AVPicture *sheets;
+	int *sheet_w, *sheet_h;
+	int nb_sheets;
+	TaskGroup group;
+	int decoded, reused;
+	int64_t decode_time, scale_time, time;
+	int error;
+} ThumbFile;
+
+typedef struct ThumbScale {
+	ThumbFile *tf;
+	AVPicture src;
+	int width, height;
+	enum PixelFormat pix_fmt;
+	AVPicture dst;     /* the tile in its sheet */
+} ThumbScale;
+
+static ThumbFile *thumb_files;
+static int thumb_next;
+static SDL_mutex *thumb_mutex;
+
+/* the w x h tile at x, y of a YUVJ420P sheet; x and y are even */
+static void thumb_tile(ThumbFile *tf, Thumb *th, AVPicture *tile) {
+	AVPicture *sheet = &tf->sheets[th->sheet];
+	int i;
 
-			/* averaging filter for audio sync */
-			is->audio_diff_avg_coef = exp(log(0.01 / AUDIO_DIFF_AVG_NB));
-			is->audio_diff_avg_count = 0;
-			/* Correct audio only if larger error than this */
-			is->audio_diff_threshold = 2.0 * SDL_AUDIO_BUFFER_SIZE / codecCtx->sample_rate;
+	memset(tile, 0, sizeof(AVPicture));
+	for(i = 0; i < 3; i++) {
+		int shift = i ? 1 : 0;
+		tile->data[i] = sheet->data[i] + (th->y >> shift) * sheet->linesize[i] + (th->x >> shift);
+		tile->linesize[i] = sheet->linesize[i];
+	}
+}
 
-			memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
-			packet_queue_init(&is->audioq);
-			SDL_PauseAudio(0);
-			break;
-		case AVMEDIA_TYPE_VIDEO:
-			is->videoStream = stream_index;
-			is->video_st = pFormatCtx->streams[stream_index];
+static void thumb_scale_task(void *arg) {
 
-			is->frame_timer = (double)av_gettime() / 1000000.0;
-			is->frame_last_delay = 40e-3;
-			is->video_current_pts_time = av_gettime();
+	ThumbScale *s = (ThumbScale *)arg;
+	ThumbFile *tf = s->tf;
+	struct SwsContext *sws;
+	int64_t start = av_gettime();
 
-			packet_queue_init(&is->videoq);
-			is->video_tid = SDL_CreateThread(video_thread, is);
-			is->sws_ctx =
-				sws_getContext
-				(
-				 is->video_st->codec->width,
-				 is->video_st->codec->height,
-				 is->video_st->codec->pix_fmt,
-				 is->video_st->codec->width,
-				 is->video_st->codec->height,
-				 PIX_FMT_YUV420P, 
-				 SWS_BILINEAR, 
-				 NULL, 
-				 NULL, 
-				 NULL
-				);
-			codecCtx->get_buffer = our_get_buffer;
-			codecCtx->release_buffer = our_release_buffer;
-			break;
-		case AVMEDIA_TYPE_SUBTITLE:
-			is->subtitleStream = stream_index;
-			is->subtitle_st = pformatCtx->streams[stream_index];
-			packet_queue_init(&is->subtitleq);
-			is->subtitle_tid = SDL_CreateThread(subtitle_thread, is);
-			break;
-		default:
-			break;
+	sws = sws_getContext(s->width, s->height, s->pix_fmt, tf->width, tf->height,
+			PIX_FMT_YUVJ420P, SWS_AREA, NULL, NULL, NULL);
+	if(sws) {
+		sws_scale(sws, (const uint8_t * const *)s->src.data, s->src.linesize,
+				0, s->height, s->dst.data, s->dst.linesize);
+		sws_freeContext(sws);
 	}
-
-	return 0;
+	avpicture_free(&s->src);
+	av_free(s);
+
+	SDL_LockMutex(thumb_mutex);
+	if(!sws)
+		tf->error = 1;
+	tf->scale_time += av_gettime() - start;
+	SDL_UnlockMutex(thumb_mutex);
 }
 
-int decode_interrupt_cb(void *opaque) {
-	return (global_video_state && global_video_state->quit);
-}
-int decode_thread(void *arg) {
+static int thumb_write_jpeg(const char *filename, AVPicture *pict, int width, int height) {
 
-	VideoState *is = (VideoState *)arg;
-	AVFormatContext *pFormatCtx = NULL;
-	AVPacket pkt1, *packet = &pkt1;
+	AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+	AVCodecContext *ctx;
+	AVFrame *frame;
+	AVPacket pkt;
+	FILE *f;
+	int got = 0, ret = -1;
 
-	AVDictionary *io_dict = NULL;
-	AVIOInterruptCB callback;
+	if(!codec || !(ctx = avcodec_alloc_context3(codec)))
+		return -1;
+	ctx->width = width;
+	ctx->height = height;
+	ctx->pix_fmt = PIX_FMT_YUVJ420P;
+	ctx->time_base = (AVRational){ 1, 25 };
+	ctx->flags |= CODEC_FLAG_QSCALE;
+	if(avcodec_open2(ctx, codec, NULL) < 0) {
+		av_free(ctx);
+		return -1;
+	}
+	frame = avcodec_alloc_frame();
+	if(frame) {
+		*(AVPicture *)frame = *pict;
+		frame->width = width;
+		frame->height = height;
+		frame->format = PIX_FMT_YUVJ420P;
+		frame->quality = THUMB_JPEG_QSCALE * FF_QP2LAMBDA;
+		av_init_packet(&pkt);
+		pkt.data = NULL;
+		pkt.size = 0;
+		if(avcodec_encode_video2(ctx, &pkt, frame, &got) >= 0 && got) {
+			f = fopen(filename, "wb");
+			if(f) {
+				if(fwrite(pkt.data, 1, pkt.size, f) == (size_t)pkt.size)
+					ret = 0;
+				if(fclose(f))
+					ret = -1;
+			}
+			av_free_packet(&pkt);
+		}
+		av_free(frame);
+	}
+	if(ret < 0)
+		fprintf(stderr, "%s: could not write the sprite sheet\n", filename);
+	avcodec_close(ctx);
+	av_free(ctx);
+	return ret;
+}
 
-	int video_index = -1;
-	int audio_index = -1;
-	int subtitle_index = -1;
-	int i, fail_flag = 0;
+static void thumb_json_string(FILE *f, const char *s) {
+	fputc('"', f);
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
 
-	is->videoStream=-1;
-	is->audioStream=-1;
+static void thumb_vtt_time(FILE *f, double t) {
+	int64_t ms = (int64_t)(t * 1000 + 0.5);
+	fprintf(f, "%02d:%02d:%02d.%03d", (int)(ms / 3600000), (int)(ms / 60000 % 60),
+			(int)(ms / 1000 % 60), (int)(ms % 1000));
+}
 
-	global_video_state = is;
-	// will interrupt blocking functions if we quit!
-	callback.callback = decode_interrupt_cb;
-	callback.opaque = is;
-	if (avio_open2(&is->io_context, is->filename, 0, &callback, &io_dict))
-	{
-		fprintf(stderr, "Unable to open I/O for %s\n", is->filename);
+static int thumb_write_index(ThumbFile *tf) {
+
+	char path[1100];
+	Thumb *th;
+	FILE *vtt, *json;
+	double end;
+	int i, ret = 0;
+
+	snprintf(path, sizeof(path), "%s.vtt", tf->base);
+	vtt = fopen(path, "w");
+	if(!vtt) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s.json", tf->base);
+	json = fopen(path, "w");
+	if(!json) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		fclose(vtt);
 		return -1;
 	}
 
-	// Open video file
-	pFormatCtx = avformat_alloc_context();
-	if(avformat_open_input(&pFormatCtx, is->filename, NULL, NULL)!=0)
-	{
-		printf("avformat_open_input: %s\n", is->filename);
-		goto READ_RET;
+	fprintf(vtt, "WEBVTT\n");
+	fprintf(json, "{\"file\":");
+	thumb_json_string(json, tf->filename);
+	fprintf(json, ",\"duration\":%.3f,\"interval\":%.3f,\"width\":%d,\"height\":%d,"
+			"\"columns\":%d,\"rows\":%d,\"sheets\":[",
+			tf->duration, thumb_interval, tf->width, tf->height, thumb_cols, thumb_rows);
+	for(i = 0; i < tf->nb_sheets; i++) {
+		snprintf(path, sizeof(path), "%s_%d.jpg", tf->name, i);
+		if(i)
+			fputc(',', json);
+		thumb_json_string(json, path);
+	}
+	fprintf(json, "],\"thumbnails\":[");
+	for(i = 0; i < tf->nb_thumbs; i++) {
+		th = &tf->thumbs[i];
+		end = i + 1 < tf->nb_thumbs ? tf->thumbs[i + 1].time : FFMAX(tf->duration, th->time + thumb_interval);
+		fprintf(vtt, "\n");
+		thumb_vtt_time(vtt, th->time);
+		fprintf(vtt, " --> ");
+		thumb_vtt_time(vtt, end);
+		fprintf(vtt, "\n%s_%d.jpg#xywh=%d,%d,%d,%d\n", tf->name, th->sheet,
+				th->x, th->y, tf->width, tf->height);
+		fprintf(json, "%s{\"time\":%.3f,\"end\":%.3f,\"keyframe\":%.3f,\"sheet\":%d,"
+				"\"x\":%d,\"y\":%d}", i ? "," : "", th->time, end, th->pts,
+				th->sheet, th->x, th->y);
 	}
+	fprintf(json, "]}\n");
+	if(fclose(vtt))
+		ret = -1;
+	if(fclose(json))
+		ret = -1;
+	return ret;
+}
 
-	is->pFormatCtx = pFormatCtx;
+/* Decode the keyframe at or before ts, or find it is the one shown last */
+static int thumb_decode(ThumbFile *tf, AVFormatContext *fmt, int index,
+		AVFrame *frame, int64_t ts, int64_t last_pts, int64_t *pts) {
 
-	// Retrieve stream information
-	if(avformat_find_stream_info(pFormatCtx, NULL)<0)
-	{
-		printf("avformat_find_stream_info\n");
-		goto READ_RET;
-	}
-	// Dump information about file onto standard error
-	av_dump_format(pFormatCtx, 0, is->filename, 0);
+	AVCodecContext *codecCtx = fmt->streams[index]->codec;
+	AVPacket pkt;
+	int got = 0;
 
-	// Find the first video stream
-	for(i=0; i<pFormatCtx->nb_streams; i++) {
-		if(pFormatCtx->streams[i]->codec->codec_type==AVMEDIA_TYPE_VIDEO &&
-				video_index < 0) {
-			video_index=i;
+	*pts = AV_NOPTS_VALUE;
+	if(av_seek_frame(fmt, index, ts, AVSEEK_FLAG_BACKWARD) < 0)
+		return -1;
+	avcodec_flush_buffers(codecCtx);
+	while(av_read_frame(fmt, &pkt) >= 0) {
+		/* the decoder would drop the rest anyway */
+		if(pkt.stream_index != index || !(pkt.flags & AV_PKT_FLAG_KEY)) {
+			av_free_packet(&pkt);
+			continue;
 		}
-		if(pFormatCtx->streams[i]->codec->codec_type==AVMEDIA_TYPE_AUDIO &&
-				audio_index < 0) {
-			audio_index=i;
+		*pts = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+		if(*pts != AV_NOPTS_VALUE && *pts == last_pts) {
+			av_free_packet(&pkt);
+			return 0;
 		}
-		if(pFormatCtx->streams[i]->codec->code_type == AVMEDIA_TYPE_SUBTITLE &&
-				subtitle_index < 0)
-			subtitle_index = i;
+		avcodec_decode_video2(codecCtx, frame, &got, &pkt);
+		av_free_packet(&pkt);
+		if(!got) {
+			/* held back for reordering, the next frame it waits for
+			   is never coming */
+			av_init_packet(&pkt);
+			pkt.data = NULL;
+			pkt.size = 0;
+			avcodec_decode_video2(codecCtx, frame, &got, &pkt);
+		}
+		tf->decoded += got;
+		return got ? 1 : -1;
 	}
-	if(audio_index >= 0) {
-		stream_component_open(is, audio_index);
+	return -1;
+}
+
+static void thumb_file_run(ThumbFile *tf) {
+
+	AVFormatContext *fmt;
+	AVCodecContext *codecCtx;
+	AVStream *st;
+	AVFrame *frame = NULL;
+	AVRational sar;
+	ThumbScale *s;
+	Thumb *th;
+	AVPicture tile, src;
+	const char *p;
+	char *dot;
+	int64_t start_time, ts, pts, last_pts = AV_NOPTS_VALUE, t;
+	int i, k, index, per_sheet, cols, rows, last = -1, in_flight = 0, ret;
+
+	tf->time = av_gettime();
+	task_group_init(&tf->group);
+
+	p = strrchr(tf->filename, '/');
+	snprintf(tf->base, sizeof(tf->base), "%s/%s", thumb_dir, p ? p + 1 : tf->filename);
+	dot = strrchr(tf->base, '.');
+	if(dot && !strchr(dot, '/'))
+		*dot = '\0';
+	tf->name = strrchr(tf->base, '/') + 1;
+
+	fmt = input_open_secondary(NULL, tf->filename, "thumbs", decode_interrupt_cb);
+	if(!fmt) {
+		tf->error = 1;
+		return;
 	}
-	if(video_index >= 0) {
-		stream_component_open(is, video_index);
-	}   
-	if(subtitle_index >= 0){
-		stream_component_open(is, subtitle_index);
+	index = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	if(index < 0 || speculate_open(fmt, index) < 0 || !(frame = avcodec_alloc_frame())) {
+		fprintf(stderr, "%s: no video to take thumbnails of\n", tf->filename);
+		tf->error = 1;
+		goto end;
+	}
+	st = fmt->streams[index];
+	codecCtx = st->codec;
+	codecCtx->skip_frame = AVDISCARD_NONKEY;
+
+	/* the size of one thumbnail, even for 4:2:0 */
+	sar = codecCtx->sample_aspect_ratio.num ? codecCtx->sample_aspect_ratio : (AVRational){ 1, 1 };
+	tf->width = thumb_width;
+	tf->height = thumb_height;
+	if(!tf->height)
+		tf->height = (int)((int64_t)tf->width * codecCtx->height * sar.den /
+				FFMAX((int64_t)codecCtx->width * sar.num, 1));
+	else if(!tf->width)
+		tf->width = (int)((int64_t)tf->height * codecCtx->width * sar.num /
+				FFMAX((int64_t)codecCtx->height * sar.den, 1));
+	tf->width = FFMAX(tf->width & ~1, 2);
+	tf->height = FFMAX(tf->height & ~1, 2);
+
+	start_time = fmt->start_time != AV_NOPTS_VALUE ? fmt->start_time : 0;
+	if(fmt->duration != AV_NOPTS_VALUE)
+		tf->duration = fmt->duration / (double)AV_TIME_BASE;
+	else if(st->duration != AV_NOPTS_VALUE)
+		tf->duration = st->duration * av_q2d(st->time_base);
+	tf->nb_thumbs = tf->duration > 0 ? (int)ceil(tf->duration / thumb_interval) : 1;
+
+	/* sheets of thumb_cols x thumb_rows, the last one only as big as it
+	   needs to be */
+	per_sheet = thumb_cols * thumb_rows;
+	tf->nb_sheets = (tf->nb_thumbs + per_sheet - 1) / per_sheet;
+	tf->thumbs = av_mallocz(tf->nb_thumbs * sizeof(Thumb));
+	tf->sheets = av_mallocz(tf->nb_sheets * sizeof(AVPicture));
+	tf->sheet_w = av_mallocz(tf->nb_sheets * sizeof(int));
+	tf->sheet_h = av_mallocz(tf->nb_sheets * sizeof(int));
+	if(!tf->thumbs || !tf->sheets || !tf->sheet_w || !tf->sheet_h) {
+		tf->error = 1;
+		goto end;
+	}
+	for(i = 0; i < tf->nb_sheets; i++) {
+		k = FFMIN(tf->nb_thumbs - i * per_sheet, per_sheet);
+		cols = FFMIN(k, thumb_cols);
+		rows = (k + thumb_cols - 1) / thumb_cols;
+		tf->sheet_w[i] = cols * tf->width;
+		tf->sheet_h[i] = rows * tf->height;
+		if(avpicture_alloc(&tf->sheets[i], PIX_FMT_YUVJ420P, tf->sheet_w[i], tf->sheet_h[i]) < 0) {
+			tf->error = 1;
+			goto end;
+		}
+		/* black where a thumbnail is missing */
+		memset(tf->sheets[i].data[0], 0, tf->sheets[i].linesize[0] * tf->sheet_h[i]);
+		memset(tf->sheets[i].data[1], 128, tf->sheets[i].linesize[1] * tf->sheet_h[i] / 2);
+		memset(tf->sheets[i].data[2], 128, tf->sheets[i].linesize[2] * tf->sheet_h[i] / 2);
+	}
+
+	for(i = 0; i < tf->nb_thumbs && !tf->error; i++) {
+		th = &tf->thumbs[i];
+		k = i % per_sheet;
+		th->time = i * thumb_interval;
+		th->sheet = i / per_sheet;
+		th->x = k % thumb_cols * tf->width;
+		th->y = k / thumb_cols * tf->height;
+		th->pts = -1;
+		th->same_as = -1;
+
+		t = av_gettime();
+		ts = av_rescale_q(start_time + (int64_t)(th->time * AV_TIME_BASE),
+				AV_TIME_BASE_Q, st->time_base);
+		ret = thumb_decode(tf, fmt, index, frame, ts, last_pts, &pts);
+		tf->decode_time += av_gettime() - t;
+		if(ret < 0)
+			continue;
+		if(pts != AV_NOPTS_VALUE)
+			th->pts = (pts - (st->start_time != AV_NOPTS_VALUE ? st->start_time : 0)) *
+					av_q2d(st->time_base);
+		if(ret == 0) {
+			th->same_as = last;
+			th->pts = tf->thumbs[last].pts;
+			tf->reused++;
+			continue;
+		}
+		last_pts = pts;
+		last = i;
+
+		/* the decoder reuses frame, the scaler gets a copy */
+		s = av_mallocz(sizeof(ThumbScale));
+		if(!s || avpicture_alloc(&s->src, codecCtx->pix_fmt, codecCtx->width, codecCtx->height) < 0) {
+			av_free(s);
+			tf->error = 1;
+			break;
+		}
+		av_picture_copy(&s->src, (AVPicture *)frame, codecCtx->pix_fmt,
+				codecCtx->width, codecCtx->height);
+		s->tf = tf;
+		s->width = codecCtx->width;
+		s->height = codecCtx->height;
+		s->pix_fmt = codecCtx->pix_fmt;
+		thumb_tile(tf, th, &s->dst);
+		task_submit(task_pool, &tf->group, thumb_scale_task, s);
+		/* a bound on the copies waiting */
+		if(++in_flight >= THUMB_MAX_SCALES) {
+			task_group_wait(task_pool, &tf->group);
+			in_flight = 0;
+		}
 	}
+	task_group_wait(task_pool, &tf->group);
+	if(tf->error)
+		goto end;
 
-	if(is->videoStream < 0 || is->audioStream < 0) {
-		fprintf(stderr, "%s: could not open codecs\n", is->filename);
-		goto READ_RET;
+	for(i = 0; i < tf->nb_thumbs; i++) {
+		th = &tf->thumbs[i];
+		if(th->same_as < 0)
+			continue;
+		thumb_tile(tf, &tf->thumbs[th->same_as], &src);
+		thumb_tile(tf, th, &tile);
+		av_picture_copy(&tile, &src, PIX_FMT_YUVJ420P, tf->width, tf->height);
+	}
+	for(i = 0; i < tf->nb_sheets; i++) {
+		char path[1100];
+		snprintf(path, sizeof(path), "%s_%d.jpg", tf->base, i);
+		if(thumb_write_jpeg(path, &tf->sheets[i], tf->sheet_w[i], tf->sheet_h[i]) < 0)
+			tf->error = 1;
 	}
+	if(thumb_write_index(tf) < 0)
+		tf->error = 1;
+
+end:
+	if(frame)
+		avcodec_close(fmt->streams[index]->codec);
+	av_free(frame);
+	avformat_close_input(&fmt);
+	if(tf->sheets)
+		for(i = 0; i < tf->nb_sheets; i++)
+			avpicture_free(&tf->sheets[i]);
+	av_freep(&tf->sheets);
+	av_freep(&tf->sheet_w);
+	av_freep(&tf->sheet_h);
+	tf->time = av_gettime() - tf->time;
+}
 
-	// main decode loop
+static int thumb_thread(void *arg) {
+
+	int i;
 
+	thread_setup(THREAD_ROLE_DECODE);
 	for(;;) {
-		if(is->quit) {
+		SDL_LockMutex(thumb_mutex);
+		i = thumb_next++;
+		SDL_UnlockMutex(thumb_mutex);
+		if(i >= playlist_size)
 			break;
-		}
-		// seek stuff goes here
-		if(is->seek_req) {
-			int stream_index= -1;
-			int64_t seek_target = is->seek_pos;
+		thumb_file_run(&thumb_files[i]);
+	}
+	return 0;
+}
 
-			if     (is->videoStream >= 0) stream_index = is->videoStream;
-			else if(is->audioStream >= 0) stream_index = is->audioStream;
+int thumb_generate(void) {
 
-			if(stream_index>=0){
-				seek_target= av_rescale_q(seek_target, AV_TIME_BASE_Q, pFormatCtx->streams[stream_index]->time_base);
-			}
-			if(av_seek_frame(is->pFormatCtx, stream_index, seek_target, is->seek_flags) < 0) {
-				fprintf(stderr, "%s: error while seeking\n", is->pFormatCtx->filename);
-			} else {
-				if(is->audioStream >= 0) {
-					packet_queue_flush(&is->audioq);
-					packet_queue_put(&is->audioq, &flush_pkt);
-				}
-				if(is->videoStream >= 0) {
-					packet_queue_flush(&is->videoq);
-					packet_queue_put(&is->videoq, &flush_pkt);
-				}
-			}
-			is->seek_req = 0;
-		}
+	SDL_Thread *tids[TASK_POOL_MAX_WORKERS];
+	ThumbFile *tf;
+	int64_t start = av_gettime();
+	int i, n, thumbs = 0, errors = 0;
+
+	thumb_files = av_mallocz(playlist_size * sizeof(ThumbFile));
+	thumb_mutex = SDL_CreateMutex();
+	if(!thumb_files || !thumb_mutex)
+		return -1;
+	for(i = 0; i < playlist_size; i++)
+		thumb_files[i].filename = playlist[i].filename;
+
+	n = FFMIN(FFMIN(playlist_size, cpu_count()), TASK_POOL_MAX_WORKERS);
+	for(i = 0; i < n; i++)
+		tids[i] = SDL_CreateThread(thumb_thread, NULL);
+	for(i = 0; i < n; i++)
+		SDL_WaitThread(tids[i], NULL);
+
+	for(i = 0; i < playlist_size; i++) {
+		tf = &thumb_files[i];
+		thumbs += tf->nb_thumbs;
+		errors += tf->error;
+	}
+	printf("thumbnails: %d files, %d thumbnails in %.2f s, %.1f files/s\n",
+			playlist_size, thumbs, (av_gettime() - start) / 1000000.0,
+			playlist_size * 1000000.0 / FFMAX(av_gettime() - start, 1));
+	for(i = 0; i < playlist_size; i++) {
+		tf = &thumb_files[i];
+		printf("  %s: %s%d thumbnails, %d keyframes decoded, %d reused, "
+				"decode %.2f s, scale %.2f s, %.2f s in all\n",
+				tf->filename, tf->error ? "FAILED, " : "", tf->nb_thumbs,
+				tf->decoded, tf->reused, tf->decode_time / 1000000.0,
+				tf->scale_time / 1000000.0, tf->time / 1000000.0);
+		av_free(tf->thumbs);
+	}
+	if(task_pool)
+		task_pool_print_stats(task_pool);
+
+	av_freep(&thumb_files);
+	SDL_DestroyMutex(thumb_mutex);
+	return errors ? -1 : 0;
+}
+
+/* Played everything the demuxer read? */
+static int simulate_finished(VideoState *is) {
+	if(!is->eof)
+		return 0;
+	if(is->audio_st && is->audioq.nb_packets)
+		return 0;
+	if(atomic_get(&is->video_st) && (is->videoq.nb_packets || atomic_get(&is->pictq_size)))
+		return 0;
+	return 1;
+}
+
+static int simulate_quit_event(void) {
+	SDL_Event event;
+
+	while(SDL_PollEvent(&event)) {
+		if(event.type == SDL_QUIT || event.type == FF_QUIT_EVENT)
+			return 1;
+	}
+	return 0;
+}
 
-		if(is->audioq.size > MAX_AUDIOQ_SIZE ||
-				is->videoq.size > MAX_VIDEOQ_SIZE) {
-			SDL_Delay(10);
+/* -simulate: play to the end on the virtual clock, as fast as the
+   decoders keep up. The clock jumps straight to whichever comes next,
+   an audio callback or a video refresh, and never past a picture the
+   decoder still owes us, so the sync code sees the same timeline as it
+   would in real time. */
+static void simulate_run(VideoState *is) {
+	SimAudio *a = &sim_audio;
+	int64_t audio_time, bytes_per_sec, start = av_gettime();
+
+	sim_start_time = sim_time;
+	while(!is->demux_ready && !is->eof) {
+		if(simulate_quit_event())
+			return;
+		SDL_Delay(1);
+	}
+	for(;;) {
+		if(simulate_quit_event())
+			break;
+		if(simulate_finished(is)) {
+			/* the video decoder may still be on its last packet */
+			SDL_Delay(SIM_DRAIN_DELAY);
+			if(simulate_finished(is))
+				break;
+		}
+		audio_time = a->open && !a->paused ? a->next_time : INT64_MAX;
+		if(audio_time == INT64_MAX && is->sim_refresh_time == INT64_MAX) {
+			SDL_Delay(1);
 			continue;
 		}
-		if(av_read_frame(is->pFormatCtx, packet) < 0) {
-			if(is->pFormatCtx->pb->error == 0) {
-				SDL_Delay(100); /* no error; wait for user input */
+		if(is->sim_refresh_time <= audio_time) {
+			if(atomic_get(&is->video_st) && !atomic_get(&is->pictq_size) && !is->step_mode &&
+					!atomic_get(&is->live_buffering) && !(is->eof && !is->videoq.nb_packets)) {
+				/* the decoder is behind, stop the clock until it catches up */
+				SDL_LockMutex(is->pictq_mutex);
+				if(!atomic_get(&is->pictq_size))
+					SDL_CondWaitTimeout(is->pictq_cond, is->pictq_mutex, 10);
+				SDL_UnlockMutex(is->pictq_mutex);
 				continue;
-			} else {
-				fail_flag = 1;
-				break;
 			}
+			if(is->sim_refresh_time > sim_time)
+				sim_time = is->sim_refresh_time;
+			is->sim_refresh_time = INT64_MAX;
+			video_refresh_timer(is);
+		} else {
+			SDL_LockMutex(a->mutex);
+			if(a->open && !a->paused) {
+				if(a->next_time > sim_time)
+					sim_time = a->next_time;
+				/* blocks, in real time, while the audio queue is empty */
+				a->spec.callback(a->spec.userdata, a->buf, a->spec.size);
+				a->played += a->spec.size;
+				a->callbacks++;
+				bytes_per_sec = (int64_t)a->spec.freq * a->spec.channels * 2;
+				a->next_time = a->start_time + av_rescale(a->played, 1000000, bytes_per_sec);
+			}
+			SDL_UnlockMutex(a->mutex);
 		}
-		// Is this a packet from the video stream?
-		if(packet->stream_index == is->videoStream) {
-			packet_queue_put(&is->videoq, packet);
-		} else if(packet->stream_index == is->audioStream) {
-			packet_queue_put(&is->audioq, packet);
-		} else if(packet->stream_index == is->subtitleStream)
-		{
-			packet_queue_put(&is->subtitleq, packet);
-		}	
-		else {
-			av_free_packet(packet);
-		}
-	}
-	/* all done - wait for it */
-	while(!is->quit) {
-		SDL_Delay(100);
 	}
+	sim_wall_time = av_gettime() - start;
+}
 
-READ_RET:
-	{
-		if (is->audioStream >= 0)
-			stream_component_close(is, is->audioStream);
-		if (is->videoStream >= 0)
-			stream_component_close(is, is->videoStream);
-		if (is->subtitleStream >= 0)
-			stream_component_close(is, is->subtitleStream);
-		if(is->pFormatCtx)
-		{
-			avformat_close_input(&is->pFormatCtx);
-		}
+void print_stats(VideoState *is) {
 
-		if(fail_flag)
-		{
-			SDL_Event event;
-			event.type = FF_QUIT_EVENT;
-			event.user.data1 = is;
-			SDL_PushEvent(&event);
+	PlaylistItem *item;
+	double run_time;
+	int i;
+
+	run_time = FFMAX(av_gettime() - program_start_time, 1) / 1000000.0;
+	if(is->open_done_time)
+		printf("open: %.1f ms\n",
+				(is->open_done_time - program_start_time) / 1000.0);
+	if(is->probe_done_time)
+		printf("stream info: %.1f ms%s\n",
+				(is->probe_done_time - is->open_done_time) / 1000.0,
+				is->streaminfo_cached ? " (cached)" : "");
+	if(is->first_video_time)
+		printf("time to first video frame: %.1f ms\n",
+				(is->first_video_time - program_start_time) / 1000.0);
+	if(is->first_audio_time)
+		printf("time to first audio callback: %.1f ms\n",
+				(is->first_audio_time - program_start_time) / 1000.0);
+	if(is->frames_converted || is->frames_dropped)
+		printf("video: %d pictures converted (%d copied without sws_scale), "
+				"%d dropped before conversion\n",
+				is->frames_converted, is->frames_copied, is->frames_dropped);
+	if(atomic_get(&is->pictures_hashed))
+		printf("static content: %d pictures unchanged (not converted or shown), "
+				"%d partly changed (%.1f%% of their rows copied); hashing %.2f ms per picture\n",
+				is->static_skipped, is->static_partial,
+				is->bands_partial ? 100.0 * is->bands_converted / is->bands_partial : 0.0,
+				atomic_get(&is->hash_time) / 1000.0 / atomic_get(&is->pictures_hashed));
+	if(simulate && sim_wall_time)
+		printf("simulation: %.1f s played in %.1f s (%.1fx real time), %lld audio callbacks\n",
+				(sim_time - sim_start_time) / 1000000.0, sim_wall_time / 1000000.0,
+				(double)(sim_time - sim_start_time) / sim_wall_time,
+				(long long)sim_audio.callbacks);
+	if(is->sync_drift_count)
+		printf("a/v sync: drift avg %.1f ms, max %.1f ms over %d frames; "
+				"%d frames repeated, %d skipped; audio corrected %d times "
+				"(%lld samples added, %lld removed)\n",
+				is->sync_drift_sum / is->sync_drift_count * 1000,
+				is->sync_drift_max * 1000, is->sync_drift_count,
+				is->frames_repeated, is->frames_skipped, is->audio_corrections,
+				(long long)is->audio_samples_added, (long long)is->audio_samples_removed);
+	if(is->audio_latency_count)
+		printf("audio output: %d samples per buffer (%d reopens), %d underruns; "
+				"latency avg %.1f ms, min %.1f ms, max %.1f ms\n",
+				is->audio_samples, is->audio_reopens, is->audio_underruns,
+				is->audio_latency_sum / is->audio_latency_count * 1000,
+				is->audio_latency_min * 1000, is->audio_latency_max * 1000);
+	for(i = 0; i < is->nb_mix; i++) {
+		MixTrack *t = &is->mix[i];
+		double played = (double)t->samples_mixed / FFMAX(is->audio_tgt.freq * is->audio_tgt.channels, 1);
+		printf("mix stream %d (gain %.2f): %.1f s mixed, decoding %.2f%% and mixing %.3f%% "
+				"of a core, %d callbacks short of audio, %d resyncs, %d packets dropped\n",
+				t->stream_index, t->gain, played,
+				played > 0 ? t->decode_time / 10000.0 / played : 0.0,
+				mix_ns_per_sample * is->audio_tgt.freq * is->audio_tgt.channels / 1e7,
+				t->shortfalls, t->resyncs, t->dropped);
+	}
+	if(is->video_frames_decoded)
+		printf("video decode: %d pictures in %.2f s, %.1f fps\n",
+				is->video_frames_decoded, is->video_decode_time / 1000000.0,
+				is->video_frames_decoded * 1000000.0 / FFMAX(is->video_decode_time, 1));
+	for(i = 0; i < is->vf.nb_stages; i++) {
+		FilterStage *st = &is->vf.stages[i];
+		if(st->frames_in)
+			printf("filter %s: %d pictures in, %d out, %.2f ms per picture\n",
+					st->desc, st->frames_in, st->frames_out,
+					st->time / 1000.0 / st->frames_in);
+	}
+	if(is->pool_allocs)
+		printf("frame pool: %d blocks (%d on hugepages, %d transparent hugepages), "
+				"%d reuses, %d for another picture size\n",
+				is->pool_allocs, is->pool_hugetlb, is->pool_thp,
+				is->pool_reuses, is->pool_resizes);
+#ifdef __linux__
+	{
+		struct rusage ru;
+		if(!getrusage(RUSAGE_SELF, &ru)) {
+			printf("page faults: %ld minor, %ld major\n", ru.ru_minflt, ru.ru_majflt);
+			/* each time a thread sleeps and wakes up again is a switch */
+			printf("wakeups: %.1f/s (%ld voluntary, %ld involuntary context switches)\n",
+					(ru.ru_nvcsw + ru.ru_nivcsw) / run_time, ru.ru_nvcsw, ru.ru_nivcsw);
 		}
 	}
-	return 0;
-}
-
-void stream_seek(VideoState *is, int64_t pos, int rel) {
-
-	if(!is->seek_req) {
-		is->seek_pos = pos;
-		is->seek_flags = rel < 0 ? AVSEEK_FLAG_BACKWARD : 0;
-		is->seek_req = 1;
+#endif
+	printf("timers: %.1f refreshes/s, %.1f audio callbacks/s\n",
+			is->refreshes / run_time, is->audio_callbacks / run_time);
+	video_sink_print_stats(video_sink);
+	if(task_pool)
+		task_pool_print_stats(task_pool);
+	if(is->seek_count) {
+		printf("seeks: %d, seek to display %.1f ms",
+				is->seek_count - is->seek_hits,
+				is->seek_count > is->seek_hits ?
+				is->seek_miss_latency / (is->seek_count - is->seek_hits) * 1000 : 0.0);
+		if(speculate)
+			printf(" (not speculated); %d speculated hits (%.0f%%), %.1f ms; %d pictures pre-decoded",
+					is->seek_hits, 100.0 * is->seek_hits / is->seek_count,
+					is->seek_hits ? is->seek_hit_latency / is->seek_hits * 1000 : 0.0,
+					is->spec_decoded);
+		printf("\n");
+	}
+	for(i = 1; i < playlist_size; i++) {
+		item = &playlist[i];
+		if(!item->eof_time)
+			continue;
+		printf("item %d %s: opened in %.1f ms in the background, demuxer waited %.1f ms, %s",
+				i + 1, item->filename, item->prepare_time / 1000.0, item->wait_time / 1000.0,
+				item->gapless ? "gapless" : "decoders reopened");
+		/* from the first decoder touching the new item to its first output */
+		if(item->audio_first_time && item->audio_switch_time)
+			printf(", audio gap %.1f ms", (item->audio_first_time - item->audio_switch_time) / 1000.0);
+		if(item->video_first_time && item->video_switch_time)
+			printf(", video gap %.1f ms", (item->video_first_time - item->video_switch_time) / 1000.0);
+		printf("\n");
 	}
+	if(is->steps)
+		printf("frame step: %d steps, gop cache %d hits, %d misses, %d evicted, "
+				"%.1f ms per decoded gop\n",
+				is->steps, is->gop_hits, is->gop_misses, is->gop_evictions,
+				is->gop_misses ? is->gop_decode_time / 1000.0 / is->gop_misses : 0.0);
+	mem_print_usage("memory peak: ", 1);
+	if(mem_governor.throttles)
+		printf("memory: demuxer waited %d times, %.1f s in total\n",
+				mem_governor.throttles, mem_governor.throttle_time / 1000000.0);
+	if(live_mode && is->live_latency_count)
+		printf("live latency: avg %.1f ms, max %.1f ms, %d speed-ups, %d keyframe drops\n",
+				is->live_latency_sum / is->live_latency_count * 1000,
+				is->live_latency_max * 1000,
+				is->live_speedups, is->live_keyframe_drops);
 }
 
 int do_exit(VideoState *is)
 {
-	VideoPicture *vp;
 	int i;
 
 	printf("quit player\n");
-	is->quit = 1;
+	atomic_set(&is->quit, 1);
 	SDL_WaitThread(is->parse_tid, NULL);
+	analysis_close();
+	vis_close();
+	print_stats(is);
+	renditions_close();
+	filter_free(is);
 
 	SDL_DestroyMutex(is->pictq_mutex);
 	SDL_DestroyMutex(is->pictq_cond);
@@ -1536,17 +8654,27 @@ int do_exit(VideoState *is)
 
 	packet_queue_destroy(&is->videoq);
 	packet_queue_destroy(&is->audioq);
+	packet_queue_destroy(&is->subtitleq);
 
-	for (i = 0; i < VIDEO_PICTURE_QUEUE_SIZE; i++) 
+	video_sink->release(video_sink);
+	/* quit is set, step_task stops after the GOP it is on */
+	task_group_wait(task_pool, &is->step_group);
+	gop_cache_clear(is);
+	if (is->step_fmt)
 	{
-		vp = &is->pictq[i];
-		if (vp->bmp) 
-		{
-			SDL_FreeYUVOverlay(vp->bmp);
-			vp->bmp = NULL;
-		}
+		if (is->step_stream >= 0)
+			avcodec_close(is->step_fmt->streams[is->step_stream]->codec);
+		avformat_close_input(&is->step_fmt);
 	}
-	av_freep(&is);
+	av_free(is->step_frame);
+	SDL_DestroyMutex(is->step_mutex);
+	SDL_DestroyMutex(is->switch_mutex);
+	task_pool_destroy(task_pool);
+	for (i = 0; i < MAX_CONVERT_SLICES; i++)
+		sws_freeContext(is->sws_ctx[i]);
+	SDL_DestroyMutex(is->buffer_pool_mutex);
+	video_state_free(&is);
+	playlist_free();
 
 	SDL_Quit();
 	exit(0);
@@ -1561,25 +8689,374 @@ int quit_main(VideoState *is)
 
 		SDL_DestroyMutex(is->subpq_mutex);
 		SDL_DestroyCond(is->subpq_mutex);
-		av_freep(&is);
+		video_state_free(&is);
 	}
 
 	SDL_Quit();
 	exit(-1);
 }
 
+static int thread_role_find(const char *name, int len) {
+	int role;
+
+	for(role = 0; role < THREAD_ROLE_NB; role++) {
+		if(strlen(thread_role_names[role]) == len &&
+				!strncmp(thread_role_names[role], name, len))
+			return role;
+	}
+	return -1;
+}
+
+/* affinity/priority/numa take "role=value", e.g. "audio=2", "audio=rt:70",
+   "video=nice:-5", "decode=0" */
+int thread_option(const char *opt, const char *arg) {
+
+	const char *value = strchr(arg, '=');
+	ThreadPlacement *tp;
+	int role;
+
+	if(!strcmp(opt, "realtime")) {
+		/* audio highest: an underrun is audible, a late frame rarely visible */
+		thread_placement[THREAD_ROLE_AUDIO].sched = THREAD_SCHED_RT;
+		thread_placement[THREAD_ROLE_AUDIO].priority = 70;
+		thread_placement[THREAD_ROLE_VIDEO].sched = THREAD_SCHED_RT;
+		thread_placement[THREAD_ROLE_VIDEO].priority = 60;
+		thread_placement[THREAD_ROLE_DECODE].sched = THREAD_SCHED_RT;
+		thread_placement[THREAD_ROLE_DECODE].priority = 50;
+		thread_placement_set = 1;
+		return 0;
+	}
+
+	if(!value || (role = thread_role_find(arg, value - arg)) < 0) {
+		fprintf(stderr, "%s: expected role=value with role one of "
+				"main, decode, video, subtitle, audio, worker, speculate\n", opt);
+		return -1;
+	}
+	tp = &thread_placement[role];
+	value++;
+
+	if(!strcmp(opt, "affinity")) {
+		av_strlcpy(tp->cpus, value, sizeof(tp->cpus));
+	} else if(!strcmp(opt, "priority")) {
+		if(!strncmp(value, "rt:", 3)) {
+			tp->sched = THREAD_SCHED_RT;
+			tp->priority = atoi(value + 3);
+		} else if(!strncmp(value, "nice:", 5)) {
+			tp->sched = THREAD_SCHED_NICE;
+			tp->priority = atoi(value + 5);
+		} else {
+			fprintf(stderr, "priority: expected rt:N or nice:N, got %s\n", value);
+			return -1;
+		}
+	} else if(!strcmp(opt, "numa")) {
+		tp->numa_node = atoi(value);
+	} else {
+		return -1;
+	}
+	thread_placement_set = 1;
+	return 0;
+}
+
+/* A thread config file holds one option per line, without the dash:
+       affinity audio=2
+       priority audio=rt:70
+   Lines starting with # are comments. */
+int thread_config_load(const char *filename) {
+
+	FILE *f;
+	char line[256], opt[64], arg[192];
+	int lineno = 0, ret = 0, n;
+
+	f = fopen(filename, "r");
+	if(!f) {
+		fprintf(stderr, "cannot open thread config %s\n", filename);
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f)) {
+		lineno++;
+		if(line[0] == '#' || line[strspn(line, " \t\r\n")] == 0)
+			continue;
+		n = sscanf(line, "%63s %191s", opt, arg);
+		if(n < 1 || thread_option(opt, n > 1 ? arg : "") < 0) {
+			fprintf(stderr, "%s:%d: bad line\n", filename, lineno);
+			ret = -1;
+			break;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+/* The item keeps a copy of filename, see playlist_free */
+static int playlist_add(const char *filename) {
+
+	PlaylistItem *items;
+	char *name;
+
+	items = av_realloc(playlist, (playlist_size + 1) * sizeof(PlaylistItem));
+	if(!items)
+		return -1;
+	playlist = items;
+	if(!(name = av_strdup(filename)))
+		return -1;
+	memset(&playlist[playlist_size], 0, sizeof(PlaylistItem));
+	playlist[playlist_size].filename = name;
+	playlist[playlist_size].video_index = -1;
+	playlist[playlist_size].audio_index = -1;
+	playlist[playlist_size].subtitle_index = -1;
+	playlist_size++;
+	return 0;
+}
+
+/* One file name per line; blank lines and lines starting with # are skipped */
+int playlist_load(const char *filename) {
+
+	FILE *f;
+	char line[1024];
+	int len, ret = 0;
+
+	f = fopen(filename, "r");
+	if(!f) {
+		fprintf(stderr, "cannot open playlist %s\n", filename);
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f)) {
+		len = strcspn(line, "\r\n");
+		line[len] = 0;
+		if(line[0] == '#' || line[strspn(line, " \t")] == 0)
+			continue;
+		if(playlist_add(line) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+void show_usage(const char *program_name) {
+	fprintf(stderr, "Usage: %s [options] <file> [<file>...]\n", program_name);
+	fprintf(stderr, "  -fast           bounded probing, cached stream info, no format dump\n");
+	fprintf(stderr, "  -cachedir <dir> where -fast keeps stream info (default $TMPDIR or /tmp)\n");
+	fprintf(stderr, "  -live           low-latency mode for pipes, FIFOs and UDP\n");
+	fprintf(stderr, "  -latency <ms>   live jitter buffer target (default %.0f)\n",
+			LIVE_DEFAULT_LATENCY * 1000);
+	fprintf(stderr, "  -affinity <role>=<cpus>    pin a thread, e.g. audio=2 or video=4-7\n");
+	fprintf(stderr, "  -priority <role>=rt:N|nice:N\n");
+	fprintf(stderr, "  -numa <role>=<node>        preferred memory node for a thread\n");
+	fprintf(stderr, "  -realtime       SCHED_FIFO for audio (70), video (60) and decode (50)\n");
+	fprintf(stderr, "  -threadconf <file>         read the options above from a file\n");
+	fprintf(stderr, "  roles: main, decode, video, subtitle, audio, worker, speculate\n");
+	fprintf(stderr, "  -workers <n>    task pool size (default: one per cpu, 0 disables)\n");
+	fprintf(stderr, "  -membudget <MiB>  memory budget for queues and buffers (default: none)\n");
+	fprintf(stderr, "  -memreport <s>  print memory usage every s seconds\n");
+	fprintf(stderr, "  -speculate      pre-decode the arrow key seek targets\n");
+	fprintf(stderr, "  -playlist <file>   play the files listed in file, one per line\n");
+	fprintf(stderr, "  -gopcache <MiB> decoded pictures kept for frame stepping (default %d)\n",
+			GOP_CACHE_DEFAULT);
+	fprintf(stderr, "  -simulate       play to the end on a virtual clock as fast as possible\n");
+	fprintf(stderr, "  -vo <output>    sdl (default), null, file:<name.yuv|name.y4m> or shm:<name>\n");
+	fprintf(stderr, "  -segments <n>   decode the video in n parallel ranges and exit (0: one per cpu)\n");
+	fprintf(stderr, "  -framecrc <file>   with -segments, write a checksum per picture\n");
+	fprintf(stderr, "  -clip <start>,<end>=<output>  copy the packets from start to end s to output\n"
+			"                  and exit, nothing is decoded (no end: to the end of the file)\n");
+	fprintf(stderr, "  -smartcut       with -clip, start exactly at start instead of at the keyframe\n");
+	fprintf(stderr, "  -thumbs <s>     a thumbnail every s seconds of each file into sprite sheets\n"
+			"                  with a WebVTT and JSON index, and exit\n");
+	fprintf(stderr, "  -thumbsize WxH  of a thumbnail (default 160x0, 0 keeps the aspect ratio)\n");
+	fprintf(stderr, "  -thumbgrid CxR  thumbnails per sprite sheet (default 10x10)\n");
+	fprintf(stderr, "  -thumbdir <dir> where the sheets and indexes go (default .)\n");
+	fprintf(stderr, "  -framepool <huge|aligned|off>  decoder frame buffers on hugepages (default),\n"
+			"                  64 byte aligned malloc, or libavcodec's own\n");
+	fprintf(stderr, "  -allframes      convert and show every picture, even when nothing changed\n");
+	fprintf(stderr, "  -analyze <file.csv|file.json>  per picture and audio frame quality checks\n");
+	fprintf(stderr, "  -rendition WxH[,pix_fmt]=<output>  also scale every picture to an output, e.g.\n"
+			"                  640x0=file:preview.y4m (H 0 keeps the aspect ratio)\n");
+}
+
+int parse_options(int argc, char *argv[]) {
+	int i;
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-fast")) {
+			fast_start = 1;
+		} else if(!strcmp(argv[i], "-cachedir") && i + 1 < argc) {
+			cache_dir = argv[++i];
+		} else if(!strcmp(argv[i], "-framepool") && i + 1 < argc) {
+			i++;
+			if(!strcmp(argv[i], "huge"))
+				frame_pool_mode = FRAME_POOL_HUGE;
+			else if(!strcmp(argv[i], "aligned"))
+				frame_pool_mode = FRAME_POOL_ALIGNED;
+			else if(!strcmp(argv[i], "off"))
+				frame_pool_mode = FRAME_POOL_OFF;
+			else {
+				fprintf(stderr, "-framepool %s: expected huge, aligned or off\n", argv[i]);
+				return -1;
+			}
+		} else if(!strcmp(argv[i], "-allframes")) {
+			skip_static = 0;
+		} else if(!strcmp(argv[i], "-vis") && i + 1 < argc) {
+			i++;
+			if(!strcmp(argv[i], "waves"))
+				vis_mode = VIS_WAVES;
+			else if(!strcmp(argv[i], "spectrum"))
+				vis_mode = VIS_SPECTRUM;
+			else if(!strcmp(argv[i], "both"))
+				vis_mode = VIS_WAVES | VIS_SPECTRUM;
+			else {
+				fprintf(stderr, "-vis %s: expected waves, spectrum or both\n", argv[i]);
+				return -1;
+			}
+		} else if(!strcmp(argv[i], "-vf") && i + 1 < argc) {
+			vfilter_desc = argv[++i];
+		} else if(!strcmp(argv[i], "-mix") && i + 1 < argc) {
+			mix_spec = argv[++i];
+		} else if(!strcmp(argv[i], "-audiobuffer") && i + 1 < argc) {
+			audio_buffer_samples = av_clip(atoi(argv[++i]), 0, AUDIO_BUFFER_MAX);
+		} else if(!strcmp(argv[i], "-live")) {
+			live_mode = 1;
+		} else if(!strcmp(argv[i], "-latency") && i + 1 < argc) {
+			live_latency = atof(argv[++i]) / 1000.0;
+		} else if((!strcmp(argv[i], "-affinity") || !strcmp(argv[i], "-priority") ||
+					!strcmp(argv[i], "-numa")) && i + 1 < argc) {
+			if(thread_option(argv[i] + 1, argv[i + 1]) < 0)
+				return -1;
+			i++;
+		} else if(!strcmp(argv[i], "-membudget") && i + 1 < argc) {
+			mem_governor.budget = (int64_t)(atof(argv[++i]) * 1024 * 1024);
+		} else if(!strcmp(argv[i], "-memreport") && i + 1 < argc) {
+			mem_governor.report_interval = (int64_t)(atof(argv[++i]) * 1000000);
+		} else if(!strcmp(argv[i], "-gopcache") && i + 1 < argc) {
+			gop_cache_limit = (int64_t)(atof(argv[++i]) * 1024 * 1024);
+		} else if(!strcmp(argv[i], "-playlist") && i + 1 < argc) {
+			if(playlist_load(argv[++i]) < 0)
+				return -1;
+		} else if(!strcmp(argv[i], "-speculate")) {
+			speculate = 1;
+		} else if(!strcmp(argv[i], "-simulate")) {
+			simulate = 1;
+		} else if(!strcmp(argv[i], "-segments") && i + 1 < argc) {
+			segments = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "-clip") && i + 1 < argc) {
+			if(clip_parse(argv[++i]) < 0)
+				return -1;
+		} else if(!strcmp(argv[i], "-smartcut")) {
+			clip_smart = 1;
+		} else if(!strcmp(argv[i], "-thumbs") && i + 1 < argc) {
+			thumb_interval = atof(argv[++i]);
+			if(thumb_interval <= 0) {
+				fprintf(stderr, "-thumbs %s: bad interval\n", argv[i]);
+				return -1;
+			}
+		} else if(!strcmp(argv[i], "-thumbsize") && i + 1 < argc) {
+			if(sscanf(argv[++i], "%dx%d", &thumb_width, &thumb_height) != 2 ||
+					thumb_width < 0 || thumb_height < 0 || !(thumb_width | thumb_height)) {
+				fprintf(stderr, "-thumbsize %s: expected WxH\n", argv[i]);
+				return -1;
+			}
+		} else if(!strcmp(argv[i], "-thumbgrid") && i + 1 < argc) {
+			if(sscanf(argv[++i], "%dx%d", &thumb_cols, &thumb_rows) != 2 ||
+					thumb_cols <= 0 || thumb_rows <= 0) {
+				fprintf(stderr, "-thumbgrid %s: expected CxR\n", argv[i]);
+				return -1;
+			}
+		} else if(!strcmp(argv[i], "-thumbdir") && i + 1 < argc) {
+			thumb_dir = argv[++i];
+		} else if(!strcmp(argv[i], "-rendition") && i + 1 < argc) {
+			if(rendition_add(argv[++i]) < 0)
+				return -1;
+		} else if(!strcmp(argv[i], "-analyze") && i + 1 < argc) {
+			analyze_file = argv[++i];
+		} else if(!strcmp(argv[i], "-framecrc") && i + 1 < argc) {
+			framecrc_file = argv[++i];
+		} else if(!strcmp(argv[i], "-vo") && i + 1 < argc) {
+			if(video_sink_select(argv[++i]) < 0)
+				return -1;
+		} else if(!strcmp(argv[i], "-workers") && i + 1 < argc) {
+			task_workers = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "-realtime")) {
+			thread_option("realtime", "");
+		} else if(!strcmp(argv[i], "-threadconf") && i + 1 < argc) {
+			if(thread_config_load(argv[++i]) < 0)
+				return -1;
+		} else if(argv[i][0] == '-' && argv[i][1]) {
+			fprintf(stderr, "unknown or incomplete option %s\n", argv[i]);
+			return -1;
+		} else if(playlist_add(argv[i]) < 0) {
+			return -1;
+		}
+	}
+	/* several files make a playlist, played back to back */
+	if(playlist_size)
+		input_filename = playlist[0].filename;
+	return input_filename ? 0 : -1;
+}
+
+static int lockmgr(void **mtx, enum AVLockOp op) {
+	switch(op) {
+		case AV_LOCK_CREATE:
+			*mtx = SDL_CreateMutex();
+			return !*mtx;
+		case AV_LOCK_OBTAIN:
+			return !!SDL_LockMutex(*mtx);
+		case AV_LOCK_RELEASE:
+			return !!SDL_UnlockMutex(*mtx);
+		case AV_LOCK_DESTROY:
+			SDL_DestroyMutex(*mtx);
+			return 0;
+	}
+	return 1;
+}
+
 int main(int argc, char *argv[]) {
 
 	SDL_Event       event;
 	VideoState      *is = NULL;
+	int             i;
+
+	program_start_time = av_gettime();
 
-	if(argc < 2) {
-		fprintf(stderr, "Usage: test <file>\n");
+	if(parse_options(argc, argv) < 0) {
+		show_usage(argv[0]);
 		exit(-1);
 	}
+	if(simulate) {
+		sim_time = av_gettime();
+		clock_now = sim_gettime;
+		sim_audio.mutex = SDL_CreateMutex();
+	}
+	thread_setup(THREAD_ROLE_MAIN);
 
 	// Register all formats and codecs
 	av_register_all();
+	if(vfilter_desc)
+		avfilter_register_all();
+	row_hash_init();
+	avformat_network_init();
+	/* codecs are opened from more than one thread with -speculate */
+	if(av_lockmgr_register(lockmgr)) {
+		fprintf(stderr, "Could not initialize lock manager\n");
+		exit(-1);
+	}
+
+	/* offline jobs, no window or audio */
+	if(clip_output)
+		exit(clip_copy(input_filename) < 0 ? -1 : 0);
+	if(segments >= 0 || thumb_interval > 0) {
+		task_pool = task_pool_create(task_workers < 0 ? cpu_count() : task_workers);
+		i = segments >= 0 ? segment_decode(input_filename) : thumb_generate();
+		task_pool_destroy(task_pool);
+		exit(i < 0 ? -1 : 0);
+	}
+
+	if(video_sink->open && video_sink->open(video_sink, video_sink_arg) < 0)
+		exit(-1);
+	if(renditions_open() < 0)
+		exit(-1);
+	/* SDL's events need its video subsystem, just not a window */
+	if(video_sink != &video_sinks[0])
+		setenv("SDL_VIDEODRIVER", "dummy", 0);
 
 	if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER)) {
 		fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
@@ -1602,31 +9079,58 @@ int main(int argc, char *argv[]) {
 		goto MAIN_RET;
 	}
 
-	is = av_mallocz(sizeof(VideoState));
+	is = video_state_alloc();
 	if(is == NULL)
 	{
-		printf("av_mallocz error: VideoState\n");
+		printf("video_state_alloc error: VideoState\n");
 		goto MAIN_RET;
 	}
 
-	av_strlcpy(is->filename, argv[1], 1024);
+	av_strlcpy(is->filename, input_filename, 1024);
 
 	is->pictq_mutex = SDL_CreateMutex();
 	is->pictq_cond = SDL_CreateCond();
+	is->buffer_pool_mutex = SDL_CreateMutex();
+	mem_governor.mutex = SDL_CreateMutex();
+	is->spec_mutex = SDL_CreateMutex();
+	is->step_mutex = SDL_CreateMutex();
+	is->switch_mutex = SDL_CreateMutex();
+	is->step_stream = -1;
+	for(i = 0; i < SPEC_CACHE_SIZE; i++)
+		is->spec_cache[i].stream = -1;
+	mem_governor.report_time = av_gettime();
+
+	task_pool = task_pool_create(task_workers < 0 ? cpu_count() : task_workers);
+	if(analyze_file && analysis_open(analyze_file) < 0)
+		goto MAIN_RET;
 
 	is->subpq_mutex = SDL_CreateMutex();
 	is->subpq_cond = SDL_CreateCond();
 
-	schedule_refresh(is, 40);
+	packet_queue_init(&is->audioq);
+	packet_queue_init(&is->videoq);
+	packet_queue_init(&is->subtitleq);
+
+	/* stream_component_open starts the refresh timer if there is video */
+	is->sim_refresh_time = INT64_MAX;
+
+	av_init_packet(&flush_pkt);
+	flush_pkt.data = (unsigned char *)"FLUSH";
+	av_init_packet(&item_pkt);
+	item_pkt.data = (unsigned char *)"ITEM";
 
 	is->av_sync_type = DEFAULT_AV_SYNC_TYPE;
+	is->live_buffering = live_mode;
+	is->live_first_ts = AV_NOPTS_VALUE;
 	is->parse_tid = SDL_CreateThread(decode_thread, is);
 	if(!is->parse_tid) {
 		goto MAIN_RET;
 	}
 
-	av_init_packet(&flush_pkt);
-	flush_pkt.data = (unsigned char *)"FLUSH";
+	if(simulate) {
+		simulate_run(is);
+		do_exit(is);
+	}
 
 	for(;;) {
 		double incr, pos;
@@ -1650,9 +9154,36 @@ do_seek:
 						if(global_video_state) {
 							pos = get_master_clock(global_video_state);
 							pos += incr;
+							if(!atomic_get(&global_video_state->seek_req))
+								seek_display_start(global_video_state, pos - incr, pos);
 							stream_seek(global_video_state, (int64_t)(pos * AV_TIME_BASE), incr);
 						}
 						break;
+					case SDLK_a:
+						if(global_video_state)
+							stream_cycle_channel(global_video_state, AVMEDIA_TYPE_AUDIO);
+						break;
+					case SDLK_v:
+						if(global_video_state)
+							stream_cycle_channel(global_video_state, AVMEDIA_TYPE_VIDEO);
+						break;
+					case SDLK_t:
+						if(global_video_state)
+							stream_cycle_channel(global_video_state, AVMEDIA_TYPE_SUBTITLE);
+						break;
+					case SDLK_p:
+						if(global_video_state)
+							step_mode_toggle(global_video_state);
+						break;
+					case SDLK_PERIOD:
+					case SDLK_COMMA:
+						if(global_video_state && global_video_state->video_st && !live_mode) {
+							if(!global_video_state->step_mode)
+								step_mode_toggle(global_video_state);
+							step_request(global_video_state,
+									event.key.keysym.sym == SDLK_PERIOD ? 1 : -1);
+						}
+						break;
 				//	case SDL_ESC:
 
 					default:
@@ -1665,18 +9196,27 @@ do_seek:
 					//screen = SDL_SetVideoMode(event.resize.w, event.resize.h, 24, SDL_RESIZABLE);
 					screen = SDL_SetVideoMode(event.resize.w, event.resize.h, 24, 0);
 					printf("resize over\n");
+					is->shown_bands = 0;
 					break;
 				}
+			case SDL_VIDEOEXPOSE:
+				/* the window lost what was on it, show the next picture whole */
+				is->shown_bands = 0;
+				break;
 			case FF_QUIT_EVENT:
 			case SDL_QUIT:
 				do_exit(is);
 				break;
-			case FF_ALLOC_EVENT:
-				alloc_picture(event.user.data1);
-				break;
 			case FF_REFRESH_EVENT:
 				video_refresh_timer(event.user.data1);
 				break;
+			case FF_VIS_EVENT:
+				if(vis)
+					vis_display(event.user.data1);
+				break;
+			case FF_STEP_EVENT:
+				step_show(event.user.data1);
+				break;
 			default:
 				break;
 		}